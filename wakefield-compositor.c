@@ -22,40 +22,391 @@
 
 #include "wakefield-compositor.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 #include <wayland-server.h>
+#include <xkbcommon/xkbcommon.h>
+
+#ifdef GDK_WINDOWING_X11
+#include <gdk/gdkx.h>
+#include <X11/Xlib-xcb.h>
+#include <X11/extensions/XInput2.h>
+#include <xkbcommon/xkbcommon-x11.h>
+#endif
+
+#include "input-timestamps-unstable-v1-server-protocol.h"
+#include "pointer-constraints-unstable-v1-server-protocol.h"
+#include "presentation-time-server-protocol.h"
+#include "relative-pointer-unstable-v1-server-protocol.h"
+#include "viewporter-server-protocol.h"
 
 struct WakefieldPointer
 {
   struct wl_list resource_list;
-  struct wl_resource *cursor_surface;
+
+  /* The surface the pointer is over, if any, and the serial of the
+   * enter event we sent for it. */
+  struct WakefieldSurface *focus;
+  uint32_t enter_serial;
+
+  /* Where the pointer is on the focus surface, and the constraint
+   * we're enforcing there, if any. */
+  double x, y;
+  struct WakefieldPointerConstraint *constraint;
+
+  /* Wheel scrolling short of a whole notch, in 120ths of one, for
+   * clients too old for wl_pointer.axis_value120. */
+  int32_t value120_remainder[2];
+
+  /* The surface the client set as its cursor, if any, and the
+   * hotspot within it. */
+  struct WakefieldSurface *cursor_surface;
+  int hotspot_x, hotspot_y;
+
+  /* GdkCursors made from the cursor surface's recent contents, most
+   * recently used first, so animated cursors don't make new ones for
+   * every frame. */
+  struct wl_list cursor_cache;
+  int cursor_cache_size;
+
+  /* zwp_input_timestamps_v1 and zwp_relative_pointer_v1 objects for
+   * our wl_pointers, each with the wl_pointer it's for as user data, or
+   * NULL once that's gone. */
+  struct wl_list timestamps_list;
+  struct wl_list relative_list;
+};
+
+struct WakefieldKeyboard
+{
+  struct wl_list resource_list;
+
+  /* Whether GTK gave us the focus, the surface we gave it to, if any,
+   * and the keys held down on it, as evdev keycodes. */
+  gboolean has_focus;
+  struct WakefieldSurface *focus;
+  struct wl_array keys;
+
+  /* The modifiers clients were last told about. */
+  uint32_t mods_depressed, mods_latched, mods_locked, group;
+
+  /* The keymap, serialized once into a sealed memfd that every client
+   * maps, or -1 if we couldn't make one. */
+  int keymap_fd;
+  uint32_t keymap_size;
+
+  /* Only touched by GTK: the state it works modifiers out with, and
+   * which of them are locks, like Caps Lock and Num Lock. */
+  struct xkb_keymap *keymap;
+  struct xkb_state *xkb_state;
+  xkb_mod_mask_t lock_mods;
+
+  /* zwp_input_timestamps_v1 objects for our wl_keyboards, with the
+   * wl_keyboard as user data, or NULL once that's gone. */
+  struct wl_list timestamps_list;
+};
+
+struct WakefieldTouchPoint
+{
+  int32_t id;
+
+  /* NULL once the surface is gone, or its client had the touch
+   * cancelled, which leaves it with no point of its own. */
+  struct WakefieldSurface *surface;
+};
+
+struct WakefieldTouch
+{
+  struct wl_list resource_list;
+
+  /* The WakefieldTouchPoints down, and the clients we sent events to
+   * since the last wl_touch.frame. */
+  GArray *points;
+  GPtrArray *frame_clients;
+
+  /* zwp_input_timestamps_v1 objects for our wl_touches, with the
+   * wl_touch as user data, or NULL once that's gone. */
+  struct wl_list timestamps_list;
 };
 
 struct WakefieldSeat
 {
+  WakefieldCompositor *compositor;
   struct WakefieldPointer pointer;
-  /* struct WakefieldKeyboard keyboard; */
+  struct WakefieldKeyboard keyboard;
+  struct WakefieldTouch touch;
+};
+
+struct WakefieldBuffer
+{
+  struct wl_resource *resource;
+  struct wl_listener destroy_listener;
+  struct wl_signal destroy_signal;
+
+  /* Whether the client is waiting for a wl_buffer.release. */
+  gboolean busy;
+
+  /* The shm metadata is fixed for the lifetime of a wl_buffer, but
+   * the data pointer can move if the client resizes the pool, so
+   * we remember it to know when our cairo wrapper is stale. */
+  const struct WakefieldFormat *format;
+  int32_t width, height, stride;
+  void *data;
+
+  cairo_surface_t *cr_surface;
 };
 
 struct WakefieldSurfacePendingState
 {
-  struct wl_resource *buffer;
+  /* Cleared if the client destroys the buffer under us. */
+  struct WakefieldBuffer *buffer;
+  struct wl_listener buffer_destroy_listener;
+  gboolean newly_attached;
+
   int scale;
 
+  /* An enum wl_output_transform, or -1 in the pending state if the
+   * client didn't set a new one. */
+  int transform;
+
+  /* In surface coordinates. For the current state, this is the
+   * damage committed since we last painted. */
+  cairo_region_t *damage;
+
+  /* From wl_surface.damage_buffer, in buffer coordinates. For the
+   * current state, this is all of the damage committed since we last
+   * painted, in the pixels of the surface's contents, which is to say
+   * with the buffer transform applied. */
+  cairo_region_t *buffer_damage;
+
+  /* In surface coordinates. NULL in the pending state means the
+   * client didn't set a new one. */
+  cairo_region_t *opaque_region;
+
+  /* From wp_viewport: the part of the buffer to show, in surface
+   * coordinates as they'd be without a viewport, and the size to show
+   * it at. A width of -1 means unset. The pending state always holds
+   * what the client asked for last. */
+  double src_x, src_y, src_width, src_height;
+  int dst_width, dst_height;
+
+  /* In surface coordinates. NULL in the pending state means the
+   * client didn't set a new one; an unset one covers everything. */
   cairo_region_t *input_region;
+
   struct wl_list frame_callbacks;
+  struct wl_list feedback_list;
 };
 
+struct WakefieldSubsurface
+{
+  struct wl_resource *resource;
+
+  /* The surface this is the role of, and the one it's attached to.
+   * The latter is cleared if the parent goes away. */
+  struct WakefieldSurface *surface;
+  struct WakefieldSurface *parent;
+
+  /* In the parent's stacking order, as shown and as the client last
+   * asked for it. */
+  struct wl_list parent_link;
+  struct wl_list parent_link_pending;
+
+  /* Relative to the parent, in its surface coordinates. */
+  int x, y;
+  int pending_x, pending_y;
+  gboolean has_pending_position;
+
+  gboolean synchronized;
+
+  /* In synchronized mode, what the client committed, waiting for the
+   * parent's next commit. */
+  struct WakefieldSurfacePendingState cached;
+  gboolean has_cache;
+};
+
+/* Enough for the backing stores of the scene GTK shows and the one
+ * it's about to take, along with the one we're writing to. */
+#define N_SPARE_BACKINGS 2
+
 struct WakefieldSurface
 {
   WakefieldCompositor *compositor;
 
   struct wl_resource *resource;
+  struct wl_list link;
+
+  /* Names the surface in messages from the GTK side, which in
+   * threaded mode only ever sees copies of it. */
+  guint32 id;
 
-  cairo_region_t *damage;
   struct WakefieldSurfacePendingState pending, current;
+
+  struct wl_resource *viewport;
+
+  /* Our wl_subsurface role, if we have one. */
+  struct WakefieldSubsurface *subsurface;
+
+  /* The pointer constraint the client asked for on us, if any. */
+  struct WakefieldPointerConstraint *constraint;
+
+  /* Our subsurfaces, bottom to top, with self standing in for us, as
+   * shown and as the client last stacked them. */
+  struct WakefieldSubsurface self;
+  struct wl_list subsurfaces;
+  struct wl_list subsurfaces_pending;
+  gboolean restacked;
+
+  /* In copy-on-commit mode, or when the buffer needs converting or
+   * transforming, a compositor-owned copy of the committed contents,
+   * at buffer size, which we paint from instead of the client's
+   * buffer. */
+  cairo_surface_t *backing;
+
+  /* In threaded mode, older backing stores we take turns with while
+   * scenes still show them, each with the damage, in content pixels,
+   * it missed since it was the backing store. */
+  cairo_surface_t *spare_backing[N_SPARE_BACKINGS];
+  cairo_region_t *spare_damage[N_SPARE_BACKINGS];
+
+  /* Whether the backing store is still laid out for a transform or
+   * viewport we no longer have, for want of a buffer to redo it from,
+   * so the next buffer has to redo all of it. */
+  gboolean backing_outdated;
+
+  /* When the contents are shown at a different size, the resampled
+   * copy we paint, along with the part of them it was made from, and
+   * the damage, in content pixels, it missed while it was covered. */
+  cairo_surface_t *scaled;
+  cairo_rectangle_int_t scaled_src;
+  cairo_region_t *scaled_damage;
+};
+
+/* The pointer constraint GTK is to enforce: the surface it's on, and
+ * when bounded, the extents of its region, in surface coordinates. */
+typedef enum
+{
+  WAKEFIELD_CONSTRAINT_NONE,
+  WAKEFIELD_CONSTRAINT_LOCK,
+  WAKEFIELD_CONSTRAINT_CONFINE,
+} WakefieldConstraintKind;
+
+struct WakefieldConstraintState
+{
+  WakefieldConstraintKind kind;
+  guint32 surface_id;
+  gboolean bounded;
+  cairo_rectangle_int_t rect;
+};
+
+/* What the GTK side tells the Wayland side: input, and what became of
+ * the frames it showed. In threaded mode, these go through a queue to
+ * the dispatch thread. */
+typedef enum
+{
+  WAKEFIELD_MESSAGE_POINTER_ENTER,
+  WAKEFIELD_MESSAGE_POINTER_MOTION,
+  WAKEFIELD_MESSAGE_POINTER_LEAVE,
+  WAKEFIELD_MESSAGE_POINTER_BUTTON,
+  WAKEFIELD_MESSAGE_POINTER_AXIS,
+  WAKEFIELD_MESSAGE_KEYBOARD_ENTER,
+  WAKEFIELD_MESSAGE_KEYBOARD_LEAVE,
+  WAKEFIELD_MESSAGE_KEYBOARD_KEY,
+  WAKEFIELD_MESSAGE_TOUCH_DOWN,
+  WAKEFIELD_MESSAGE_TOUCH_MOTION,
+  WAKEFIELD_MESSAGE_TOUCH_UP,
+  WAKEFIELD_MESSAGE_TOUCH_CANCEL,
+  WAKEFIELD_MESSAGE_TOUCH_FRAME,
+  WAKEFIELD_MESSAGE_FRAME,
+  WAKEFIELD_MESSAGE_PRESENTED,
+  WAKEFIELD_MESSAGE_DISCARDED,
+  WAKEFIELD_MESSAGE_OUTPUT_SCALE,
+} WakefieldMessageType;
+
+struct WakefieldMessage
+{
+  WakefieldMessageType type;
+
+  /* In milliseconds, for input and frame callbacks. */
+  uint32_t time;
+
+  /* For input: when it happened, going by the event time, in
+   * microseconds of the monotonic clock. */
+  gint64 timestamp;
+
+  /* For pointer events: the surface the pointer is over, or 0 if
+   * none, and where on it. For touch events, the same for the point,
+   * with the surface being the one it went down on. */
+  guint32 surface_id;
+  double sx, sy;
+  int32_t touch_id;
+
+  /* For motion: how far the pointer moved, in surface coordinates,
+   * whether or not it could, with and without acceleration. For
+   * scrolling: how far to scroll. */
+  double dx, dy;
+  double dx_unaccel, dy_unaccel;
+
+  /* For scrolling: the wl_pointer.axis_source, for wheels, how many
+   * 120ths of a notch, and on which axes scrolling stopped. */
+  uint32_t axis_source;
+  int32_t value120_x, value120_y;
+  gboolean stop_x, stop_y;
+
+  uint32_t button;
+  gboolean pressed;
+
+  /* For the keyboard: the evdev keycode, and the modifiers once GTK
+   * has handled the event. */
+  uint32_t key;
+  uint32_t mods_depressed, mods_latched, mods_locked, group;
+
+  /* For frames: whether we're hidden, and which scene was painted,
+   * presented or discarded, in which frame, when and how. */
+  gboolean hidden;
+  guint64 scene_seq;
+  gint64 frame_counter;
+  gint64 presentation_time, refresh_interval;
+  uint32_t flags;
+
+  /* For the output: the scale factor GTK shows us at. */
+  int scale;
+};
+
+/* In threaded mode, what the dispatch thread hands GTK to show: copies
+ * of the surfaces in the tree, with the damage committed since the
+ * last scene, and wrappers around their backing stores. */
+struct WakefieldScene
+{
+  guint64 seq;
+
+  struct wl_list surfaces;
+  struct WakefieldSurface *root;
+
+  /* Whether clients are waiting on a frame, and whether presentation
+   * feedback is waiting on this scene getting shown, and GTK has told
+   * the dispatch thread what became of it. */
+  gboolean needs_frame;
+  gboolean has_feedback;
+  gboolean feedback_done;
+
+  /* How to show the pointer; see update_cursor(). */
+  guint cursor_serial;
+  gboolean cursor_focus;
+  cairo_surface_t *cursor_image;
+  int hotspot_x, hotspot_y;
+
+  /* The pointer constraint to enforce; see publish_constraint(). */
+  guint constraint_serial;
+  struct WakefieldConstraintState constraint;
 };
 
 struct _WakefieldCompositorPrivate
@@ -64,8 +415,140 @@ struct _WakefieldCompositorPrivate
   struct wl_client *client;
   int client_fd;
 
+  /* Every surface clients created, and the one at the root of the
+   * tree we show. */
+  struct wl_list surfaces;
   struct WakefieldSurface *surface;
+  GHashTable *surface_ids;
+  guint32 next_surface_id;
   struct WakefieldSeat seat;
+  struct wl_list output_resources;
+
+  /* The scale factor we tell outputs about. In threaded mode, it's the
+   * dispatch thread's, and GTK sends it over when it changes. */
+  int output_scale;
+
+  /* Painted frames whose presentation feedback is waiting for GDK to
+   * learn when they actually reached the screen. */
+  struct wl_list presented_frames;
+
+  gboolean copy_on_commit;
+  guint flush_damage_id;
+
+  /* On backends where our window's surfaces live on the server (X11),
+   * a server-side copy of everything we've drawn, so that exposes
+   * don't have to upload the client's pixels again. retained_damage
+   * is what's out of date, in widget coordinates. */
+  cairo_surface_t *retained;
+  cairo_region_t *retained_damage;
+  int retained_width, retained_height, retained_scale;
+  gboolean retained_unsupported;
+
+  gulong after_paint_id;
+  gulong update_id;
+
+  /* Outside of the immediate motion mode, the pointer motion we hold
+   * on to until the next frame clock tick: only the latest, or all of
+   * it in the history mode. */
+  WakefieldMotionMode motion_mode;
+  GArray *pending_motion;
+
+  /* What to add to GDK's event times, in microseconds, to put them on
+   * the monotonic clock; see get_event_timestamp(). */
+  gboolean has_event_time_offset;
+  gint64 event_time_offset;
+
+  /* The scrolling we add up until the next frame clock tick, if any. */
+  gboolean has_pending_scroll;
+  struct WakefieldMessage pending_scroll;
+
+  /* The touch events we hold on to until the next tick, to send in
+   * one wl_touch.frame, and the WakefieldTouchSequences GDK has going,
+   * with the points we made of them. */
+  GArray *pending_touch;
+  GArray *touch_sequences;
+
+  /* While we're hidden the frame clock either doesn't run or doesn't
+   * paint us, so frame callbacks are driven from a timeout instead. */
+  WakefieldFrameThrottle hidden_frame_throttle;
+  gboolean hidden;
+  gboolean obscured;
+  gboolean iconified;
+  guint hidden_frame_id;
+
+  GtkWidget *toplevel;
+  gulong window_state_id;
+
+  /* How the root surface's contents are fitted into our allocation. */
+  WakefieldScaleMode scale_mode;
+
+  /* Dispatches the Wayland side on the GTK main loop, outside of
+   * threaded mode, for up to dispatch_budget microseconds at a time. */
+  GSource *event_source;
+  int dispatch_priority;
+  gint64 dispatch_budget;
+  guint64 dispatches, dispatch_budget_hits;
+
+  /* Whether we've queued events for clients since we last flushed
+   * them, and while GDK is still handing us a burst of input, the idle
+   * that flushes the lot once it's done. */
+  gboolean needs_flush;
+  guint input_burst_id;
+
+  /* In threaded mode, the Wayland side runs on the dispatch thread,
+   * and GTK pokes it through wakeup_fd when it has messages for it. */
+  gboolean threaded;
+  GThread *gtk_thread;
+  GThread *dispatch_thread;
+  gint dispatch_quit;
+  int wakeup_fd;
+  struct wl_event_source *wakeup_source;
+
+  /* GTK to the dispatch thread: a bounded ring of messages, with only
+   * GTK moving the head and only the dispatch thread the tail. */
+  struct WakefieldMessage *messages;
+  gint message_head, message_tail;
+
+  /* The dispatch thread to GTK: a triple buffer of scenes. The thread
+   * builds the next one on its own, then swaps it in as the ready one,
+   * which GTK swaps out for the one it shows. */
+  struct WakefieldScene *ready_scene;
+  struct WakefieldScene *front_scene;
+  gint consume_pending;
+
+  /* Only touched by the dispatch thread: whether it has something new
+   * to show, the frame callbacks that went out with scenes GTK hasn't
+   * painted yet, and how to show and constrain the pointer. */
+  gboolean scene_dirty;
+  guint64 scene_seq;
+  struct wl_list published_callbacks;
+  guint cursor_serial;
+  gboolean cursor_focus;
+  cairo_surface_t *cursor_image;
+  guint constraint_serial;
+  struct WakefieldConstraintState constraint;
+
+  /* Only touched by GTK: the cursor it shows, the pointer constraint it
+   * enforces, and the scenes whose presentation it's waiting for GDK's
+   * timings on. */
+  guint shown_cursor_serial;
+  guint shown_constraint_serial;
+  struct WakefieldConstraintState shown_constraint;
+  GArray *timed_scenes;
+
+  /* While GTK enforces a constraint, the seat it grabbed, and in root
+   * coordinates, where the pointer got locked, and where it was at the
+   * last event, for relative motion. */
+  GdkSeat *constraint_grab;
+  int lock_root_x, lock_root_y;
+  gboolean have_last_root;
+  double last_root_x, last_root_y;
+
+  /* On X11, the XInput2 opcode, and whether we get XI_RawMotion, with
+   * the unaccelerated motion it had since the last motion event. */
+  int xi_opcode;
+  gboolean has_raw_motion;
+  double raw_dx, raw_dy;
 };
 typedef struct _WakefieldCompositorPrivate WakefieldCompositorPrivate;
 
@@ -73,6 +556,49 @@ G_DEFINE_TYPE_WITH_PRIVATE (WakefieldCompositor, wakefield_compositor, GTK_TYPE_
 
 /* Utility methods */
 
+/* In threaded mode, whether we're on the dispatch thread, which
+ * mustn't touch GTK. */
+static gboolean
+on_dispatch_thread (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->threaded && g_thread_self () != priv->gtk_thread;
+}
+
+/* On the dispatch thread, whatever we'd have GTK do waits for the next
+ * scene instead. Returns TRUE if so. */
+static gboolean
+defer_to_scene (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  if (!on_dispatch_thread (compositor))
+    return FALSE;
+
+  priv->scene_dirty = TRUE;
+  return TRUE;
+}
+
+static void queue_message (WakefieldCompositor     *compositor,
+                           struct WakefieldMessage *message);
+static void flush_pending_motion (WakefieldCompositor *compositor);
+static void flush_pending_touch (WakefieldCompositor *compositor);
+static void flush_pending_scroll (WakefieldCompositor *compositor);
+static void release_constraint_grab (WakefieldCompositor *compositor);
+static void attach_raw_motion (WakefieldCompositor *compositor);
+static void detach_raw_motion (WakefieldCompositor *compositor);
+
+/* Outside of threaded mode, has the GSource flush clients before the
+ * main loop goes back to sleep. */
+static void
+mark_needs_flush (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  priv->needs_flush = TRUE;
+}
+
 /* Generic implementation for the resource destructors */
 
 static void
@@ -82,9 +608,466 @@ resource_release (struct wl_client *client,
   wl_resource_destroy (resource);
 }
 
+/* Frame callbacks and presentation feedback */
+
+struct WakefieldPresentedFrame
+{
+  struct wl_list link;
+  gint64 frame_counter;
+
+  /* The frame clock's time for that frame, for when GDK no longer has
+   * its timings. */
+  gint64 frame_time;
+
+  /* In threaded mode, the scene it was shown in, which is what GTK
+   * knows it by. */
+  guint64 scene_seq;
+
+  struct wl_list feedback_list;
+};
+
+static void
+send_frame_callbacks (struct WakefieldSurface *surface,
+                      uint32_t                 time)
+{
+  struct wl_resource *cr, *tmp;
+
+  wl_resource_for_each_safe (cr, tmp, &surface->current.frame_callbacks)
+    {
+      wl_callback_send_done (cr, time);
+      wl_resource_destroy (cr);
+    }
+}
+
+static void
+discard_feedback_list (struct wl_list *feedback_list)
+{
+  struct wl_resource *feedback, *tmp;
+
+  wl_resource_for_each_safe (feedback, tmp, feedback_list)
+    {
+      wp_presentation_feedback_send_discarded (feedback);
+      wl_resource_destroy (feedback);
+    }
+}
+
+/* Works out when a frame reached the screen, and how, from GDK's
+ * timings for it, if it still has them, or else its @frame_time. */
+static void
+get_presentation_time (GdkFrameTimings *timings,
+                       gint64           frame_time,
+                       gint64          *presentation_time,
+                       gint64          *refresh_interval,
+                       uint32_t        *flags)
+{
+  *presentation_time = frame_time;
+  *refresh_interval = 0;
+  *flags = 0;
+
+  if (!timings)
+    return;
+
+  *presentation_time = gdk_frame_timings_get_presentation_time (timings);
+  *refresh_interval = gdk_frame_timings_get_refresh_interval (timings);
+
+  /* Only claim vsync if the timestamp came from the window system
+   * rather than GDK's own prediction. */
+  if (*presentation_time != 0)
+    *flags |= WP_PRESENTATION_FEEDBACK_KIND_VSYNC;
+  else
+    *presentation_time = gdk_frame_timings_get_predicted_presentation_time (timings);
+
+  if (*presentation_time == 0)
+    *presentation_time = gdk_frame_timings_get_frame_time (timings);
+
+  if (*presentation_time == 0)
+    *presentation_time = frame_time;
+}
+
+static void
+send_presented_frame (WakefieldCompositor            *compositor,
+                      struct WakefieldPresentedFrame *frame,
+                      gint64                          presentation_time,
+                      gint64                          refresh_interval,
+                      uint32_t                        flags)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_resource *feedback, *tmp;
+  uint64_t tv_sec;
+  uint32_t tv_nsec;
+
+  tv_sec = presentation_time / G_USEC_PER_SEC;
+  tv_nsec = (presentation_time % G_USEC_PER_SEC) * 1000;
+
+  wl_resource_for_each_safe (feedback, tmp, &frame->feedback_list)
+    {
+      struct wl_client *client = wl_resource_get_client (feedback);
+      struct wl_resource *output;
+
+      wl_resource_for_each (output, &priv->output_resources)
+        {
+          if (wl_resource_get_client (output) == client)
+            wp_presentation_feedback_send_sync_output (feedback, output);
+        }
+
+      wp_presentation_feedback_send_presented (feedback,
+                                               tv_sec >> 32, tv_sec & 0xffffffff, tv_nsec,
+                                               refresh_interval * 1000,
+                                               frame->frame_counter >> 32, frame->frame_counter & 0xffffffff,
+                                               flags);
+      wl_resource_destroy (feedback);
+    }
+}
+
+/* Sends feedback for every painted frame GDK has complete timings
+ * for. Returns TRUE if some frames are still waiting. */
+static gboolean
+flush_presented_frames (WakefieldCompositor *compositor,
+                        GdkFrameClock       *frame_clock)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPresentedFrame *frame, *tmp;
+
+  wl_list_for_each_safe (frame, tmp, &priv->presented_frames, link)
+    {
+      GdkFrameTimings *timings = NULL;
+      gint64 presentation_time, refresh_interval;
+      uint32_t flags;
+
+      if (frame_clock)
+        {
+          timings = gdk_frame_clock_get_timings (frame_clock, frame->frame_counter);
+          if (timings && !gdk_frame_timings_get_complete (timings))
+            continue;
+        }
+
+      get_presentation_time (timings, frame->frame_time,
+                             &presentation_time, &refresh_interval, &flags);
+      send_presented_frame (compositor, frame, presentation_time, refresh_interval, flags);
+
+      wl_list_remove (&frame->link);
+      g_slice_free (struct WakefieldPresentedFrame, frame);
+    }
+
+  return !wl_list_empty (&priv->presented_frames);
+}
+
+struct WakefieldTimedScene
+{
+  guint64 scene_seq;
+  gint64 frame_counter, frame_time;
+};
+
+/* The threaded mode version of flush_presented_frames(): tells the
+ * dispatch thread when the scenes with feedback waiting on them that
+ * GDK has complete timings for were shown. */
+static gboolean
+flush_timed_scenes (WakefieldCompositor *compositor,
+                    GdkFrameClock       *frame_clock)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  guint i = 0;
+
+  while (i < priv->timed_scenes->len)
+    {
+      struct WakefieldTimedScene *timed = &g_array_index (priv->timed_scenes, struct WakefieldTimedScene, i);
+      struct WakefieldMessage message = { 0 };
+      GdkFrameTimings *timings = NULL;
+
+      if (frame_clock)
+        {
+          timings = gdk_frame_clock_get_timings (frame_clock, timed->frame_counter);
+          if (timings && !gdk_frame_timings_get_complete (timings))
+            {
+              i++;
+              continue;
+            }
+        }
+
+      message.type = WAKEFIELD_MESSAGE_PRESENTED;
+      message.scene_seq = timed->scene_seq;
+      message.frame_counter = timed->frame_counter;
+      get_presentation_time (timings, timed->frame_time, &message.presentation_time,
+                             &message.refresh_interval, &message.flags);
+      queue_message (compositor, &message);
+
+      g_array_remove_index (priv->timed_scenes, i);
+    }
+
+  return priv->timed_scenes->len > 0;
+}
+
+/* Tells the dispatch thread the feedback waiting on @scene won't be
+ * presented, unless we already told it something. */
+static void
+discard_scene_feedback (WakefieldCompositor   *compositor,
+                        struct WakefieldScene *scene)
+{
+  struct WakefieldMessage message = { 0 };
+
+  if (!scene->has_feedback || scene->feedback_done)
+    return;
+
+  message.type = WAKEFIELD_MESSAGE_DISCARDED;
+  message.scene_seq = scene->seq;
+  queue_message (compositor, &message);
+
+  scene->feedback_done = TRUE;
+}
+
+/* In threaded mode, the surfaces are the dispatch thread's, so we only
+ * tell it about the frame, and take note of when the scene we show
+ * gets presented. */
+static void
+scene_after_paint (WakefieldCompositor *compositor,
+                   GdkFrameClock       *frame_clock)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldScene *scene = priv->front_scene;
+
+  if (scene->has_feedback && !scene->feedback_done)
+    {
+      struct WakefieldTimedScene timed;
+
+      timed.scene_seq = scene->seq;
+      timed.frame_counter = gdk_frame_clock_get_frame_counter (frame_clock);
+      timed.frame_time = gdk_frame_clock_get_frame_time (frame_clock);
+      g_array_append_val (priv->timed_scenes, timed);
+      scene->feedback_done = TRUE;
+    }
+
+  if (!priv->hidden && scene->needs_frame)
+    {
+      struct WakefieldMessage message = { 0 };
+
+      message.type = WAKEFIELD_MESSAGE_FRAME;
+      message.time = gdk_frame_clock_get_frame_time (frame_clock) / 1000;
+      message.scene_seq = scene->seq;
+      queue_message (compositor, &message);
+
+      /* Callbacks committed after this come with a new scene. */
+      scene->needs_frame = FALSE;
+    }
+
+  if (flush_timed_scenes (compositor, frame_clock))
+    gdk_frame_clock_request_phase (frame_clock, GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
+}
+
+/* Anything committed before this frame has now been painted, so let
+ * clients start on their next frame straight away, with a timestamp
+ * from the (monotonic) frame clock rather than the wall clock. */
+static void
+wakefield_compositor_after_paint (GdkFrameClock *frame_clock,
+                                  gpointer       user_data)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (user_data);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPresentedFrame *frame = NULL;
+  struct WakefieldSurface *surface;
+
+  if (priv->threaded)
+    {
+      scene_after_paint (compositor, frame_clock);
+      return;
+    }
+
+  wl_list_for_each (surface, &priv->surfaces, link)
+    {
+      if (wl_list_empty (&surface->current.feedback_list))
+        continue;
+
+      if (!frame)
+        {
+          frame = g_slice_new0 (struct WakefieldPresentedFrame);
+          frame->frame_counter = gdk_frame_clock_get_frame_counter (frame_clock);
+          frame->frame_time = gdk_frame_clock_get_frame_time (frame_clock);
+          wl_list_init (&frame->feedback_list);
+          wl_list_insert (priv->presented_frames.prev, &frame->link);
+        }
+
+      wl_list_insert_list (&frame->feedback_list, &surface->current.feedback_list);
+      wl_list_init (&surface->current.feedback_list);
+    }
+
+  /* The frame clock keeps running for the rest of the toplevel while
+   * we're hidden; our callbacks are on the hidden timeout then. */
+  if (!priv->hidden)
+    {
+      wl_list_for_each (surface, &priv->surfaces, link)
+        send_frame_callbacks (surface, gdk_frame_clock_get_frame_time (frame_clock) / 1000);
+    }
+
+  mark_needs_flush (compositor);
+
+  /* Keep the frame clock going until the window system has told GDK
+   * when our frames were presented. */
+  if (flush_presented_frames (compositor, frame_clock))
+    gdk_frame_clock_request_phase (frame_clock, GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
+}
+
+static void
+wakefield_compositor_update (GdkFrameClock *frame_clock,
+                             gpointer       user_data)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (user_data);
+
+  flush_pending_motion (compositor);
+  flush_pending_scroll (compositor);
+  flush_pending_touch (compositor);
+}
+
+#define HIDDEN_FULL_RATE_INTERVAL_MS 16
+#define HIDDEN_REDUCED_RATE_INTERVAL_MS 1000
+
+static gboolean
+hidden_frame_timeout (gpointer user_data)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (user_data);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldSurface *surface;
+
+  priv->hidden_frame_id = 0;
+
+  if (priv->threaded)
+    {
+      struct WakefieldMessage message = { 0 };
+
+      discard_scene_feedback (compositor, priv->front_scene);
+
+      message.type = WAKEFIELD_MESSAGE_FRAME;
+      message.time = g_get_monotonic_time () / 1000;
+      message.hidden = TRUE;
+      message.scene_seq = priv->front_scene->seq;
+      queue_message (compositor, &message);
+
+      return G_SOURCE_REMOVE;
+    }
+
+  wl_list_for_each (surface, &priv->surfaces, link)
+    {
+      /* Nothing was shown, so nothing was presented. */
+      discard_feedback_list (&surface->current.feedback_list);
+      send_frame_callbacks (surface, g_get_monotonic_time () / 1000);
+    }
+
+  mark_needs_flush (compositor);
+  return G_SOURCE_REMOVE;
+}
+
+/* Makes sure pending frame callbacks and feedback get sent: on the
+ * next frame clock cycle when we're visible, even if the commit had
+ * no damage, or according to the hidden throttle when we're not. */
+static void
+schedule_frame (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  GdkFrameClock *frame_clock;
+
+  if (defer_to_scene (compositor))
+    return;
+
+  if (priv->hidden)
+    {
+      guint interval;
+
+      if (priv->hidden_frame_id)
+        return;
+
+      switch (priv->hidden_frame_throttle)
+        {
+        case WAKEFIELD_FRAME_THROTTLE_FULL_RATE:
+          interval = HIDDEN_FULL_RATE_INTERVAL_MS;
+          break;
+        case WAKEFIELD_FRAME_THROTTLE_REDUCED_RATE:
+          interval = HIDDEN_REDUCED_RATE_INTERVAL_MS;
+          break;
+        case WAKEFIELD_FRAME_THROTTLE_SUSPENDED:
+        default:
+          return;
+        }
+
+      priv->hidden_frame_id = g_timeout_add (interval, hidden_frame_timeout, compositor);
+      return;
+    }
+
+  frame_clock = gtk_widget_get_frame_clock (GTK_WIDGET (compositor));
+  if (frame_clock)
+    gdk_frame_clock_request_phase (frame_clock, GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
+}
+
+static void
+update_hidden (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  GtkWidget *widget = GTK_WIDGET (compositor);
+  gboolean hidden;
+
+  hidden = (!gtk_widget_get_mapped (widget) || priv->obscured || priv->iconified);
+  if (priv->hidden == hidden)
+    return;
+
+  priv->hidden = hidden;
+
+  if (priv->hidden_frame_id)
+    {
+      g_source_remove (priv->hidden_frame_id);
+      priv->hidden_frame_id = 0;
+    }
+
+  /* Whatever was committed while we were hidden hasn't been drawn. */
+  if (!hidden)
+    gtk_widget_queue_draw (widget);
+
+  schedule_frame (compositor);
+}
+
+static gboolean
+toplevel_window_state_event (GtkWidget           *toplevel,
+                             GdkEventWindowState *event,
+                             gpointer             user_data)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (user_data);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  priv->iconified = (event->new_window_state & (GDK_WINDOW_STATE_ICONIFIED |
+                                                GDK_WINDOW_STATE_WITHDRAWN)) != 0;
+  update_hidden (compositor);
+
+  return FALSE;
+}
+
+static void
+wakefield_compositor_map (GtkWidget *widget)
+{
+  GTK_WIDGET_CLASS (wakefield_compositor_parent_class)->map (widget);
+  update_hidden (WAKEFIELD_COMPOSITOR (widget));
+}
+
+static void
+wakefield_compositor_unmap (GtkWidget *widget)
+{
+  GTK_WIDGET_CLASS (wakefield_compositor_parent_class)->unmap (widget);
+  update_hidden (WAKEFIELD_COMPOSITOR (widget));
+}
+
+static gboolean
+wakefield_compositor_visibility_notify_event (GtkWidget          *widget,
+                                              GdkEventVisibility *event)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  priv->obscured = (event->state == GDK_VISIBILITY_FULLY_OBSCURED);
+  update_hidden (compositor);
+
+  return FALSE;
+}
+
 static void
 wakefield_compositor_realize (GtkWidget *widget)
 {
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   GtkAllocation allocation;
   GdkWindow *window;
   GdkWindowAttr attributes;
@@ -106,101 +1089,1304 @@ wakefield_compositor_realize (GtkWidget *widget)
                            GDK_BUTTON_PRESS_MASK |
                            GDK_BUTTON_RELEASE_MASK |
                            GDK_SCROLL_MASK |
+                           GDK_SMOOTH_SCROLL_MASK |
+                           GDK_TOUCH_MASK |
                            GDK_FOCUS_CHANGE_MASK |
                            GDK_KEY_PRESS_MASK |
                            GDK_KEY_RELEASE_MASK |
                            GDK_ENTER_NOTIFY_MASK |
                            GDK_LEAVE_NOTIFY_MASK |
+                           GDK_VISIBILITY_NOTIFY_MASK |
                            GDK_EXPOSURE_MASK);
 
-  window = gdk_window_new (gtk_widget_get_parent_window (widget),
-                           &attributes, attributes_mask);
-  gtk_widget_set_window (widget, window);
-  gtk_widget_register_window (widget, window);
+  window = gdk_window_new (gtk_widget_get_parent_window (widget),
+                           &attributes, attributes_mask);
+  gtk_widget_set_window (widget, window);
+  gtk_widget_register_window (widget, window);
+
+  priv->after_paint_id = g_signal_connect (gtk_widget_get_frame_clock (widget), "after-paint",
+                                           G_CALLBACK (wakefield_compositor_after_paint), compositor);
+  priv->update_id = g_signal_connect (gtk_widget_get_frame_clock (widget), "update",
+                                      G_CALLBACK (wakefield_compositor_update), compositor);
+
+  /* GDK would otherwise squash the motion we're meant to keep. */
+  if (priv->motion_mode == WAKEFIELD_MOTION_MODE_HISTORY)
+    gdk_window_set_event_compression (window, FALSE);
+
+  attach_raw_motion (compositor);
+
+  priv->toplevel = gtk_widget_get_toplevel (widget);
+  if (gtk_widget_is_toplevel (priv->toplevel))
+    {
+      GdkWindowState state = gdk_window_get_state (gtk_widget_get_window (priv->toplevel));
+
+      priv->iconified = (state & (GDK_WINDOW_STATE_ICONIFIED | GDK_WINDOW_STATE_WITHDRAWN)) != 0;
+      priv->window_state_id = g_signal_connect (priv->toplevel, "window-state-event",
+                                                G_CALLBACK (toplevel_window_state_event), compositor);
+    }
+  else
+    priv->toplevel = NULL;
+}
+
+static void
+wakefield_compositor_unrealize (GtkWidget *widget)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  if (priv->after_paint_id)
+    {
+      g_signal_handler_disconnect (gtk_widget_get_frame_clock (widget), priv->after_paint_id);
+      priv->after_paint_id = 0;
+    }
+
+  if (priv->update_id)
+    {
+      g_signal_handler_disconnect (gtk_widget_get_frame_clock (widget), priv->update_id);
+      priv->update_id = 0;
+    }
+
+  /* There won't be a tick to send it on. */
+  flush_pending_motion (compositor);
+  flush_pending_scroll (compositor);
+  flush_pending_touch (compositor);
+
+  /* The grab goes with the window. */
+  release_constraint_grab (compositor);
+  priv->shown_constraint.kind = WAKEFIELD_CONSTRAINT_NONE;
+  priv->have_last_root = FALSE;
+  detach_raw_motion (compositor);
+
+  /* We won't hear about those frames anymore. */
+  if (priv->threaded)
+    flush_timed_scenes (compositor, NULL);
+  else
+    {
+      flush_presented_frames (compositor, NULL);
+      mark_needs_flush (compositor);
+    }
+
+  if (priv->window_state_id)
+    {
+      g_signal_handler_disconnect (priv->toplevel, priv->window_state_id);
+      priv->window_state_id = 0;
+    }
+  priv->toplevel = NULL;
+  priv->iconified = FALSE;
+  priv->obscured = FALSE;
+
+  g_clear_pointer (&priv->retained, cairo_surface_destroy);
+  priv->retained_unsupported = FALSE;
+
+  GTK_WIDGET_CLASS (wakefield_compositor_parent_class)->unrealize (widget);
+}
+
+#include "wakefield-format.c"
+#include "wakefield-transform.c"
+#include "wakefield-scale.c"
+
+static void
+wakefield_buffer_destroy_handler (struct wl_listener *listener,
+                                  void               *data)
+{
+  struct WakefieldBuffer *buffer = wl_container_of (listener, buffer, destroy_listener);
+
+  wl_signal_emit (&buffer->destroy_signal, buffer);
+
+  g_clear_pointer (&buffer->cr_surface, cairo_surface_destroy);
+  g_slice_free (struct WakefieldBuffer, buffer);
+}
+
+/* We keep one WakefieldBuffer around for each wl_buffer we see, tied
+ * to the lifetime of the resource, so that redraws and repeated
+ * attaches of the same buffer don't have to set up a new cairo
+ * surface every time. */
+static struct WakefieldBuffer *
+wakefield_buffer_from_resource (struct wl_resource *resource)
+{
+  struct WakefieldBuffer *buffer;
+  struct wl_listener *listener;
+  struct wl_shm_buffer *shm_buffer;
+
+  listener = wl_resource_get_destroy_listener (resource, wakefield_buffer_destroy_handler);
+  if (listener)
+    return wl_container_of (listener, buffer, destroy_listener);
+
+  buffer = g_slice_new0 (struct WakefieldBuffer);
+  buffer->resource = resource;
+
+  shm_buffer = wl_shm_buffer_get (resource);
+  if (shm_buffer)
+    {
+      buffer->format = wakefield_format_for_wl_shm_format (wl_shm_buffer_get_format (shm_buffer));
+      buffer->width = wl_shm_buffer_get_width (shm_buffer);
+      buffer->height = wl_shm_buffer_get_height (shm_buffer);
+      buffer->stride = wl_shm_buffer_get_stride (shm_buffer);
+    }
+  else
+    g_assert_not_reached ();
+
+  buffer->destroy_listener.notify = wakefield_buffer_destroy_handler;
+  wl_resource_add_destroy_listener (resource, &buffer->destroy_listener);
+  wl_signal_init (&buffer->destroy_signal);
+
+  return buffer;
+}
+
+static void
+wakefield_buffer_release (struct WakefieldBuffer *buffer)
+{
+  if (!buffer->busy)
+    return;
+
+  buffer->busy = FALSE;
+  wl_buffer_send_release (buffer->resource);
+}
+
+/* Should be called between wl_shm_buffer_begin_access and
+ * wl_shm_buffer_end_access. */
+static cairo_surface_t *
+wakefield_buffer_get_cairo_surface (struct WakefieldBuffer *buffer,
+                                    struct wl_shm_buffer   *shm_buffer)
+{
+  void *data = wl_shm_buffer_get_data (shm_buffer);
+
+  if (buffer->cr_surface && buffer->data == data)
+    return buffer->cr_surface;
+
+  g_clear_pointer (&buffer->cr_surface, cairo_surface_destroy);
+
+  buffer->data = data;
+  buffer->cr_surface = cairo_image_surface_create_for_data (data,
+                                                            buffer->format->cairo_format,
+                                                            buffer->width,
+                                                            buffer->height,
+                                                            buffer->stride);
+  return buffer->cr_surface;
+}
+
+/* Returns the area GTK wants us to repaint, in user space. */
+static cairo_region_t *
+get_clip_region (cairo_t *cr)
+{
+  cairo_rectangle_list_t *list;
+  cairo_region_t *region;
+
+  list = cairo_copy_clip_rectangle_list (cr);
+  if (list->status == CAIRO_STATUS_SUCCESS)
+    {
+      int i;
+
+      region = cairo_region_create ();
+      for (i = 0; i < list->num_rectangles; i++)
+        {
+          cairo_rectangle_t *r = &list->rectangles[i];
+          cairo_rectangle_int_t rect;
+
+          rect.x = floor (r->x);
+          rect.y = floor (r->y);
+          rect.width = ceil (r->x + r->width) - rect.x;
+          rect.height = ceil (r->y + r->height) - rect.y;
+          cairo_region_union_rectangle (region, &rect);
+        }
+    }
+  else
+    {
+      GdkRectangle clip;
+
+      if (!gdk_cairo_get_clip_rectangle (cr, &clip))
+        clip.width = clip.height = 0;
+      region = cairo_region_create_rectangle (&clip);
+    }
+
+  cairo_rectangle_list_destroy (list);
+  return region;
+}
+
+static void
+paint_clipped (cairo_t          *cr,
+               cairo_surface_t  *cr_surface,
+               double            x,
+               double            y,
+               cairo_region_t   *region,
+               cairo_operator_t  op)
+{
+  if (cairo_region_is_empty (region))
+    return;
+
+  cairo_save (cr);
+  gdk_cairo_region (cr, region);
+  cairo_clip (cr);
+
+  cairo_set_operator (cr, op);
+  cairo_set_source_surface (cr, cr_surface, x, y);
+  cairo_paint (cr);
+  cairo_restore (cr);
+}
+
+/* Paints @cr_surface at @scale, with its top left corner at @x, @y in
+ * widget coordinates, but only inside @paint_region. */
+static void
+paint_content (cairo_t         *cr,
+               cairo_surface_t *cr_surface,
+               double           x,
+               double           y,
+               int              scale,
+               cairo_region_t  *paint_region,
+               cairo_region_t  *opaque_region)
+{
+  cairo_region_t *copy_region, *blend_region;
+
+  if (cairo_region_is_empty (paint_region))
+    return;
+
+  cairo_surface_set_device_scale (cr_surface, scale, scale);
+
+  /* Whatever the client promised us is opaque can just be copied
+   * over, and only the rest needs blending. */
+  copy_region = cairo_region_copy (paint_region);
+  cairo_region_intersect (copy_region, opaque_region);
+  blend_region = cairo_region_copy (paint_region);
+  cairo_region_subtract (blend_region, opaque_region);
+
+  paint_clipped (cr, cr_surface, x, y, copy_region, CAIRO_OPERATOR_SOURCE);
+  paint_clipped (cr, cr_surface, x, y, blend_region, CAIRO_OPERATOR_OVER);
+
+  cairo_region_destroy (copy_region);
+  cairo_region_destroy (blend_region);
+}
+
+/* Returns what we paint the surface from: the backing store if it has
+ * one, or its buffer's image surface, which needs to be wrapped in
+ * wl_shm_buffer_begin_access / wl_shm_buffer_end_access. */
+static cairo_surface_t *
+get_content (struct WakefieldSurface *surface)
+{
+  struct WakefieldBuffer *buffer = surface->current.buffer;
+  struct wl_shm_buffer *shm_buffer;
+
+  if (surface->backing)
+    return surface->backing;
+
+  shm_buffer = wl_shm_buffer_get (buffer->resource);
+  if (!shm_buffer)
+    g_assert_not_reached ();
+
+  return wakefield_buffer_get_cairo_surface (buffer, shm_buffer);
+}
+
+/* Gets the size of the surface's contents, in pixels, and returns
+ * FALSE if it doesn't have any. */
+static gboolean
+get_content_size (struct WakefieldSurface *surface,
+                  int                     *width,
+                  int                     *height)
+{
+  if (surface->backing)
+    {
+      *width = cairo_image_surface_get_width (surface->backing);
+      *height = cairo_image_surface_get_height (surface->backing);
+    }
+  else if (surface->current.buffer)
+    {
+      *width = surface->current.buffer->width;
+      *height = surface->current.buffer->height;
+    }
+  else
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Works out the surface's size, in surface coordinates, for contents
+ * of @content_width by @content_height pixels. */
+static void
+get_surface_size_for_content (struct WakefieldSurface *surface,
+                              int                      content_width,
+                              int                      content_height,
+                              int                     *width,
+                              int                     *height)
+{
+  int scale = surface->current.scale;
+
+  if (surface->current.dst_width > 0)
+    {
+      *width = surface->current.dst_width;
+      *height = surface->current.dst_height;
+    }
+  else if (surface->current.src_width > 0)
+    {
+      /* Checked to be whole numbers on commit. */
+      *width = surface->current.src_width;
+      *height = surface->current.src_height;
+    }
+  else
+    {
+      *width = content_width / scale;
+      *height = content_height / scale;
+    }
+}
+
+/* Gets the surface's size, in surface coordinates, and returns FALSE
+ * if it doesn't have any contents. */
+static gboolean
+get_surface_size (struct WakefieldSurface *surface,
+                  int                     *width,
+                  int                     *height)
+{
+  int content_width, content_height;
+
+  if (!get_content_size (surface, &content_width, &content_height))
+    return FALSE;
+
+  get_surface_size_for_content (surface, content_width, content_height, width, height);
+  return *width > 0 && *height > 0;
+}
+
+/* Works out the part of @content_width by @content_height pixels of
+ * contents that is shown. */
+static void
+get_source_rect_for_content (struct WakefieldSurface *surface,
+                             int                      content_width,
+                             int                      content_height,
+                             cairo_rectangle_int_t   *rect)
+{
+  int scale = surface->current.scale;
+
+  rect->x = rect->y = 0;
+  rect->width = content_width;
+  rect->height = content_height;
+
+  /* A source rectangle that isn't on whole pixels is rounded to the
+   * nearest ones. */
+  if (surface->current.src_width > 0)
+    {
+      int x1 = floor ((surface->current.src_x + surface->current.src_width) * scale + 0.5);
+      int y1 = floor ((surface->current.src_y + surface->current.src_height) * scale + 0.5);
+
+      rect->x = CLAMP ((int) floor (surface->current.src_x * scale + 0.5), 0, content_width - 1);
+      rect->y = CLAMP ((int) floor (surface->current.src_y * scale + 0.5), 0, content_height - 1);
+      rect->width = CLAMP (x1, rect->x + 1, content_width) - rect->x;
+      rect->height = CLAMP (y1, rect->y + 1, content_height) - rect->y;
+    }
+}
+
+/* Gets the part of the surface's contents that is shown, in pixels.
+ * Only valid if get_surface_size() succeeds. */
+static void
+get_source_rect (struct WakefieldSurface *surface,
+                 cairo_rectangle_int_t   *rect)
+{
+  int width, height;
+
+  get_content_size (surface, &width, &height);
+  get_source_rect_for_content (surface, width, height, rect);
+}
+
+/* Maps a region in surface coordinates to the pixels of @content_width
+ * by @content_height contents it covers. Damage sent that way has to
+ * be rounded out to whole pixels, and more so the more we scale. */
+static cairo_region_t *
+surface_region_to_content (struct WakefieldSurface *surface,
+                           cairo_region_t          *region,
+                           int                      content_width,
+                           int                      content_height)
+{
+  cairo_rectangle_int_t src;
+  cairo_region_t *mapped;
+  int width, height;
+  int i;
+
+  mapped = cairo_region_create ();
+
+  get_surface_size_for_content (surface, content_width, content_height, &width, &height);
+  if (width <= 0 || height <= 0)
+    return mapped;
+
+  get_source_rect_for_content (surface, content_width, content_height, &src);
+
+  for (i = 0; i < cairo_region_num_rectangles (region); i++)
+    {
+      cairo_rectangle_int_t rect;
+      int x0, y0, x1, y1;
+
+      cairo_region_get_rectangle (region, i, &rect);
+
+      x0 = src.x + floor ((double) rect.x * src.width / width);
+      y0 = src.y + floor ((double) rect.y * src.height / height);
+      x1 = src.x + ceil ((double) (rect.x + rect.width) * src.width / width);
+      y1 = src.y + ceil ((double) (rect.y + rect.height) * src.height / height);
+
+      rect.x = x0;
+      rect.y = y0;
+      rect.width = x1 - x0;
+      rect.height = y1 - y0;
+      cairo_region_union_rectangle (mapped, &rect);
+    }
+
+  cairo_region_intersect_rectangle (mapped, &src);
+  return mapped;
+}
+
+/* The other way around: maps a region in the pixels of @content_width
+ * by @content_height contents to the surface coordinates showing
+ * them. */
+static cairo_region_t *
+content_region_to_surface (struct WakefieldSurface *surface,
+                           cairo_region_t          *region,
+                           int                      content_width,
+                           int                      content_height)
+{
+  cairo_rectangle_int_t src, extents = { 0, 0, 0, 0 };
+  cairo_region_t *mapped;
+  int i;
+
+  mapped = cairo_region_create ();
+
+  get_surface_size_for_content (surface, content_width, content_height, &extents.width, &extents.height);
+  if (extents.width <= 0 || extents.height <= 0)
+    return mapped;
+
+  get_source_rect_for_content (surface, content_width, content_height, &src);
+
+  for (i = 0; i < cairo_region_num_rectangles (region); i++)
+    {
+      cairo_rectangle_int_t rect;
+      int x0, y0, x1, y1;
+
+      cairo_region_get_rectangle (region, i, &rect);
+
+      x0 = floor ((double) (rect.x - src.x) * extents.width / src.width);
+      y0 = floor ((double) (rect.y - src.y) * extents.height / src.height);
+      x1 = ceil ((double) (rect.x + rect.width - src.x) * extents.width / src.width);
+      y1 = ceil ((double) (rect.y + rect.height - src.y) * extents.height / src.height);
+
+      rect.x = x0;
+      rect.y = y0;
+      rect.width = x1 - x0;
+      rect.height = y1 - y0;
+      cairo_region_union_rectangle (mapped, &rect);
+    }
+
+  cairo_region_intersect_rectangle (mapped, &extents);
+  return mapped;
+}
+
+/* The surfaces GTK shows: the clients' own, or in threaded mode, the
+ * copies in the last scene the dispatch thread handed over. */
+static struct wl_list *
+get_shown_surfaces (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->threaded ? &priv->front_scene->surfaces : &priv->surfaces;
+}
+
+static struct WakefieldSurface *
+get_shown_root (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->threaded ? priv->front_scene->root : priv->surface;
+}
+
+/* Works out where the root surface's contents go in the widget,
+ * according to the scale mode. Returns FALSE if there's nothing to
+ * show. */
+static gboolean
+get_root_rect (WakefieldCompositor   *compositor,
+               cairo_rectangle_int_t *rect)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  GtkWidget *widget = GTK_WIDGET (compositor);
+  int alloc_width = gtk_widget_get_allocated_width (widget);
+  int alloc_height = gtk_widget_get_allocated_height (widget);
+  struct WakefieldSurface *root = get_shown_root (compositor);
+  int width, height;
+  double s;
+
+  if (!root || !get_surface_size (root, &width, &height))
+    return FALSE;
+
+  switch (priv->scale_mode)
+    {
+    case WAKEFIELD_SCALE_MODE_NONE:
+    default:
+      s = 1;
+      break;
+    case WAKEFIELD_SCALE_MODE_STRETCH:
+      rect->x = rect->y = 0;
+      rect->width = MAX (alloc_width, 1);
+      rect->height = MAX (alloc_height, 1);
+      return TRUE;
+    case WAKEFIELD_SCALE_MODE_FIT:
+      s = MIN ((double) alloc_width / width, (double) alloc_height / height);
+      break;
+    case WAKEFIELD_SCALE_MODE_FILL:
+      s = MAX ((double) alloc_width / width, (double) alloc_height / height);
+      break;
+    case WAKEFIELD_SCALE_MODE_INTEGER:
+      s = MIN ((double) alloc_width / width, (double) alloc_height / height);
+      s = s >= 1 ? floor (s) : 1 / ceil (1 / s);
+      break;
+    }
+
+  if (priv->scale_mode == WAKEFIELD_SCALE_MODE_NONE)
+    {
+      rect->x = rect->y = 0;
+      rect->width = width;
+      rect->height = height;
+    }
+  else
+    {
+      rect->width = MAX ((int) (width * s + 0.5), 1);
+      rect->height = MAX ((int) (height * s + 0.5), 1);
+      rect->x = (alloc_width - rect->width) / 2;
+      rect->y = (alloc_height - rect->height) / 2;
+    }
+
+  return TRUE;
+}
+
+/* Works out where a subsurface is in the root surface's coordinates.
+ * Returns FALSE if it isn't in the tree we show, or some surface
+ * between them isn't mapped, which hides it along with its parent. */
+static gboolean
+get_surface_position (struct WakefieldSurface *surface,
+                      int                     *x,
+                      int                     *y)
+{
+  struct WakefieldSurface *root = get_shown_root (surface->compositor);
+  int width, height;
+
+  *x = *y = 0;
+
+  while (surface != root)
+    {
+      if (!surface->subsurface || !surface->subsurface->parent)
+        return FALSE;
+
+      *x += surface->subsurface->x;
+      *y += surface->subsurface->y;
+      surface = surface->subsurface->parent;
+
+      if (!get_surface_size (surface, &width, &height))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Works out where a surface's contents go in the widget: the root
+ * surface's according to the scale mode, and its subsurfaces' scaled
+ * along with them. Returns FALSE if the surface isn't shown. */
+static gboolean
+get_content_rect (struct WakefieldSurface *surface,
+                  cairo_rectangle_int_t   *rect)
+{
+  struct WakefieldSurface *root = get_shown_root (surface->compositor);
+  cairo_rectangle_int_t root_rect;
+  int root_width, root_height;
+  int x, y, width, height;
+  int x0, y0, x1, y1;
+
+  if (!get_root_rect (surface->compositor, &root_rect))
+    return FALSE;
+
+  if (surface == root)
+    {
+      *rect = root_rect;
+      return TRUE;
+    }
+
+  if (!get_surface_position (surface, &x, &y) ||
+      !get_surface_size (surface, &width, &height))
+    return FALSE;
+
+  get_surface_size (root, &root_width, &root_height);
+
+  x0 = root_rect.x + floor ((double) x * root_rect.width / root_width + 0.5);
+  y0 = root_rect.y + floor ((double) y * root_rect.height / root_height + 0.5);
+  x1 = root_rect.x + floor ((double) (x + width) * root_rect.width / root_width + 0.5);
+  y1 = root_rect.y + floor ((double) (y + height) * root_rect.height / root_height + 0.5);
+
+  rect->x = x0;
+  rect->y = y0;
+  rect->width = MAX (x1 - x0, 1);
+  rect->height = MAX (y1 - y0, 1);
+  return TRUE;
+}
+
+/* Adds @surface and the subsurfaces shown along with it to @surfaces,
+ * bottom to top. */
+static void
+collect_surfaces (struct WakefieldSurface *surface,
+                  GPtrArray               *surfaces)
+{
+  struct WakefieldSubsurface *sub;
+  int width, height;
+
+  if (!get_surface_size (surface, &width, &height))
+    return;
+
+  wl_list_for_each (sub, &surface->subsurfaces, parent_link)
+    {
+      if (sub->surface == surface)
+        g_ptr_array_add (surfaces, surface);
+      else
+        collect_surfaces (sub->surface, surfaces);
+    }
+}
+
+/* Returns the surfaces we show, bottom to top. */
+static GPtrArray *
+get_surfaces (WakefieldCompositor *compositor)
+{
+  struct WakefieldSurface *root = get_shown_root (compositor);
+  GPtrArray *surfaces = g_ptr_array_new ();
+
+  if (root)
+    collect_surfaces (root, surfaces);
+
+  return surfaces;
+}
+
+/* Adds the part of the widget @surface and its subsurfaces cover to
+ * @region. */
+static void
+add_tree_extents (struct WakefieldSurface *surface,
+                  cairo_region_t          *region)
+{
+  GPtrArray *surfaces = g_ptr_array_new ();
+  guint i;
+
+  collect_surfaces (surface, surfaces);
+
+  for (i = 0; i < surfaces->len; i++)
+    {
+      cairo_rectangle_int_t rect;
+
+      if (get_content_rect (g_ptr_array_index (surfaces, i), &rect))
+        cairo_region_union_rectangle (region, &rect);
+    }
+
+  g_ptr_array_free (surfaces, TRUE);
+}
+
+/* Maps a region in surface coordinates to widget coordinates. Pixels
+ * the mapped region only partly covers are left out for @inward, and
+ * included otherwise, along with a margin for the resampling filter
+ * when the contents are scaled. */
+static cairo_region_t *
+surface_region_to_widget (struct WakefieldSurface *surface,
+                          cairo_region_t          *region,
+                          gboolean                 inward)
+{
+  cairo_rectangle_int_t content_rect;
+  cairo_region_t *mapped;
+  int width, height, margin;
+  int i;
+
+  if (!get_content_rect (surface, &content_rect))
+    return cairo_region_create ();
+
+  get_surface_size (surface, &width, &height);
+
+  if (content_rect.width == width && content_rect.height == height)
+    {
+      mapped = cairo_region_copy (region);
+      cairo_region_translate (mapped, content_rect.x, content_rect.y);
+      return mapped;
+    }
+
+  margin = inward ? 0 : 1;
+  mapped = cairo_region_create ();
+  for (i = 0; i < cairo_region_num_rectangles (region); i++)
+    {
+      cairo_rectangle_int_t rect;
+      double x0, y0, x1, y1;
+
+      cairo_region_get_rectangle (region, i, &rect);
+
+      x0 = content_rect.x + (double) rect.x * content_rect.width / width;
+      y0 = content_rect.y + (double) rect.y * content_rect.height / height;
+      x1 = content_rect.x + (double) (rect.x + rect.width) * content_rect.width / width;
+      y1 = content_rect.y + (double) (rect.y + rect.height) * content_rect.height / height;
+
+      if (inward)
+        {
+          rect.x = ceil (x0);
+          rect.y = ceil (y0);
+          rect.width = floor (x1) - rect.x;
+          rect.height = floor (y1) - rect.y;
+        }
+      else
+        {
+          rect.x = floor (x0) - margin;
+          rect.y = floor (y0) - margin;
+          rect.width = ceil (x1) + margin - rect.x;
+          rect.height = ceil (y1) + margin - rect.y;
+        }
+
+      if (rect.width > 0 && rect.height > 0)
+        cairo_region_union_rectangle (mapped, &rect);
+    }
+
+  cairo_region_intersect_rectangle (mapped, &content_rect);
+  return mapped;
+}
+
+/* Finds the topmost surface at widget coordinates @x, @y, such as
+ * those of pointer events, and maps them to its surface coordinates.
+ * Returns NULL if there's none. */
+static struct WakefieldSurface *
+pick_surface (WakefieldCompositor *compositor,
+              double               x,
+              double               y,
+              double              *sx,
+              double              *sy)
+{
+  struct WakefieldSurface *found = NULL;
+  GPtrArray *surfaces = get_surfaces (compositor);
+  guint i;
+
+  for (i = surfaces->len; i-- > 0; )
+    {
+      struct WakefieldSurface *surface = g_ptr_array_index (surfaces, i);
+      cairo_rectangle_int_t content_rect;
+      int width, height;
+
+      get_content_rect (surface, &content_rect);
+      if (x < content_rect.x || x >= content_rect.x + content_rect.width ||
+          y < content_rect.y || y >= content_rect.y + content_rect.height)
+        continue;
+
+      get_surface_size (surface, &width, &height);
+      *sx = (x - content_rect.x) * width / content_rect.width;
+      *sy = (y - content_rect.y) * height / content_rect.height;
+
+      /* Input outside the input region falls through to whatever is
+       * below. */
+      if (!cairo_region_contains_point (surface->current.input_region, floor (*sx), floor (*sy)))
+        continue;
+
+      found = surface;
+      break;
+    }
+
+  g_ptr_array_free (surfaces, TRUE);
+  return found;
+}
+
+/* Returns the part of the widget the surface's contents are known to
+ * cover completely, in widget coordinates. */
+static cairo_region_t *
+get_opaque_region (struct WakefieldSurface *surface)
+{
+  cairo_rectangle_int_t extents = { 0, 0, 0, 0 };
+  cairo_region_t *region, *mapped;
+  cairo_format_t format;
+
+  if (!get_surface_size (surface, &extents.width, &extents.height))
+    return cairo_region_create ();
+
+  if (surface->backing)
+    format = cairo_image_surface_get_format (surface->backing);
+  else
+    format = surface->current.buffer->format->cairo_format;
+
+  /* Formats without alpha are opaque whatever the client says. */
+  if (format != CAIRO_FORMAT_ARGB32)
+    region = cairo_region_create_rectangle (&extents);
+  else
+    {
+      region = cairo_region_copy (surface->current.opaque_region);
+      cairo_region_intersect_rectangle (region, &extents);
+    }
+
+  mapped = surface_region_to_widget (surface, region, TRUE);
+  cairo_region_destroy (region);
+  return mapped;
+}
+
+/* Brings the parts of the scaled copy covered by @update, in its
+ * pixels, up to date with the @src part of @content. */
+static void
+update_scaled (cairo_surface_t       *scaled,
+               cairo_surface_t       *content,
+               cairo_rectangle_int_t *src,
+               cairo_region_t        *update)
+{
+  cairo_format_t format = cairo_image_surface_get_format (content);
+  int stride = cairo_image_surface_get_stride (content);
+  uint8_t *data;
+  int i;
+
+  /* Our resampler only knows 32-bit pixels. The other formats are
+   * rare enough to leave to cairo. */
+  if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)
+    {
+      cairo_t *cr;
+
+      cairo_surface_set_device_scale (scaled, 1, 1);
+      cairo_surface_set_device_scale (content, 1, 1);
+
+      cr = cairo_create (scaled);
+      gdk_cairo_region (cr, update);
+      cairo_clip (cr);
+      cairo_scale (cr,
+                   (double) cairo_image_surface_get_width (scaled) / src->width,
+                   (double) cairo_image_surface_get_height (scaled) / src->height);
+      cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+      cairo_set_source_surface (cr, content, -src->x, -src->y);
+      cairo_pattern_set_filter (cairo_get_source (cr), CAIRO_FILTER_GOOD);
+      cairo_paint (cr);
+      cairo_destroy (cr);
+      return;
+    }
+
+  cairo_surface_flush (scaled);
+  cairo_surface_flush (content);
+
+  data = cairo_image_surface_get_data (content) + src->y * stride + src->x * 4;
+
+  for (i = 0; i < cairo_region_num_rectangles (update); i++)
+    {
+      cairo_rectangle_int_t rect;
+
+      cairo_region_get_rectangle (update, i, &rect);
+      wakefield_scale_rect (cairo_image_surface_get_data (scaled),
+                            cairo_image_surface_get_stride (scaled),
+                            cairo_image_surface_get_width (scaled),
+                            cairo_image_surface_get_height (scaled),
+                            data, stride, src->width, src->height,
+                            &rect);
+      cairo_surface_mark_dirty_rectangle (scaled, rect.x, rect.y, rect.width, rect.height);
+    }
+}
+
+/* Paints the surface resampled to @content_rect, through a scaled
+ * copy we keep around, so the resampling is only ever redone for the
+ * damage, or when the size we show it at changes. */
+static void
+draw_scaled (cairo_t                 *cr,
+             struct WakefieldSurface *surface,
+             cairo_rectangle_int_t   *content_rect,
+             cairo_rectangle_int_t   *src,
+             cairo_region_t          *paint_region,
+             cairo_region_t          *opaque_region)
+{
+  int widget_scale = gtk_widget_get_scale_factor (GTK_WIDGET (surface->compositor));
+  int dst_width = content_rect->width * widget_scale;
+  int dst_height = content_rect->height * widget_scale;
+  struct WakefieldBuffer *buffer = surface->backing ? NULL : surface->current.buffer;
+  struct wl_shm_buffer *shm_buffer = NULL;
+  cairo_surface_t *content;
+  cairo_format_t format;
+  cairo_region_t *update;
+
+  /* Don't bother resampling what's covered up, but remember what it
+   * missed for when it shows again. */
+  if (cairo_region_is_empty (paint_region))
+    {
+      if (surface->scaled)
+        {
+          if (!surface->scaled_damage)
+            surface->scaled_damage = cairo_region_create ();
+          cairo_region_union (surface->scaled_damage, surface->current.buffer_damage);
+        }
+      return;
+    }
+
+  if (buffer)
+    {
+      shm_buffer = wl_shm_buffer_get (buffer->resource);
+      wl_shm_buffer_begin_access (shm_buffer);
+    }
+
+  content = get_content (surface);
+  format = cairo_image_surface_get_format (content) == CAIRO_FORMAT_ARGB32 ?
+    CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24;
+
+  if (surface->scaled &&
+      (cairo_image_surface_get_format (surface->scaled) != format ||
+       cairo_image_surface_get_width (surface->scaled) != dst_width ||
+       cairo_image_surface_get_height (surface->scaled) != dst_height ||
+       memcmp (&surface->scaled_src, src, sizeof (*src)) != 0))
+    g_clear_pointer (&surface->scaled, cairo_surface_destroy);
+
+  if (!surface->scaled)
+    {
+      cairo_rectangle_int_t all = { 0, 0, dst_width, dst_height };
+
+      surface->scaled = cairo_image_surface_create (format, dst_width, dst_height);
+      surface->scaled_src = *src;
+      update = cairo_region_create_rectangle (&all);
+    }
+  else
+    {
+      cairo_region_t *damage = surface->current.buffer_damage;
+      int i;
+
+      if (surface->scaled_damage)
+        {
+          cairo_region_union (surface->scaled_damage, damage);
+          damage = surface->scaled_damage;
+        }
+
+      /* See what samples from the damaged pixels. */
+      update = cairo_region_create ();
+      for (i = 0; i < cairo_region_num_rectangles (damage); i++)
+        {
+          cairo_rectangle_int_t rect;
+
+          cairo_region_get_rectangle (damage, i, &rect);
+          rect.x -= src->x;
+          rect.y -= src->y;
+
+          wakefield_scale_map_rect (src->width, src->height, dst_width, dst_height, &rect);
+          cairo_region_union_rectangle (update, &rect);
+        }
+    }
+
+  g_clear_pointer (&surface->scaled_damage, cairo_region_destroy);
+
+  if (!cairo_region_is_empty (update))
+    update_scaled (surface->scaled, content, src, update);
+
+  cairo_region_destroy (update);
+
+  /* We keep the buffer until the client attaches another: the scaled
+   * copy gets thrown away whenever what we show it at changes, and
+   * has to be redone from it then. */
+  if (buffer)
+    wl_shm_buffer_end_access (shm_buffer);
+
+  paint_content (cr, surface->scaled, content_rect->x, content_rect->y,
+                 widget_scale, paint_region, opaque_region);
+}
+
+static void
+draw_surface (cairo_t                 *cr,
+              struct WakefieldSurface *surface,
+              cairo_region_t          *paint_region,
+              cairo_region_t          *opaque_region)
+{
+  cairo_rectangle_int_t content_rect, src;
+  int scale = surface->current.scale;
+
+  get_content_rect (surface, &content_rect);
+  get_source_rect (surface, &src);
+
+  if (content_rect.width * scale != src.width || content_rect.height * scale != src.height)
+    draw_scaled (cr, surface, &content_rect, &src, paint_region, opaque_region);
+  else
+    {
+      struct WakefieldBuffer *buffer = surface->backing ? NULL : surface->current.buffer;
+      struct wl_shm_buffer *shm_buffer = NULL;
+
+      /* The scaled copy won't be kept up to date while we don't use
+       * it. */
+      g_clear_pointer (&surface->scaled, cairo_surface_destroy);
+
+      if (buffer)
+        {
+          shm_buffer = wl_shm_buffer_get (buffer->resource);
+          wl_shm_buffer_begin_access (shm_buffer);
+        }
+
+      paint_content (cr, get_content (surface),
+                     content_rect.x - (double) src.x / scale,
+                     content_rect.y - (double) src.y / scale,
+                     scale, paint_region, opaque_region);
+
+      if (buffer)
+        {
+          wl_shm_buffer_end_access (shm_buffer);
+          wakefield_buffer_release (buffer);
+          mark_needs_flush (surface->compositor);
+        }
+    }
+}
+
+/* Paints the surface tree. GTK's clip already covers the damage we
+ * queued in commit, as well as anything exposed in the meantime, so
+ * we paint exactly that. Working down from the top, each surface only
+ * gets the part nothing opaque above it covers, so e.g. an opaque
+ * video subsurface doesn't make us repaint its parent underneath. */
+static void
+draw_surfaces (cairo_t             *cr,
+               WakefieldCompositor *compositor)
+{
+  GPtrArray *surfaces = get_surfaces (compositor);
+  cairo_region_t **paint_regions, **opaque_regions;
+  cairo_region_t *visible;
+  struct WakefieldSurface *surface;
+  guint i;
+
+  paint_regions = g_new (cairo_region_t *, surfaces->len);
+  opaque_regions = g_new (cairo_region_t *, surfaces->len);
+  visible = get_clip_region (cr);
+
+  for (i = surfaces->len; i-- > 0; )
+    {
+      cairo_rectangle_int_t content_rect;
+
+      surface = g_ptr_array_index (surfaces, i);
+      get_content_rect (surface, &content_rect);
+
+      paint_regions[i] = cairo_region_copy (visible);
+      cairo_region_intersect_rectangle (paint_regions[i], &content_rect);
+
+      opaque_regions[i] = get_opaque_region (surface);
+      cairo_region_subtract (visible, opaque_regions[i]);
+    }
+
+  for (i = 0; i < surfaces->len; i++)
+    {
+      draw_surface (cr, g_ptr_array_index (surfaces, i), paint_regions[i], opaque_regions[i]);
+      cairo_region_destroy (paint_regions[i]);
+      cairo_region_destroy (opaque_regions[i]);
+    }
+
+  cairo_region_destroy (visible);
+  g_free (paint_regions);
+  g_free (opaque_regions);
+  g_ptr_array_free (surfaces, TRUE);
+
+  /* Everything committed so far is on screen now, or never will be. */
+  wl_list_for_each (surface, get_shown_surfaces (compositor), link)
+    {
+      cairo_rectangle_int_t nothing = { 0, 0, 0, 0 };
+      cairo_region_intersect_rectangle (surface->current.damage, &nothing);
+      cairo_region_intersect_rectangle (surface->current.buffer_damage, &nothing);
+    }
 }
 
-static cairo_format_t
-cairo_format_for_wl_shm_format (enum wl_shm_format format)
+/* Returns the retained surface, (re)creating it if our size or scale
+ * changed, or NULL if it wouldn't save us anything here. */
+static cairo_surface_t *
+ensure_retained (WakefieldCompositor *compositor)
 {
-  switch (format)
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  GtkWidget *widget = GTK_WIDGET (compositor);
+  GdkWindow *window = gtk_widget_get_window (widget);
+  int width = gtk_widget_get_allocated_width (widget);
+  int height = gtk_widget_get_allocated_height (widget);
+  int scale = gtk_widget_get_scale_factor (widget);
+  cairo_rectangle_int_t all = { 0, 0, width, height };
+
+#ifdef GDK_WINDOWING_X11
+  if (!GDK_IS_X11_WINDOW (window))
+    return NULL;
+#else
+  return NULL;
+#endif
+
+  if ((priv->retained || priv->retained_unsupported) &&
+      priv->retained_width == width &&
+      priv->retained_height == height &&
+      priv->retained_scale == scale)
+    return priv->retained;
+
+  g_clear_pointer (&priv->retained, cairo_surface_destroy);
+
+  priv->retained_width = width;
+  priv->retained_height = height;
+  priv->retained_scale = scale;
+
+  priv->retained = gdk_window_create_similar_surface (window,
+                                                      CAIRO_CONTENT_COLOR_ALPHA,
+                                                      width, height);
+
+  /* Painting an image surface into another is no cheaper than
+   * painting the client's buffer directly. Remember that, so we
+   * don't try again until our size or scale changes. */
+  priv->retained_unsupported = cairo_surface_get_type (priv->retained) == CAIRO_SURFACE_TYPE_IMAGE;
+  if (priv->retained_unsupported)
     {
-    case WL_SHM_FORMAT_ARGB8888:
-      return CAIRO_FORMAT_ARGB32;
-    case WL_SHM_FORMAT_XRGB8888:
-      return CAIRO_FORMAT_RGB24;
-    default:
-      g_assert_not_reached ();
+      g_clear_pointer (&priv->retained, cairo_surface_destroy);
+      return NULL;
     }
+
+  cairo_region_destroy (priv->retained_damage);
+  priv->retained_damage = cairo_region_create_rectangle (&all);
+
+  return priv->retained;
 }
 
-static uint32_t
-get_time (void)
+/* Used when what we show changes without the client sending damage. */
+static void
+damage_all (WakefieldCompositor *compositor)
 {
-  struct timeval tv;
-  gettimeofday (&tv, NULL);
-  return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldSurface *surface;
+
+  if (defer_to_scene (compositor))
+    return;
+
+  g_clear_pointer (&priv->retained, cairo_surface_destroy);
+  wl_list_for_each (surface, get_shown_surfaces (compositor), link)
+    g_clear_pointer (&surface->scaled, cairo_surface_destroy);
+  gtk_widget_queue_draw (GTK_WIDGET (compositor));
 }
 
+/* Used when surfaces move around, and for what's under ones going
+ * away: repaints @region, in widget coordinates, as it is. */
 static void
-draw_surface (cairo_t                 *cr,
-              struct WakefieldSurface *surface)
+damage_region (WakefieldCompositor *compositor,
+               cairo_region_t      *region)
 {
-  struct wl_shm_buffer *shm_buffer;
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
 
-  shm_buffer = wl_shm_buffer_get (surface->current.buffer);
-  if (shm_buffer)
-    {
-      cairo_surface_t *cr_surface;
+  if (defer_to_scene (compositor) || cairo_region_is_empty (region))
+    return;
 
-      wl_shm_buffer_begin_access (shm_buffer);
+  cairo_region_union (priv->retained_damage, region);
+  gtk_widget_queue_draw_region (GTK_WIDGET (compositor), region);
+}
+
+/* Repaints what @surface and its subsurfaces cover. */
+static void
+damage_tree (struct WakefieldSurface *surface)
+{
+  cairo_region_t *extents;
 
-      cr_surface = cairo_image_surface_create_for_data (wl_shm_buffer_get_data (shm_buffer),
-                                                        cairo_format_for_wl_shm_format (wl_shm_buffer_get_format (shm_buffer)),
-                                                        wl_shm_buffer_get_width (shm_buffer),
-                                                        wl_shm_buffer_get_height (shm_buffer),
-                                                        wl_shm_buffer_get_stride (shm_buffer));
-      cairo_surface_set_device_scale (cr_surface, surface->current.scale, surface->current.scale);
+  if (defer_to_scene (surface->compositor))
+    return;
 
-      cairo_set_source_surface (cr, cr_surface, 0, 0);
+  extents = cairo_region_create ();
+  add_tree_extents (surface, extents);
+  damage_region (surface->compositor, extents);
+  cairo_region_destroy (extents);
+}
 
-      /* XXX: Do scaling of our surface to match our allocation. */
-      cairo_paint (cr);
+static void
+wakefield_compositor_size_allocate (GtkWidget     *widget,
+                                    GtkAllocation *allocation)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  GtkAllocation old_allocation;
 
-      cairo_surface_destroy (cr_surface);
+  gtk_widget_get_allocation (widget, &old_allocation);
+
+  GTK_WIDGET_CLASS (wakefield_compositor_parent_class)->size_allocate (widget, allocation);
+
+  /* Resizing our window only exposes what's new, but when we scale
+   * our contents to fit, all of it moves. */
+  if (priv->scale_mode != WAKEFIELD_SCALE_MODE_NONE &&
+      (old_allocation.width != allocation->width ||
+       old_allocation.height != allocation->height))
+    damage_all (compositor);
+}
+
+static gboolean
+wakefield_compositor_draw (GtkWidget *widget,
+                           cairo_t   *cr)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  cairo_surface_t *retained = ensure_retained (compositor);
+  struct WakefieldSurface *surface;
 
-      wl_shm_buffer_end_access (shm_buffer);
+  if (!retained)
+    {
+      draw_surfaces (cr, compositor);
+      return TRUE;
     }
-  else
-    g_assert_not_reached ();
 
-  wl_buffer_send_release (surface->current.buffer);
+  /* Bring the retained surface up to date with what was committed,
+   * which only ever touches the damaged areas... */
+  wl_list_for_each (surface, get_shown_surfaces (compositor), link)
+    {
+      cairo_region_t *damage = surface_region_to_widget (surface, surface->current.damage, FALSE);
+      cairo_region_union (priv->retained_damage, damage);
+      cairo_region_destroy (damage);
+    }
 
-  /* Trigger frame callbacks. */
-  {
-    struct wl_resource *cr;
-    /* XXX: Should we use the frame clock for this? */
-    uint32_t time = get_time ();
+  if (!cairo_region_is_empty (priv->retained_damage))
+    {
+      cairo_t *retained_cr = cairo_create (retained);
+      cairo_region_t *clear_region = cairo_region_copy (priv->retained_damage);
+      GPtrArray *surfaces = get_surfaces (compositor);
+      guint i;
+
+      /* The opaque parts get overwritten anyway. */
+      for (i = 0; i < surfaces->len; i++)
+        {
+          cairo_region_t *opaque_region = get_opaque_region (g_ptr_array_index (surfaces, i));
+          cairo_region_subtract (clear_region, opaque_region);
+          cairo_region_destroy (opaque_region);
+        }
+      g_ptr_array_free (surfaces, TRUE);
+
+      cairo_save (retained_cr);
+      gdk_cairo_region (retained_cr, clear_region);
+      cairo_clip (retained_cr);
+      cairo_set_operator (retained_cr, CAIRO_OPERATOR_CLEAR);
+      cairo_paint (retained_cr);
+      cairo_restore (retained_cr);
+      cairo_region_destroy (clear_region);
+
+      gdk_cairo_region (retained_cr, priv->retained_damage);
+      cairo_clip (retained_cr);
+
+      draw_surfaces (retained_cr, compositor);
+
+      cairo_destroy (retained_cr);
 
-    wl_resource_for_each (cr, &surface->current.frame_callbacks)
       {
-        wl_callback_send_done (cr, time);
+        cairo_rectangle_int_t nothing = { 0, 0, 0, 0 };
+        cairo_region_intersect_rectangle (priv->retained_damage, &nothing);
       }
+    }
 
-    wl_list_init (&surface->current.frame_callbacks);
-  }
+  /* ... and then exposes are just a copy on the server. */
+  cairo_set_source_surface (cr, retained, 0, 0);
+  cairo_paint (cr);
+
+  return TRUE;
 }
 
 static gboolean
-wakefield_compositor_draw (GtkWidget *widget,
-                           cairo_t   *cr)
+flush_damage (GtkWidget     *widget,
+              GdkFrameClock *frame_clock,
+              gpointer       user_data)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldSurface *surface;
 
-  if (priv->surface)
-    draw_surface (cr, priv->surface);  
+  priv->flush_damage_id = 0;
 
-  return TRUE;
+  wl_list_for_each (surface, get_shown_surfaces (compositor), link)
+    {
+      cairo_region_t *damage = surface_region_to_widget (surface, surface->current.damage, FALSE);
+      gtk_widget_queue_draw_region (widget, damage);
+      cairo_region_destroy (damage);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+/* However fast the client commits, we only queue one draw per frame,
+ * covering all the damage committed since the last one. */
+static void
+schedule_draw (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  if (defer_to_scene (compositor))
+    return;
+
+  /* A tick callback would keep the whole toplevel's frame clock busy
+   * for nothing; the damage is drawn when we're shown again. */
+  if (priv->hidden)
+    return;
+
+  if (priv->flush_damage_id == 0)
+    priv->flush_damage_id = gtk_widget_add_tick_callback (GTK_WIDGET (compositor), flush_damage, NULL, NULL);
 }
 
 static void
@@ -209,9 +2395,19 @@ unbind_resource (struct wl_resource *resource)
   wl_list_remove (wl_resource_get_link (resource));
 }
 
+static void update_cursor (WakefieldCompositor *compositor);
+static void attach_event_source (WakefieldCompositor *compositor);
+static void commit_constraint (struct WakefieldSurface *surface);
+static void update_keyboard_focus (WakefieldCompositor *compositor);
+static void detach_constraint (struct WakefieldSurface *surface);
+static void set_output_scale (WakefieldCompositor *compositor,
+                              int                  scale);
+
 /* Break the surface and seat code out since it's getting too tricky */
 #include "wakefield-surface.c"
+#include "wakefield-constraints.c"
 #include "wakefield-seat.c"
+#include "wakefield-thread.c"
 
 static void
 bind_output (struct wl_client *client,
@@ -220,12 +2416,61 @@ bind_output (struct wl_client *client,
              uint32_t id)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (data);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *cr;
 
   cr = wl_resource_create (client, &wl_output_interface, version, id);
   wl_resource_set_destructor (cr, unbind_resource);
-  /* wl_list_insert (&priv->output_resources, cr); */
-  wl_output_send_scale (cr, gtk_widget_get_scale_factor (GTK_WIDGET (compositor)));
+  wl_list_insert (&priv->output_resources, wl_resource_get_link (cr));
+  wl_output_send_scale (cr, priv->output_scale);
+}
+
+static void
+set_output_scale (WakefieldCompositor *compositor,
+                  int                  scale)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_resource *output;
+
+  if (scale == priv->output_scale)
+    return;
+
+  priv->output_scale = scale;
+
+  wl_resource_for_each (output, &priv->output_resources)
+    {
+      if (wl_resource_get_version (output) < WL_OUTPUT_DONE_SINCE_VERSION)
+        continue;
+
+      wl_output_send_scale (output, scale);
+      wl_output_send_done (output);
+    }
+}
+
+/* Tells outputs about the scale factor GTK shows us at, without the
+ * dispatch thread having to ask GTK. */
+static void
+wakefield_compositor_notify_scale_factor (GObject    *object,
+                                          GParamSpec *pspec,
+                                          gpointer    user_data)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (object);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  int scale = gtk_widget_get_scale_factor (GTK_WIDGET (compositor));
+
+  if (priv->threaded)
+    {
+      struct WakefieldMessage message = { 0 };
+
+      message.type = WAKEFIELD_MESSAGE_OUTPUT_SCALE;
+      message.scale = scale;
+      queue_message (compositor, &message);
+    }
+  else
+    {
+      set_output_scale (compositor, scale);
+      mark_needs_flush (compositor);
+    }
 }
 
 #define WL_OUTPUT_VERSION 2
@@ -234,27 +2479,136 @@ static void
 wakefield_output_init (WakefieldCompositor *compositor)
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-  /* wl_list_init (&priv->output_resources); */
+  wl_list_init (&priv->output_resources);
+  priv->output_scale = 1;
+  g_signal_connect (compositor, "notify::scale-factor",
+                    G_CALLBACK (wakefield_compositor_notify_scale_factor), NULL);
   wl_global_create (priv->wl_display, &wl_output_interface,
                     WL_OUTPUT_VERSION, compositor, bind_output);
 }
 
+static void
+presentation_feedback (struct wl_client *client,
+                       struct wl_resource *resource,
+                       struct wl_resource *surface_resource,
+                       uint32_t callback_id)
+{
+  struct WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+  struct wl_resource *feedback;
+
+  feedback = wl_resource_create (client, &wp_presentation_feedback_interface, 1, callback_id);
+  wl_resource_set_implementation (feedback, NULL, NULL, unbind_resource);
+  wl_list_insert (&surface->pending.feedback_list, wl_resource_get_link (feedback));
+}
+
+static const struct wp_presentation_interface presentation_interface = {
+  resource_release,
+  presentation_feedback
+};
+
+static void
+bind_presentation (struct wl_client *client,
+                   void *data,
+                   uint32_t version,
+                   uint32_t id)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (data);
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &wp_presentation_interface, version, id);
+  wl_resource_set_implementation (cr, &presentation_interface, compositor, NULL);
+
+  /* The clock of both GdkFrameClock and g_get_monotonic_time() */
+  wp_presentation_send_clock_id (cr, CLOCK_MONOTONIC);
+}
+
+#define WP_PRESENTATION_VERSION 1
+
+static void
+wakefield_presentation_init (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  wl_list_init (&priv->presented_frames);
+  wl_global_create (priv->wl_display, &wp_presentation_interface,
+                    WP_PRESENTATION_VERSION, compositor, bind_presentation);
+}
+
+static void
+wakefield_compositor_dispose (GObject *object)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (object);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  if (priv->threaded)
+    stop_dispatch_thread (compositor);
+
+  if (priv->hidden_frame_id)
+    {
+      g_source_remove (priv->hidden_frame_id);
+      priv->hidden_frame_id = 0;
+    }
+
+  if (priv->input_burst_id)
+    {
+      g_source_remove (priv->input_burst_id);
+      priv->input_burst_id = 0;
+    }
+
+  wakefield_pointer_clear_cursor_cache (&priv->seat.pointer);
+
+  G_OBJECT_CLASS (wakefield_compositor_parent_class)->dispose (object);
+}
+
+static void
+wakefield_compositor_finalize (GObject *object)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (object);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  g_clear_pointer (&priv->retained, cairo_surface_destroy);
+  g_clear_pointer (&priv->retained_damage, cairo_region_destroy);
+  g_clear_pointer (&priv->surface_ids, g_hash_table_destroy);
+  g_clear_pointer (&priv->timed_scenes, g_array_unref);
+  g_clear_pointer (&priv->pending_motion, g_array_unref);
+  g_clear_pointer (&priv->pending_touch, g_array_unref);
+  g_clear_pointer (&priv->touch_sequences, g_array_unref);
+
+  wakefield_seat_finalize (compositor);
+
+  G_OBJECT_CLASS (wakefield_compositor_parent_class)->finalize (object);
+}
+
 static void
 wakefield_compositor_class_init (WakefieldCompositorClass *klass)
 {
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
 
+  object_class->dispose = wakefield_compositor_dispose;
+  object_class->finalize = wakefield_compositor_finalize;
+
+  wakefield_format_init ();
+
   widget_class->realize = wakefield_compositor_realize;
+  widget_class->unrealize = wakefield_compositor_unrealize;
+  widget_class->map = wakefield_compositor_map;
+  widget_class->unmap = wakefield_compositor_unmap;
+  widget_class->visibility_notify_event = wakefield_compositor_visibility_notify_event;
+  widget_class->size_allocate = wakefield_compositor_size_allocate;
   widget_class->draw = wakefield_compositor_draw;
   widget_class->enter_notify_event = wakefield_compositor_enter_notify_event;
   widget_class->leave_notify_event = wakefield_compositor_leave_notify_event;
   widget_class->button_press_event = wakefield_compositor_button_press_event;
   widget_class->button_release_event = wakefield_compositor_button_release_event;
   widget_class->motion_notify_event = wakefield_compositor_motion_notify_event;
+  widget_class->scroll_event = wakefield_compositor_scroll_event;
+  widget_class->key_press_event = wakefield_compositor_key_press_event;
+  widget_class->key_release_event = wakefield_compositor_key_release_event;
+  widget_class->focus_in_event = wakefield_compositor_focus_in_event;
+  widget_class->focus_out_event = wakefield_compositor_focus_out_event;
+  widget_class->touch_event = wakefield_compositor_touch_event;
 }
 
-static GSource * wayland_event_source_new (struct wl_display *display);
-
 static void
 wakefield_compositor_init (WakefieldCompositor *compositor)
 {
@@ -262,13 +2616,35 @@ wakefield_compositor_init (WakefieldCompositor *compositor)
   int fds[2];
 
   gtk_widget_set_has_window (GTK_WIDGET (compositor), TRUE);
+  gtk_widget_set_can_focus (GTK_WIDGET (compositor), TRUE);
+
+  priv->retained_damage = cairo_region_create ();
+  wl_list_init (&priv->surfaces);
+  priv->surface_ids = g_hash_table_new (NULL, NULL);
+  priv->timed_scenes = g_array_new (FALSE, FALSE, sizeof (struct WakefieldTimedScene));
+  priv->pending_motion = g_array_new (FALSE, FALSE, sizeof (struct WakefieldMessage));
+  priv->pending_touch = g_array_new (FALSE, FALSE, sizeof (struct WakefieldMessage));
+  priv->touch_sequences = g_array_new (FALSE, FALSE, sizeof (struct WakefieldTouchSequence));
+
+  /* Not mapped yet. */
+  priv->hidden = TRUE;
+  priv->hidden_frame_throttle = WAKEFIELD_FRAME_THROTTLE_REDUCED_RATE;
+  priv->dispatch_priority = G_PRIORITY_DEFAULT;
+  priv->dispatch_budget = 4000;
 
   priv->wl_display = wl_display_create ();
   wl_display_init_shm (priv->wl_display);
+  wakefield_format_add_shm_formats (priv->wl_display);
 
   wakefield_surface_init (compositor);
-  wakefield_seat_init (&priv->seat, priv->wl_display);
+  wakefield_viewporter_init (compositor);
+  wakefield_subcompositor_init (compositor);
+  wakefield_seat_init (compositor);
+  wakefield_input_timestamps_init (compositor);
+  wakefield_relative_pointer_init (compositor);
+  wakefield_pointer_constraints_init (compositor);
   wakefield_output_init (compositor);
+  wakefield_presentation_init (compositor);
 
   socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds);
   priv->client = wl_client_create (priv->wl_display, fds[0]);
@@ -278,7 +2654,7 @@ wakefield_compositor_init (WakefieldCompositor *compositor)
   wl_display_add_socket_auto (priv->wl_display);
 
   /* Attach the wl_event_loop to ours */
-  g_source_attach (wayland_event_source_new (priv->wl_display), NULL);
+  attach_event_source (compositor);
 }
 
 int
@@ -289,6 +2665,202 @@ wakefield_compositor_get_fd (WakefieldCompositor *compositor)
   return priv->client_fd;
 }
 
+/* In copy-on-commit mode, we copy the damaged parts of every
+ * committed buffer into memory we own and release the buffer right
+ * away, rather than holding on to it until GTK gets around to
+ * drawing. This costs a copy, but lets clients keep rendering with
+ * two buffers while the widget is hidden or GTK is busy. */
+void
+wakefield_compositor_set_copy_on_commit (WakefieldCompositor *compositor,
+                                         gboolean             copy_on_commit)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  priv->copy_on_commit = !!copy_on_commit;
+}
+
+gboolean
+wakefield_compositor_get_copy_on_commit (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->copy_on_commit;
+}
+
+/* Controls how often clients get frame callbacks while the widget is
+ * unmapped, fully obscured or in a minimized toplevel: at roughly the
+ * usual rate, once a second, or not at all until we're shown again.
+ * The default is the reduced rate, so hidden clients neither burn CPU
+ * nor stall forever. */
+void
+wakefield_compositor_set_hidden_frame_throttle (WakefieldCompositor    *compositor,
+                                                WakefieldFrameThrottle  throttle)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  if (priv->hidden_frame_throttle == throttle)
+    return;
+
+  priv->hidden_frame_throttle = throttle;
+
+  if (priv->hidden_frame_id)
+    {
+      g_source_remove (priv->hidden_frame_id);
+      priv->hidden_frame_id = 0;
+    }
+
+  schedule_frame (compositor);
+}
+
+WakefieldFrameThrottle
+wakefield_compositor_get_hidden_frame_throttle (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->hidden_frame_throttle;
+}
+
+/* How pointer motion is sent on to clients:
+ *
+ * - IMMEDIATE sends every motion event GDK gives us as it comes.
+ * - COALESCED only sends where the pointer ended up, once per frame
+ *   clock tick, which is all most clients draw anyway.
+ * - HISTORY also holds motion until the tick, but then sends all of
+ *   it, each in a wl_pointer.frame of its own, with GDK's own motion
+ *   compression turned off, for clients that want every sample, like
+ *   drawing programs.
+ *
+ * Either way, motion goes out before any other pointer event that
+ * comes after it. The default is IMMEDIATE.
+ *
+ * Touch events always wait for the tick, to go out in a single
+ * wl_touch.frame, and outside of HISTORY, only the latest motion of
+ * each point is kept. Scrolling is added up until the tick in every
+ * mode. */
+void
+wakefield_compositor_set_motion_mode (WakefieldCompositor *compositor,
+                                      WakefieldMotionMode  motion_mode)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  GdkWindow *window = gtk_widget_get_window (GTK_WIDGET (compositor));
+
+  if (priv->motion_mode == motion_mode)
+    return;
+
+  flush_pending_motion (compositor);
+  priv->motion_mode = motion_mode;
+
+  if (window)
+    gdk_window_set_event_compression (window, motion_mode != WAKEFIELD_MOTION_MODE_HISTORY);
+}
+
+WakefieldMotionMode
+wakefield_compositor_get_motion_mode (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->motion_mode;
+}
+
+/* In threaded mode, the Wayland side of the compositor runs on a
+ * thread of its own, so clients get their replies and buffers back
+ * while GTK is busy drawing, and a chatty client doesn't hold up GTK's
+ * event handling. Neither side ever waits for the other: the dispatch
+ * thread hands GTK snapshots of what to show, and GTK hands it input
+ * and frame timings. Everything clients commit goes through our own
+ * backing store in this mode, which costs a copy of the damage on
+ * every commit, and of the whole surface when GTK still shows the
+ * last one. */
+void
+wakefield_compositor_set_threaded_dispatch (WakefieldCompositor *compositor,
+                                            gboolean             threaded)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  if (priv->threaded == !!threaded)
+    return;
+
+  if (threaded)
+    {
+      start_dispatch_thread (compositor);
+      return;
+    }
+
+  stop_dispatch_thread (compositor);
+  attach_event_source (compositor);
+
+  update_cursor (compositor);
+  damage_all (compositor);
+}
+
+gboolean
+wakefield_compositor_get_threaded_dispatch (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->threaded;
+}
+
+/* The priority the Wayland side is dispatched at on the GTK main loop,
+ * G_PRIORITY_DEFAULT by default. Going below GDK_PRIORITY_REDRAW lets
+ * GTK paint before it gets to what clients sent. This has no effect in
+ * threaded mode. */
+void
+wakefield_compositor_set_dispatch_priority (WakefieldCompositor *compositor,
+                                            int                  priority)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  priv->dispatch_priority = priority;
+  if (priv->event_source)
+    g_source_set_priority (priv->event_source, priority);
+}
+
+int
+wakefield_compositor_get_dispatch_priority (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->dispatch_priority;
+}
+
+/* How long, in microseconds, we keep dispatching client requests
+ * before letting the rest of the GTK main loop run, 4ms by default.
+ * Whatever is left over gets dispatched on the next iteration. With a
+ * budget of 0, we only go once around the clients each time. This has
+ * no effect in threaded mode. */
+void
+wakefield_compositor_set_dispatch_budget (WakefieldCompositor *compositor,
+                                          gint64               budget_us)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  priv->dispatch_budget = MAX (budget_us, 0);
+}
+
+gint64
+wakefield_compositor_get_dispatch_budget (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->dispatch_budget;
+}
+
+/* How many times we dispatched client requests on the GTK main loop,
+ * and how many of those ran out of budget with requests left over. */
+void
+wakefield_compositor_get_dispatch_stats (WakefieldCompositor *compositor,
+                                         guint64             *dispatches,
+                                         guint64             *budget_hits)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  if (dispatches)
+    *dispatches = priv->dispatches;
+  if (budget_hits)
+    *budget_hits = priv->dispatch_budget_hits;
+}
+
 
 
 /* Wayland GSource */
@@ -296,6 +2868,7 @@ wakefield_compositor_get_fd (WakefieldCompositor *compositor)
 typedef struct
 {
   GSource source;
+  WakefieldCompositor *compositor;
   struct wl_display *display;
 } WaylandEventSource;
 
@@ -303,24 +2876,61 @@ static gboolean
 wayland_event_source_prepare (GSource *base, int *timeout)
 {
   WaylandEventSource *source = (WaylandEventSource *)base;
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (source->compositor);
 
   *timeout = -1;
 
-  wl_display_flush_clients (source->display);
+  /* Most iterations of the main loop have nothing to do with us. */
+  if (priv->needs_flush && !priv->input_burst_id)
+    {
+      priv->needs_flush = FALSE;
+      wl_display_flush_clients (source->display);
+    }
 
   return FALSE;
 }
 
+static gboolean
+event_loop_has_events (struct wl_event_loop *loop)
+{
+  struct pollfd pfd = { wl_event_loop_get_fd (loop), POLLIN, 0 };
+
+  return poll (&pfd, 1, 0) > 0;
+}
+
 static gboolean
 wayland_event_source_dispatch (GSource *base,
                                GSourceFunc callback,
                                void *data)
 {
   WaylandEventSource *source = (WaylandEventSource *)base;
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (source->compositor);
   struct wl_event_loop *loop = wl_display_get_event_loop (source->display);
+  gint64 deadline = g_get_monotonic_time () + priv->dispatch_budget;
+
+  priv->dispatches++;
+
+  /* Each time around, libwayland reads once from every client with
+   * something to say and dispatches what it got, so clients take
+   * turns, and one flooding us with requests only gets its share. */
+  while (TRUE)
+    {
+      wl_event_loop_dispatch (loop, 0);
+
+      if (!event_loop_has_events (loop))
+        break;
+
+      if (g_get_monotonic_time () >= deadline)
+        {
+          priv->dispatch_budget_hits++;
+          break;
+        }
 
-  wl_event_loop_dispatch (loop, 0);
+      /* Don't keep the replies waiting for the rest. */
+      wl_display_flush_clients (source->display);
+    }
 
+  mark_needs_flush (source->compositor);
   return TRUE;
 }
 
@@ -332,18 +2942,54 @@ static GSourceFuncs wayland_event_source_funcs =
   NULL
 };
 
-static GSource *
-wayland_event_source_new (struct wl_display *display)
+static void
+attach_event_source (WakefieldCompositor *compositor)
 {
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   WaylandEventSource *source;
-  struct wl_event_loop *loop = wl_display_get_event_loop (display);
+  struct wl_event_loop *loop = wl_display_get_event_loop (priv->wl_display);
 
   source = (WaylandEventSource *) g_source_new (&wayland_event_source_funcs,
                                                 sizeof (WaylandEventSource));
-  source->display = display;
+  source->compositor = compositor;
+  source->display = priv->wl_display;
   g_source_add_unix_fd (&source->source,
                         wl_event_loop_get_fd (loop),
                         G_IO_IN | G_IO_ERR);
+  g_source_set_priority (&source->source, priv->dispatch_priority);
+
+  priv->event_source = &source->source;
+  g_source_attach (priv->event_source, NULL);
+}
+
+/* How the client's contents are fitted into our allocation:
+ *
+ * - NONE shows them at their own size, in the top left corner.
+ * - FIT scales them as large as fits, keeping the aspect ratio.
+ * - FILL scales them to cover all of it, keeping the aspect ratio
+ *   and cropping what doesn't fit.
+ * - STRETCH scales them to exactly our allocation.
+ * - INTEGER is like FIT, but only by whole factors, for pixel-exact
+ *   contents.
+ *
+ * The scaled modes center the contents. The default is NONE. */
+void
+wakefield_compositor_set_scale_mode (WakefieldCompositor *compositor,
+                                     WakefieldScaleMode   scale_mode)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  if (priv->scale_mode == scale_mode)
+    return;
+
+  priv->scale_mode = scale_mode;
+  damage_all (compositor);
+}
+
+WakefieldScaleMode
+wakefield_compositor_get_scale_mode (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
 
-  return &source->source;
+  return priv->scale_mode;
 }
@@ -31,6 +31,29 @@
 #define WAKEFIELD_IS_COMPOSITOR_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass),  WAKEFIELD_TYPE_COMPOSITOR))
 #define WAKEFIELD_COMPOSITOR_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj),  WAKEFIELD_TYPE_COMPOSITOR, WakefieldCompositorClass))
 
+typedef enum
+{
+  WAKEFIELD_FRAME_THROTTLE_FULL_RATE,
+  WAKEFIELD_FRAME_THROTTLE_REDUCED_RATE,
+  WAKEFIELD_FRAME_THROTTLE_SUSPENDED,
+} WakefieldFrameThrottle;
+
+typedef enum
+{
+  WAKEFIELD_SCALE_MODE_NONE,
+  WAKEFIELD_SCALE_MODE_FIT,
+  WAKEFIELD_SCALE_MODE_FILL,
+  WAKEFIELD_SCALE_MODE_STRETCH,
+  WAKEFIELD_SCALE_MODE_INTEGER,
+} WakefieldScaleMode;
+
+typedef enum
+{
+  WAKEFIELD_MOTION_MODE_IMMEDIATE,
+  WAKEFIELD_MOTION_MODE_COALESCED,
+  WAKEFIELD_MOTION_MODE_HISTORY,
+} WakefieldMotionMode;
+
 typedef struct _WakefieldCompositor        WakefieldCompositor;
 typedef struct _WakefieldCompositorClass   WakefieldCompositorClass;
 
@@ -47,3 +70,35 @@ struct _WakefieldCompositorClass
 GType wakefield_compositor_get_type (void) G_GNUC_CONST;
 
 int wakefield_compositor_get_fd (WakefieldCompositor *compositor);
+
+void wakefield_compositor_set_copy_on_commit (WakefieldCompositor *compositor,
+                                              gboolean             copy_on_commit);
+gboolean wakefield_compositor_get_copy_on_commit (WakefieldCompositor *compositor);
+
+void wakefield_compositor_set_hidden_frame_throttle (WakefieldCompositor    *compositor,
+                                                     WakefieldFrameThrottle  throttle);
+WakefieldFrameThrottle wakefield_compositor_get_hidden_frame_throttle (WakefieldCompositor *compositor);
+
+void wakefield_compositor_set_threaded_dispatch (WakefieldCompositor *compositor,
+                                                 gboolean             threaded);
+gboolean wakefield_compositor_get_threaded_dispatch (WakefieldCompositor *compositor);
+
+void wakefield_compositor_set_dispatch_priority (WakefieldCompositor *compositor,
+                                                 int                  priority);
+int wakefield_compositor_get_dispatch_priority (WakefieldCompositor *compositor);
+
+void wakefield_compositor_set_dispatch_budget (WakefieldCompositor *compositor,
+                                               gint64               budget_us);
+gint64 wakefield_compositor_get_dispatch_budget (WakefieldCompositor *compositor);
+
+void wakefield_compositor_get_dispatch_stats (WakefieldCompositor *compositor,
+                                              guint64             *dispatches,
+                                              guint64             *budget_hits);
+
+void wakefield_compositor_set_motion_mode (WakefieldCompositor *compositor,
+                                           WakefieldMotionMode  motion_mode);
+WakefieldMotionMode wakefield_compositor_get_motion_mode (WakefieldCompositor *compositor);
+
+void wakefield_compositor_set_scale_mode (WakefieldCompositor *compositor,
+                                          WakefieldScaleMode   scale_mode);
+WakefieldScaleMode wakefield_compositor_get_scale_mode (WakefieldCompositor *compositor);
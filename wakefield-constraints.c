@@ -0,0 +1,632 @@
+/*
+ * Copyright (C) 2015 Endless Mobile
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * Written by:
+ *     Jasper St. Pierre <jstpierre@mecheye.net>
+ */
+
+/* Pointer constraints
+ *
+ * The Wayland side works out when a constraint is active. GTK enforces
+ * it with a grab on our window, warping the pointer back whenever it
+ * strays: to where it got locked, or into the extents of the region
+ * it's confined to, since GDK can't confine it to anything finer. */
+
+struct WakefieldPointerConstraint
+{
+  struct wl_resource *resource;
+  WakefieldCompositor *compositor;
+
+  /* NULL once the surface is gone, which leaves us inert. */
+  struct WakefieldSurface *surface;
+
+  gboolean lock;
+  uint32_t lifetime;
+
+  /* In surface coordinates, with NULL meaning all of it. The region
+   * from set_region only applies from the surface's next commit. */
+  cairo_region_t *region;
+  cairo_region_t *pending_region;
+  gboolean has_pending_region;
+
+  /* Whether we're enforcing it, and for oneshot constraints, whether
+   * we're done with it. */
+  gboolean active;
+  gboolean defunct;
+};
+
+/* GTK side */
+
+static void
+release_constraint_grab (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  if (priv->constraint_grab)
+    {
+      gdk_seat_ungrab (priv->constraint_grab);
+      priv->constraint_grab = NULL;
+    }
+}
+
+/* Starts enforcing @state, which the Wayland side decided on. */
+static void
+show_constraint (WakefieldCompositor                    *compositor,
+                 const struct WakefieldConstraintState  *state)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  GdkWindow *window = gtk_widget_get_window (GTK_WIDGET (compositor));
+  GdkSeat *seat;
+
+  priv->shown_constraint = *state;
+
+  if (state->kind == WAKEFIELD_CONSTRAINT_NONE || !window)
+    {
+      release_constraint_grab (compositor);
+      return;
+    }
+
+  /* The pointer stays where it is, which is where we last saw it. */
+  priv->lock_root_x = floor (priv->last_root_x + 0.5);
+  priv->lock_root_y = floor (priv->last_root_y + 0.5);
+
+  if (priv->constraint_grab)
+    return;
+
+  seat = gdk_display_get_default_seat (gdk_window_get_display (window));
+  if (gdk_seat_grab (seat, window, GDK_SEAT_CAPABILITY_ALL_POINTING, FALSE,
+                     NULL, NULL, NULL, NULL) == GDK_GRAB_SUCCESS)
+    priv->constraint_grab = seat;
+}
+
+/* Works out where the pointer is confined to, in widget coordinates.
+ * Returns FALSE if the surface isn't shown. */
+static gboolean
+get_confine_rect (WakefieldCompositor   *compositor,
+                  cairo_rectangle_int_t *rect)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldSurface *surface = NULL;
+  GPtrArray *surfaces = get_surfaces (compositor);
+  cairo_rectangle_int_t content_rect, bounds = { 0, 0, 0, 0 };
+  int x0, y0, x1, y1;
+  guint i;
+
+  for (i = 0; i < surfaces->len; i++)
+    {
+      struct WakefieldSurface *shown = g_ptr_array_index (surfaces, i);
+
+      if (shown->id == priv->shown_constraint.surface_id)
+        surface = shown;
+    }
+
+  g_ptr_array_free (surfaces, TRUE);
+
+  if (!surface || !get_content_rect (surface, &content_rect))
+    return FALSE;
+
+  get_surface_size (surface, &bounds.width, &bounds.height);
+  if (priv->shown_constraint.bounded)
+    gdk_rectangle_intersect (&bounds, &priv->shown_constraint.rect, &bounds);
+
+  if (bounds.width <= 0 || bounds.height <= 0)
+    return FALSE;
+
+  x0 = content_rect.x + ceil ((double) bounds.x * content_rect.width / bounds.width);
+  y0 = content_rect.y + ceil ((double) bounds.y * content_rect.height / bounds.height);
+  x1 = content_rect.x + floor ((double) (bounds.x + bounds.width) * content_rect.width / bounds.width);
+  y1 = content_rect.y + floor ((double) (bounds.y + bounds.height) * content_rect.height / bounds.height);
+
+  rect->x = x0;
+  rect->y = y0;
+  rect->width = MAX (x1 - x0, 1);
+  rect->height = MAX (y1 - y0, 1);
+  return TRUE;
+}
+
+#ifdef GDK_WINDOWING_X11
+/* How many of our widgets want XI_RawMotion, which is selected for the
+ * whole client. */
+static guint raw_motion_users;
+
+/* Adds up the unaccelerated motion in XI_RawMotion, which comes ahead
+ * of the core motion it turns into, for the next motion event. */
+static GdkFilterReturn
+raw_motion_filter (GdkXEvent *xevent,
+                   GdkEvent  *event,
+                   gpointer   user_data)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (user_data);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  XGenericEventCookie *cookie = &((XEvent *) xevent)->xcookie;
+  XIRawEvent *raw;
+  double *value;
+  int i;
+
+  if (cookie->type != GenericEvent || cookie->extension != priv->xi_opcode ||
+      cookie->evtype != XI_RawMotion || !cookie->data)
+    return GDK_FILTER_CONTINUE;
+
+  raw = cookie->data;
+  value = raw->raw_values;
+
+  /* The values are only there for the valuators in the mask, and the
+   * first two are the X and Y axes. */
+  for (i = 0; i < 2 && i < raw->valuators.mask_len * 8; i++)
+    {
+      if (!XIMaskIsSet (raw->valuators.mask, i))
+        continue;
+
+      if (i == 0)
+        priv->raw_dx += *value;
+      else
+        priv->raw_dy += *value;
+      value++;
+    }
+
+  return GDK_FILTER_CONTINUE;
+}
+
+static void
+select_raw_motion (Display  *xdisplay,
+                   gboolean  selected)
+{
+  unsigned char bits[XIMaskLen (XI_RawMotion)] = { 0 };
+  XIEventMask mask;
+
+  if (selected)
+    XISetMask (bits, XI_RawMotion);
+
+  mask.deviceid = XIAllMasterDevices;
+  mask.mask_len = sizeof (bits);
+  mask.mask = bits;
+  XISelectEvents (xdisplay, DefaultRootWindow (xdisplay), &mask, 1);
+}
+#endif
+
+/* Has the X server send us unaccelerated motion for relative pointers,
+ * where there's one to ask. */
+static void
+attach_raw_motion (WakefieldCompositor *compositor)
+{
+#ifdef GDK_WINDOWING_X11
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  GdkDisplay *display = gtk_widget_get_display (GTK_WIDGET (compositor));
+  Display *xdisplay;
+  int event, error;
+
+  if (!GDK_IS_X11_DISPLAY (display))
+    return;
+
+  xdisplay = gdk_x11_display_get_xdisplay (display);
+  if (!XQueryExtension (xdisplay, "XInputExtension", &priv->xi_opcode, &event, &error))
+    return;
+
+  if (raw_motion_users++ == 0)
+    {
+      gdk_x11_display_error_trap_push (display);
+      select_raw_motion (xdisplay, TRUE);
+      gdk_x11_display_error_trap_pop_ignored (display);
+    }
+
+  gdk_window_add_filter (NULL, raw_motion_filter, compositor);
+  priv->raw_dx = priv->raw_dy = 0;
+  priv->has_raw_motion = TRUE;
+#endif
+}
+
+static void
+detach_raw_motion (WakefieldCompositor *compositor)
+{
+#ifdef GDK_WINDOWING_X11
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  GdkDisplay *display = gtk_widget_get_display (GTK_WIDGET (compositor));
+
+  if (!priv->has_raw_motion)
+    return;
+
+  gdk_window_remove_filter (NULL, raw_motion_filter, compositor);
+  priv->has_raw_motion = FALSE;
+
+  if (--raw_motion_users == 0)
+    {
+      gdk_x11_display_error_trap_push (display);
+      select_raw_motion (gdk_x11_display_get_xdisplay (display), FALSE);
+      gdk_x11_display_error_trap_pop_ignored (display);
+    }
+#endif
+}
+
+/* Keeps the pointer where the constraint we enforce wants it, and
+ * works out how far it moved since the last event, in surface
+ * coordinates, with and without acceleration. Without XI_RawMotion,
+ * all we know is the accelerated motion. Returns FALSE for events
+ * that are only the pointer coming back from our warps. */
+static gboolean
+constrain_motion (WakefieldCompositor *compositor,
+                  GdkEventMotion      *event,
+                  double              *x,
+                  double              *y,
+                  double              *dx,
+                  double              *dy,
+                  double              *dx_unaccel,
+                  double              *dy_unaccel)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  double root_x = event->x_root, root_y = event->y_root;
+  gboolean had_last = priv->have_last_root;
+  cairo_rectangle_int_t rect;
+  int width, height;
+
+  *dx = had_last ? root_x - priv->last_root_x : 0;
+  *dy = had_last ? root_y - priv->last_root_y : 0;
+
+  if (priv->has_raw_motion)
+    {
+      *dx_unaccel = priv->raw_dx;
+      *dy_unaccel = priv->raw_dy;
+    }
+  else
+    {
+      *dx_unaccel = *dx;
+      *dy_unaccel = *dy;
+    }
+
+  if (priv->constraint_grab && priv->shown_constraint.kind == WAKEFIELD_CONSTRAINT_LOCK)
+    {
+      root_x = priv->lock_root_x;
+      root_y = priv->lock_root_y;
+    }
+  else if (priv->constraint_grab && get_confine_rect (compositor, &rect))
+    {
+      root_x += CLAMP (event->x, rect.x, rect.x + rect.width - 1) - event->x;
+      root_y += CLAMP (event->y, rect.y, rect.y + rect.height - 1) - event->y;
+    }
+
+  if (root_x != event->x_root || root_y != event->y_root)
+    {
+      root_x = floor (root_x + 0.5);
+      root_y = floor (root_y + 0.5);
+      gdk_device_warp (event->device, gdk_window_get_screen (event->window), root_x, root_y);
+    }
+
+  *x = event->x + (root_x - event->x_root);
+  *y = event->y + (root_y - event->y_root);
+
+  priv->last_root_x = root_x;
+  priv->last_root_y = root_y;
+  priv->have_last_root = TRUE;
+
+  if (had_last && *dx == 0 && *dy == 0 && *dx_unaccel == 0 && *dy_unaccel == 0)
+    return FALSE;
+
+  priv->raw_dx = priv->raw_dy = 0;
+
+  /* Relative motion is in the root surface's coordinates too. */
+  if (get_root_rect (compositor, &rect) &&
+      get_surface_size (get_shown_root (compositor), &width, &height))
+    {
+      *dx *= (double) width / rect.width;
+      *dy *= (double) height / rect.height;
+      *dx_unaccel *= (double) width / rect.width;
+      *dy_unaccel *= (double) height / rect.height;
+    }
+
+  return TRUE;
+}
+
+/* Wayland side */
+
+/* Tells GTK what to enforce: straight away, or in threaded mode, with
+ * the next scene. */
+static void
+publish_constraint (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointerConstraint *constraint = priv->seat.pointer.constraint;
+  struct WakefieldConstraintState state = { WAKEFIELD_CONSTRAINT_NONE };
+
+  if (constraint)
+    {
+      state.kind = constraint->lock ? WAKEFIELD_CONSTRAINT_LOCK : WAKEFIELD_CONSTRAINT_CONFINE;
+      state.surface_id = constraint->surface->id;
+      state.bounded = constraint->region != NULL;
+      if (constraint->region)
+        cairo_region_get_extents (constraint->region, &state.rect);
+    }
+
+  priv->constraint = state;
+  priv->constraint_serial++;
+
+  if (priv->threaded)
+    {
+      priv->scene_dirty = TRUE;
+      return;
+    }
+
+  priv->shown_constraint_serial = priv->constraint_serial;
+  show_constraint (compositor, &state);
+}
+
+static void
+activate_constraint (struct WakefieldPointerConstraint *constraint)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (constraint->compositor);
+
+  priv->seat.pointer.constraint = constraint;
+  constraint->active = TRUE;
+
+  if (constraint->lock)
+    zwp_locked_pointer_v1_send_locked (constraint->resource);
+  else
+    zwp_confined_pointer_v1_send_confined (constraint->resource);
+}
+
+static void
+deactivate_constraint (struct WakefieldPointerConstraint *constraint,
+                       gboolean                           notify)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (constraint->compositor);
+
+  priv->seat.pointer.constraint = NULL;
+  constraint->active = FALSE;
+
+  if (constraint->lifetime != ZWP_POINTER_CONSTRAINTS_V1_LIFETIME_PERSISTENT)
+    constraint->defunct = TRUE;
+
+  if (!notify)
+    return;
+
+  if (constraint->lock)
+    zwp_locked_pointer_v1_send_unlocked (constraint->resource);
+  else
+    zwp_confined_pointer_v1_send_unconfined (constraint->resource);
+}
+
+/* Activates the constraint on the surface the pointer is over once the
+ * pointer gets into its region, and deactivates the active one once
+ * the pointer isn't over its surface anymore. */
+static void
+update_constraint (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+  struct WakefieldPointerConstraint *constraint = NULL;
+
+  if (pointer->focus && pointer->focus->constraint)
+    {
+      constraint = pointer->focus->constraint;
+
+      if (!constraint->active &&
+          (constraint->defunct ||
+           (constraint->region &&
+            !cairo_region_contains_point (constraint->region, floor (pointer->x), floor (pointer->y)))))
+        constraint = NULL;
+    }
+
+  if (constraint == pointer->constraint)
+    return;
+
+  if (pointer->constraint)
+    deactivate_constraint (pointer->constraint, TRUE);
+  if (constraint)
+    activate_constraint (constraint);
+
+  publish_constraint (compositor);
+}
+
+/* Applies the region set since the last commit of @surface. */
+static void
+commit_constraint (struct WakefieldSurface *surface)
+{
+  struct WakefieldPointerConstraint *constraint = surface->constraint;
+
+  if (!constraint || !constraint->has_pending_region)
+    return;
+
+  g_clear_pointer (&constraint->region, cairo_region_destroy);
+  constraint->region = constraint->pending_region;
+  constraint->pending_region = NULL;
+  constraint->has_pending_region = FALSE;
+
+  if (constraint->active)
+    publish_constraint (surface->compositor);
+  else
+    update_constraint (surface->compositor);
+}
+
+/* Leaves the constraint on @surface inert, as the surface is going
+ * away. */
+static void
+detach_constraint (struct WakefieldSurface *surface)
+{
+  struct WakefieldPointerConstraint *constraint = surface->constraint;
+
+  if (!constraint)
+    return;
+
+  if (constraint->active)
+    {
+      deactivate_constraint (constraint, TRUE);
+      publish_constraint (surface->compositor);
+    }
+
+  constraint->surface = NULL;
+  constraint->defunct = TRUE;
+  surface->constraint = NULL;
+}
+
+static void
+pointer_constraint_destructor (struct wl_resource *resource)
+{
+  struct WakefieldPointerConstraint *constraint = wl_resource_get_user_data (resource);
+
+  if (constraint->active)
+    {
+      deactivate_constraint (constraint, FALSE);
+      publish_constraint (constraint->compositor);
+    }
+
+  if (constraint->surface)
+    constraint->surface->constraint = NULL;
+
+  g_clear_pointer (&constraint->region, cairo_region_destroy);
+  g_clear_pointer (&constraint->pending_region, cairo_region_destroy);
+  g_slice_free (struct WakefieldPointerConstraint, constraint);
+}
+
+static void
+pointer_constraint_set_region (struct wl_client   *client,
+                               struct wl_resource *resource,
+                               struct wl_resource *region_resource)
+{
+  struct WakefieldPointerConstraint *constraint = wl_resource_get_user_data (resource);
+
+  g_clear_pointer (&constraint->pending_region, cairo_region_destroy);
+  if (region_resource)
+    {
+      struct WakefieldRegion *region = wl_resource_get_user_data (region_resource);
+      constraint->pending_region = cairo_region_copy (region->region);
+    }
+
+  constraint->has_pending_region = TRUE;
+}
+
+static void
+locked_pointer_set_cursor_position_hint (struct wl_client   *client,
+                                         struct wl_resource *resource,
+                                         wl_fixed_t          surface_x,
+                                         wl_fixed_t          surface_y)
+{
+  /* We never move the pointer on unlocking, so we've no use for it. */
+}
+
+static const struct zwp_locked_pointer_v1_interface locked_pointer_interface = {
+  resource_release,
+  locked_pointer_set_cursor_position_hint,
+  pointer_constraint_set_region,
+};
+
+static const struct zwp_confined_pointer_v1_interface confined_pointer_interface = {
+  resource_release,
+  pointer_constraint_set_region,
+};
+
+static void
+create_pointer_constraint (struct wl_client   *client,
+                           struct wl_resource *resource,
+                           uint32_t            id,
+                           struct wl_resource *surface_resource,
+                           struct wl_resource *region_resource,
+                           uint32_t            lifetime,
+                           gboolean            lock)
+{
+  struct WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+  struct WakefieldPointerConstraint *constraint;
+  int version = wl_resource_get_version (resource);
+
+  if (surface->constraint)
+    {
+      wl_resource_post_error (resource, ZWP_POINTER_CONSTRAINTS_V1_ERROR_ALREADY_CONSTRAINED,
+                              "the pointer is already constrained to wl_surface@%d",
+                              wl_resource_get_id (surface_resource));
+      return;
+    }
+
+  constraint = g_slice_new0 (struct WakefieldPointerConstraint);
+  constraint->compositor = surface->compositor;
+  constraint->surface = surface;
+  constraint->lock = lock;
+  constraint->lifetime = lifetime;
+
+  if (region_resource)
+    {
+      struct WakefieldRegion *region = wl_resource_get_user_data (region_resource);
+      constraint->region = cairo_region_copy (region->region);
+    }
+
+  if (lock)
+    {
+      constraint->resource = wl_resource_create (client, &zwp_locked_pointer_v1_interface, version, id);
+      wl_resource_set_implementation (constraint->resource, &locked_pointer_interface,
+                                      constraint, pointer_constraint_destructor);
+    }
+  else
+    {
+      constraint->resource = wl_resource_create (client, &zwp_confined_pointer_v1_interface, version, id);
+      wl_resource_set_implementation (constraint->resource, &confined_pointer_interface,
+                                      constraint, pointer_constraint_destructor);
+    }
+
+  surface->constraint = constraint;
+  update_constraint (surface->compositor);
+}
+
+static void
+pointer_constraints_lock_pointer (struct wl_client   *client,
+                                  struct wl_resource *resource,
+                                  uint32_t            id,
+                                  struct wl_resource *surface_resource,
+                                  struct wl_resource *pointer_resource,
+                                  struct wl_resource *region_resource,
+                                  uint32_t            lifetime)
+{
+  create_pointer_constraint (client, resource, id, surface_resource, region_resource, lifetime, TRUE);
+}
+
+static void
+pointer_constraints_confine_pointer (struct wl_client   *client,
+                                     struct wl_resource *resource,
+                                     uint32_t            id,
+                                     struct wl_resource *surface_resource,
+                                     struct wl_resource *pointer_resource,
+                                     struct wl_resource *region_resource,
+                                     uint32_t            lifetime)
+{
+  create_pointer_constraint (client, resource, id, surface_resource, region_resource, lifetime, FALSE);
+}
+
+static const struct zwp_pointer_constraints_v1_interface pointer_constraints_interface = {
+  resource_release,
+  pointer_constraints_lock_pointer,
+  pointer_constraints_confine_pointer,
+};
+
+static void
+bind_pointer_constraints (struct wl_client *client,
+                          void *data,
+                          uint32_t version,
+                          uint32_t id)
+{
+  WakefieldCompositor *compositor = data;
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &zwp_pointer_constraints_v1_interface, version, id);
+  wl_resource_set_implementation (cr, &pointer_constraints_interface, compositor, NULL);
+}
+
+#define ZWP_POINTER_CONSTRAINTS_VERSION 1
+
+static void
+wakefield_pointer_constraints_init (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  wl_global_create (priv->wl_display, &zwp_pointer_constraints_v1_interface,
+                    ZWP_POINTER_CONSTRAINTS_VERSION, compositor, bind_pointer_constraints);
+}
@@ -0,0 +1,421 @@
+/*
+ * Copyright (C) 2015 Endless Mobile
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * Written by:
+ *     Jasper St. Pierre <jstpierre@mecheye.net>
+ */
+
+/* The wl_shm formats we support, and how to turn each of them into
+ * something cairo can paint. Formats cairo understands natively are
+ * painted straight out of the client's buffer; the rest get converted
+ * into our backing store on commit, one damaged rectangle at a time. */
+
+#if defined (__x86_64__) || defined (__i386__)
+#include <immintrin.h>
+#endif
+#if defined (__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+enum WakefieldConversion
+{
+  WAKEFIELD_CONVERSION_NONE,
+  WAKEFIELD_CONVERSION_SWAP_RB_8888,
+  WAKEFIELD_CONVERSION_ARGB2101010_TO_8888,
+  WAKEFIELD_CONVERSION_ABGR2101010_TO_8888,
+  WAKEFIELD_CONVERSION_SWAP_RB_2101010,
+};
+
+struct WakefieldFormat
+{
+  enum wl_shm_format shm_format;
+  cairo_format_t cairo_format;
+  int bytes_per_pixel;
+  enum WakefieldConversion conversion;
+};
+
+static const struct WakefieldFormat wakefield_formats[] = {
+  { WL_SHM_FORMAT_ARGB8888,    CAIRO_FORMAT_ARGB32,    4, WAKEFIELD_CONVERSION_NONE },
+  { WL_SHM_FORMAT_XRGB8888,    CAIRO_FORMAT_RGB24,     4, WAKEFIELD_CONVERSION_NONE },
+  { WL_SHM_FORMAT_RGB565,      CAIRO_FORMAT_RGB16_565, 2, WAKEFIELD_CONVERSION_NONE },
+  { WL_SHM_FORMAT_XRGB2101010, CAIRO_FORMAT_RGB30,     4, WAKEFIELD_CONVERSION_NONE },
+  { WL_SHM_FORMAT_ABGR8888,    CAIRO_FORMAT_ARGB32,    4, WAKEFIELD_CONVERSION_SWAP_RB_8888 },
+  { WL_SHM_FORMAT_XBGR8888,    CAIRO_FORMAT_RGB24,     4, WAKEFIELD_CONVERSION_SWAP_RB_8888 },
+  { WL_SHM_FORMAT_ARGB2101010, CAIRO_FORMAT_ARGB32,    4, WAKEFIELD_CONVERSION_ARGB2101010_TO_8888 },
+  { WL_SHM_FORMAT_ABGR2101010, CAIRO_FORMAT_ARGB32,    4, WAKEFIELD_CONVERSION_ABGR2101010_TO_8888 },
+  { WL_SHM_FORMAT_XBGR2101010, CAIRO_FORMAT_RGB30,     4, WAKEFIELD_CONVERSION_SWAP_RB_2101010 },
+};
+
+static const struct WakefieldFormat *
+wakefield_format_for_wl_shm_format (enum wl_shm_format shm_format)
+{
+  unsigned i;
+
+  for (i = 0; i < G_N_ELEMENTS (wakefield_formats); i++)
+    if (wakefield_formats[i].shm_format == shm_format)
+      return &wakefield_formats[i];
+
+  /* libwayland rejects buffers in formats we didn't advertise. */
+  g_assert_not_reached ();
+  return NULL;
+}
+
+static void
+wakefield_format_add_shm_formats (struct wl_display *wl_display)
+{
+  unsigned i;
+
+  for (i = 0; i < G_N_ELEMENTS (wakefield_formats); i++)
+    {
+      /* These two are always advertised by wl_display_init_shm. */
+      if (wakefield_formats[i].shm_format == WL_SHM_FORMAT_ARGB8888 ||
+          wakefield_formats[i].shm_format == WL_SHM_FORMAT_XRGB8888)
+        continue;
+
+      wl_display_add_shm_format (wl_display, wakefield_formats[i].shm_format);
+    }
+}
+
+/* Every conversion is a handful of 32-bit lane operations, which
+ * each SIMD flavour below repeats. The 2-bit alpha of the 10-bit
+ * formats is widened by replication, so 3 becomes 0xff. Colour
+ * channels are truncated, which keeps premultiplied values in
+ * range. */
+
+static inline uint32_t
+convert_pixel (enum WakefieldConversion conversion,
+               uint32_t                 p)
+{
+  uint32_t a;
+
+  switch (conversion)
+    {
+    case WAKEFIELD_CONVERSION_SWAP_RB_8888:
+      return (p & 0xff00ff00) | ((p << 16) & 0x00ff0000) | ((p >> 16) & 0x000000ff);
+    case WAKEFIELD_CONVERSION_ARGB2101010_TO_8888:
+      a = p >> 30;
+      a |= a << 2;
+      a |= a << 4;
+      return (a << 24) | ((p >> 6) & 0x00ff0000) | ((p >> 4) & 0x0000ff00) | ((p >> 2) & 0x000000ff);
+    case WAKEFIELD_CONVERSION_ABGR2101010_TO_8888:
+      a = p >> 30;
+      a |= a << 2;
+      a |= a << 4;
+      return (a << 24) | ((p << 14) & 0x00ff0000) | ((p >> 4) & 0x0000ff00) | ((p >> 22) & 0x000000ff);
+    case WAKEFIELD_CONVERSION_SWAP_RB_2101010:
+      return (p & 0xc00ffc00) | ((p << 20) & 0x3ff00000) | ((p >> 20) & 0x000003ff);
+    case WAKEFIELD_CONVERSION_NONE:
+    default:
+      return p;
+    }
+}
+
+static void
+convert_row_scalar (enum WakefieldConversion  conversion,
+                    uint32_t                 *dst,
+                    const uint32_t           *src,
+                    int                       width)
+{
+  int i;
+
+  for (i = 0; i < width; i++)
+    dst[i] = convert_pixel (conversion, src[i]);
+}
+
+/* Stamps out the vector loop for one conversion; whatever's left over
+ * at the end of the row goes through convert_row_scalar. */
+#define CONVERT_LOOP(step, vec_ptr_type, load, store, op)                \
+  for (; width >= (step); width -= (step), src += (step), dst += (step)) \
+    store ((vec_ptr_type) dst, op (load ((const vec_ptr_type) src)))
+
+#if defined (__SSE2__)
+
+static inline __m128i
+swap_rb_8888_sse2 (__m128i p)
+{
+  return _mm_or_si128 (_mm_and_si128 (p, _mm_set1_epi32 (0xff00ff00)),
+                       _mm_or_si128 (_mm_and_si128 (_mm_slli_epi32 (p, 16), _mm_set1_epi32 (0x00ff0000)),
+                                     _mm_and_si128 (_mm_srli_epi32 (p, 16), _mm_set1_epi32 (0x000000ff))));
+}
+
+static inline __m128i
+alpha_2_to_8_sse2 (__m128i p)
+{
+  __m128i a = _mm_srli_epi32 (p, 30);
+  a = _mm_or_si128 (a, _mm_slli_epi32 (a, 2));
+  a = _mm_or_si128 (a, _mm_slli_epi32 (a, 4));
+  return _mm_slli_epi32 (a, 24);
+}
+
+static inline __m128i
+argb2101010_to_8888_sse2 (__m128i p)
+{
+  __m128i rgb = _mm_or_si128 (_mm_and_si128 (_mm_srli_epi32 (p, 6), _mm_set1_epi32 (0x00ff0000)),
+                              _mm_or_si128 (_mm_and_si128 (_mm_srli_epi32 (p, 4), _mm_set1_epi32 (0x0000ff00)),
+                                            _mm_and_si128 (_mm_srli_epi32 (p, 2), _mm_set1_epi32 (0x000000ff))));
+  return _mm_or_si128 (alpha_2_to_8_sse2 (p), rgb);
+}
+
+static inline __m128i
+abgr2101010_to_8888_sse2 (__m128i p)
+{
+  __m128i rgb = _mm_or_si128 (_mm_and_si128 (_mm_slli_epi32 (p, 14), _mm_set1_epi32 (0x00ff0000)),
+                              _mm_or_si128 (_mm_and_si128 (_mm_srli_epi32 (p, 4), _mm_set1_epi32 (0x0000ff00)),
+                                            _mm_and_si128 (_mm_srli_epi32 (p, 22), _mm_set1_epi32 (0x000000ff))));
+  return _mm_or_si128 (alpha_2_to_8_sse2 (p), rgb);
+}
+
+static inline __m128i
+swap_rb_2101010_sse2 (__m128i p)
+{
+  return _mm_or_si128 (_mm_and_si128 (p, _mm_set1_epi32 (0xc00ffc00)),
+                       _mm_or_si128 (_mm_and_si128 (_mm_slli_epi32 (p, 20), _mm_set1_epi32 (0x3ff00000)),
+                                     _mm_and_si128 (_mm_srli_epi32 (p, 20), _mm_set1_epi32 (0x000003ff))));
+}
+
+static void
+convert_row_sse2 (enum WakefieldConversion  conversion,
+                  uint32_t                 *dst,
+                  const uint32_t           *src,
+                  int                       width)
+{
+  switch (conversion)
+    {
+    case WAKEFIELD_CONVERSION_SWAP_RB_8888:
+      CONVERT_LOOP (4, __m128i *, _mm_loadu_si128, _mm_storeu_si128, swap_rb_8888_sse2);
+      break;
+    case WAKEFIELD_CONVERSION_ARGB2101010_TO_8888:
+      CONVERT_LOOP (4, __m128i *, _mm_loadu_si128, _mm_storeu_si128, argb2101010_to_8888_sse2);
+      break;
+    case WAKEFIELD_CONVERSION_ABGR2101010_TO_8888:
+      CONVERT_LOOP (4, __m128i *, _mm_loadu_si128, _mm_storeu_si128, abgr2101010_to_8888_sse2);
+      break;
+    case WAKEFIELD_CONVERSION_SWAP_RB_2101010:
+      CONVERT_LOOP (4, __m128i *, _mm_loadu_si128, _mm_storeu_si128, swap_rb_2101010_sse2);
+      break;
+    case WAKEFIELD_CONVERSION_NONE:
+    default:
+      break;
+    }
+
+  convert_row_scalar (conversion, dst, src, width);
+}
+
+#endif /* __SSE2__ */
+
+#if defined (__x86_64__) || defined (__i386__)
+
+#define WAKEFIELD_AVX2 __attribute__ ((target ("avx2")))
+
+static inline WAKEFIELD_AVX2 __m256i
+swap_rb_8888_avx2 (__m256i p)
+{
+  /* AVX2 can do this one as a plain byte shuffle. */
+  const __m256i mask = _mm256_setr_epi8 (2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                         2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  return _mm256_shuffle_epi8 (p, mask);
+}
+
+static inline WAKEFIELD_AVX2 __m256i
+alpha_2_to_8_avx2 (__m256i p)
+{
+  __m256i a = _mm256_srli_epi32 (p, 30);
+  a = _mm256_or_si256 (a, _mm256_slli_epi32 (a, 2));
+  a = _mm256_or_si256 (a, _mm256_slli_epi32 (a, 4));
+  return _mm256_slli_epi32 (a, 24);
+}
+
+static inline WAKEFIELD_AVX2 __m256i
+argb2101010_to_8888_avx2 (__m256i p)
+{
+  __m256i rgb = _mm256_or_si256 (_mm256_and_si256 (_mm256_srli_epi32 (p, 6), _mm256_set1_epi32 (0x00ff0000)),
+                                 _mm256_or_si256 (_mm256_and_si256 (_mm256_srli_epi32 (p, 4), _mm256_set1_epi32 (0x0000ff00)),
+                                                  _mm256_and_si256 (_mm256_srli_epi32 (p, 2), _mm256_set1_epi32 (0x000000ff))));
+  return _mm256_or_si256 (alpha_2_to_8_avx2 (p), rgb);
+}
+
+static inline WAKEFIELD_AVX2 __m256i
+abgr2101010_to_8888_avx2 (__m256i p)
+{
+  __m256i rgb = _mm256_or_si256 (_mm256_and_si256 (_mm256_slli_epi32 (p, 14), _mm256_set1_epi32 (0x00ff0000)),
+                                 _mm256_or_si256 (_mm256_and_si256 (_mm256_srli_epi32 (p, 4), _mm256_set1_epi32 (0x0000ff00)),
+                                                  _mm256_and_si256 (_mm256_srli_epi32 (p, 22), _mm256_set1_epi32 (0x000000ff))));
+  return _mm256_or_si256 (alpha_2_to_8_avx2 (p), rgb);
+}
+
+static inline WAKEFIELD_AVX2 __m256i
+swap_rb_2101010_avx2 (__m256i p)
+{
+  return _mm256_or_si256 (_mm256_and_si256 (p, _mm256_set1_epi32 (0xc00ffc00)),
+                          _mm256_or_si256 (_mm256_and_si256 (_mm256_slli_epi32 (p, 20), _mm256_set1_epi32 (0x3ff00000)),
+                                           _mm256_and_si256 (_mm256_srli_epi32 (p, 20), _mm256_set1_epi32 (0x000003ff))));
+}
+
+static WAKEFIELD_AVX2 void
+convert_row_avx2 (enum WakefieldConversion  conversion,
+                  uint32_t                 *dst,
+                  const uint32_t           *src,
+                  int                       width)
+{
+  switch (conversion)
+    {
+    case WAKEFIELD_CONVERSION_SWAP_RB_8888:
+      CONVERT_LOOP (8, __m256i *, _mm256_loadu_si256, _mm256_storeu_si256, swap_rb_8888_avx2);
+      break;
+    case WAKEFIELD_CONVERSION_ARGB2101010_TO_8888:
+      CONVERT_LOOP (8, __m256i *, _mm256_loadu_si256, _mm256_storeu_si256, argb2101010_to_8888_avx2);
+      break;
+    case WAKEFIELD_CONVERSION_ABGR2101010_TO_8888:
+      CONVERT_LOOP (8, __m256i *, _mm256_loadu_si256, _mm256_storeu_si256, abgr2101010_to_8888_avx2);
+      break;
+    case WAKEFIELD_CONVERSION_SWAP_RB_2101010:
+      CONVERT_LOOP (8, __m256i *, _mm256_loadu_si256, _mm256_storeu_si256, swap_rb_2101010_avx2);
+      break;
+    case WAKEFIELD_CONVERSION_NONE:
+    default:
+      break;
+    }
+
+  convert_row_scalar (conversion, dst, src, width);
+}
+
+#endif /* x86 */
+
+#if defined (__ARM_NEON)
+
+static inline uint32x4_t
+swap_rb_8888_neon (uint32x4_t p)
+{
+  return vorrq_u32 (vandq_u32 (p, vdupq_n_u32 (0xff00ff00)),
+                    vorrq_u32 (vandq_u32 (vshlq_n_u32 (p, 16), vdupq_n_u32 (0x00ff0000)),
+                               vandq_u32 (vshrq_n_u32 (p, 16), vdupq_n_u32 (0x000000ff))));
+}
+
+static inline uint32x4_t
+alpha_2_to_8_neon (uint32x4_t p)
+{
+  uint32x4_t a = vshrq_n_u32 (p, 30);
+  a = vorrq_u32 (a, vshlq_n_u32 (a, 2));
+  a = vorrq_u32 (a, vshlq_n_u32 (a, 4));
+  return vshlq_n_u32 (a, 24);
+}
+
+static inline uint32x4_t
+argb2101010_to_8888_neon (uint32x4_t p)
+{
+  uint32x4_t rgb = vorrq_u32 (vandq_u32 (vshrq_n_u32 (p, 6), vdupq_n_u32 (0x00ff0000)),
+                              vorrq_u32 (vandq_u32 (vshrq_n_u32 (p, 4), vdupq_n_u32 (0x0000ff00)),
+                                         vandq_u32 (vshrq_n_u32 (p, 2), vdupq_n_u32 (0x000000ff))));
+  return vorrq_u32 (alpha_2_to_8_neon (p), rgb);
+}
+
+static inline uint32x4_t
+abgr2101010_to_8888_neon (uint32x4_t p)
+{
+  uint32x4_t rgb = vorrq_u32 (vandq_u32 (vshlq_n_u32 (p, 14), vdupq_n_u32 (0x00ff0000)),
+                              vorrq_u32 (vandq_u32 (vshrq_n_u32 (p, 4), vdupq_n_u32 (0x0000ff00)),
+                                         vandq_u32 (vshrq_n_u32 (p, 22), vdupq_n_u32 (0x000000ff))));
+  return vorrq_u32 (alpha_2_to_8_neon (p), rgb);
+}
+
+static inline uint32x4_t
+swap_rb_2101010_neon (uint32x4_t p)
+{
+  return vorrq_u32 (vandq_u32 (p, vdupq_n_u32 (0xc00ffc00)),
+                    vorrq_u32 (vandq_u32 (vshlq_n_u32 (p, 20), vdupq_n_u32 (0x3ff00000)),
+                               vandq_u32 (vshrq_n_u32 (p, 20), vdupq_n_u32 (0x000003ff))));
+}
+
+static void
+convert_row_neon (enum WakefieldConversion  conversion,
+                  uint32_t                 *dst,
+                  const uint32_t           *src,
+                  int                       width)
+{
+  switch (conversion)
+    {
+    case WAKEFIELD_CONVERSION_SWAP_RB_8888:
+      CONVERT_LOOP (4, uint32_t *, vld1q_u32, vst1q_u32, swap_rb_8888_neon);
+      break;
+    case WAKEFIELD_CONVERSION_ARGB2101010_TO_8888:
+      CONVERT_LOOP (4, uint32_t *, vld1q_u32, vst1q_u32, argb2101010_to_8888_neon);
+      break;
+    case WAKEFIELD_CONVERSION_ABGR2101010_TO_8888:
+      CONVERT_LOOP (4, uint32_t *, vld1q_u32, vst1q_u32, abgr2101010_to_8888_neon);
+      break;
+    case WAKEFIELD_CONVERSION_SWAP_RB_2101010:
+      CONVERT_LOOP (4, uint32_t *, vld1q_u32, vst1q_u32, swap_rb_2101010_neon);
+      break;
+    case WAKEFIELD_CONVERSION_NONE:
+    default:
+      break;
+    }
+
+  convert_row_scalar (conversion, dst, src, width);
+}
+
+#endif /* __ARM_NEON */
+
+#undef CONVERT_LOOP
+
+typedef void (*WakefieldConvertRowFunc) (enum WakefieldConversion  conversion,
+                                         uint32_t                 *dst,
+                                         const uint32_t           *src,
+                                         int                       width);
+
+static WakefieldConvertRowFunc convert_row = convert_row_scalar;
+
+static void
+wakefield_format_init (void)
+{
+#if defined (__SSE2__)
+  convert_row = convert_row_sse2;
+#endif
+#if defined (__x86_64__) || defined (__i386__)
+  if (__builtin_cpu_supports ("avx2"))
+    convert_row = convert_row_avx2;
+#endif
+#if defined (__ARM_NEON)
+  convert_row = convert_row_neon;
+#endif
+}
+
+/* Copies a rectangle of pixels from a buffer in @format into an image
+ * surface in the matching cairo format, converting if needed. */
+static void
+wakefield_format_copy_rect (const struct WakefieldFormat *format,
+                            uint8_t                      *dst,
+                            int                           dst_stride,
+                            const uint8_t                *src,
+                            int                           src_stride,
+                            cairo_rectangle_int_t        *rect)
+{
+  int bpp = format->bytes_per_pixel;
+  int y;
+
+  dst += rect->y * dst_stride + rect->x * bpp;
+  src += rect->y * src_stride + rect->x * bpp;
+
+  for (y = 0; y < rect->height; y++, dst += dst_stride, src += src_stride)
+    {
+      if (format->conversion == WAKEFIELD_CONVERSION_NONE)
+        memcpy (dst, src, rect->width * bpp);
+      else
+        convert_row (format->conversion, (uint32_t *) dst, (const uint32_t *) src, rect->width);
+    }
+}
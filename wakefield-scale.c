@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2015 Endless Mobile
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * Written by:
+ *     Jasper St. Pierre <jstpierre@mecheye.net>
+ */
+
+/* Resampling of 32-bit contents to the size we show them at. This
+ * only ever runs over the parts of the destination that some damage
+ * touched, and the result is kept around between draws. Bilinear
+ * handles upscales and mild downscales; past 2:1, where bilinear
+ * starts skipping source pixels, we average whole boxes instead. */
+
+/* Bilinear weights are 7 bits, so that the horizontal pass of an
+ * 8-bit channel still fits in 16 bits. */
+#define BILINEAR_BITS 7
+#define BILINEAR_ONE (1 << BILINEAR_BITS)
+
+/* Where destination coordinate @i samples from: between @src0 and
+ * @src0 + 1 at @weight / BILINEAR_ONE of the way. */
+static void
+bilinear_sample (int  i,
+                 int  src_size,
+                 int  dst_size,
+                 int *src0,
+                 int *src1,
+                 int *weight)
+{
+  double f = (i + 0.5) * src_size / dst_size - 0.5;
+  int s;
+
+  f = CLAMP (f, 0, src_size - 1);
+  s = MIN ((int) f, MAX (src_size - 2, 0));
+
+  *src0 = s;
+  *src1 = MIN (s + 1, src_size - 1);
+  *weight = (int) ((f - s) * BILINEAR_ONE + 0.5);
+}
+
+/* Interpolates one source row horizontally into @out, four 16-bit
+ * channels per pixel, scaled up by BILINEAR_ONE. */
+static void
+bilinear_row (uint16_t       *out,
+              const uint32_t *src,
+              const int      *x0,
+              const int      *x1,
+              const int      *wx,
+              int             width)
+{
+  int i;
+
+#if defined (__SSE2__)
+  for (i = 0; i < width; i++)
+    {
+      __m128i p = _mm_unpacklo_epi32 (_mm_cvtsi32_si128 (src[x0[i]]),
+                                      _mm_cvtsi32_si128 (src[x1[i]]));
+      __m128i w = _mm_unpacklo_epi64 (_mm_set1_epi16 (BILINEAR_ONE - wx[i]),
+                                      _mm_set1_epi16 (wx[i]));
+
+      p = _mm_mullo_epi16 (_mm_unpacklo_epi8 (p, _mm_setzero_si128 ()), w);
+      _mm_storel_epi64 ((__m128i *) (out + i * 4), _mm_add_epi16 (p, _mm_srli_si128 (p, 8)));
+    }
+#elif defined (__ARM_NEON)
+  for (i = 0; i < width; i++)
+    {
+      uint8x8_t p = vreinterpret_u8_u32 (vset_lane_u32 (src[x1[i]], vdup_n_u32 (src[x0[i]]), 1));
+      uint8x8_t w = vext_u8 (vdup_n_u8 (BILINEAR_ONE - wx[i]), vdup_n_u8 (wx[i]), 4);
+      uint16x8_t v = vmull_u8 (p, w);
+
+      vst1_u16 (out + i * 4, vadd_u16 (vget_low_u16 (v), vget_high_u16 (v)));
+    }
+#else
+  for (i = 0; i < width; i++)
+    {
+      uint32_t a = src[x0[i]], b = src[x1[i]];
+      int c;
+
+      for (c = 0; c < 4; c++)
+        out[i * 4 + c] = ((a >> (c * 8)) & 0xff) * (BILINEAR_ONE - wx[i]) +
+                         ((b >> (c * 8)) & 0xff) * wx[i];
+    }
+#endif
+}
+
+/* Blends two rows from bilinear_row vertically into the destination. */
+static void
+bilinear_blend (uint32_t       *dst,
+                const uint16_t *row0,
+                const uint16_t *row1,
+                int             wy,
+                int             width)
+{
+  const int shift = 2 * BILINEAR_BITS;
+  int i = 0;
+
+#if defined (__SSE2__)
+  {
+    const __m128i w = _mm_set1_epi32 ((wy << 16) | (BILINEAR_ONE - wy));
+    const __m128i round = _mm_set1_epi32 (1 << (shift - 1));
+
+    for (; i + 2 <= width; i += 2)
+      {
+        __m128i r0 = _mm_loadu_si128 ((const __m128i *) (row0 + i * 4));
+        __m128i r1 = _mm_loadu_si128 ((const __m128i *) (row1 + i * 4));
+        __m128i lo = _mm_madd_epi16 (_mm_unpacklo_epi16 (r0, r1), w);
+        __m128i hi = _mm_madd_epi16 (_mm_unpackhi_epi16 (r0, r1), w);
+        __m128i v;
+
+        lo = _mm_srai_epi32 (_mm_add_epi32 (lo, round), shift);
+        hi = _mm_srai_epi32 (_mm_add_epi32 (hi, round), shift);
+        v = _mm_packs_epi32 (lo, hi);
+        _mm_storel_epi64 ((__m128i *) (dst + i), _mm_packus_epi16 (v, v));
+      }
+  }
+#elif defined (__ARM_NEON)
+  for (; i + 2 <= width; i += 2)
+    {
+      uint16x8_t r0 = vld1q_u16 (row0 + i * 4);
+      uint16x8_t r1 = vld1q_u16 (row1 + i * 4);
+      uint32x4_t lo = vmlal_n_u16 (vmull_n_u16 (vget_low_u16 (r0), BILINEAR_ONE - wy), vget_low_u16 (r1), wy);
+      uint32x4_t hi = vmlal_n_u16 (vmull_n_u16 (vget_high_u16 (r0), BILINEAR_ONE - wy), vget_high_u16 (r1), wy);
+      uint16x8_t v = vcombine_u16 (vrshrn_n_u32 (lo, 2 * BILINEAR_BITS), vrshrn_n_u32 (hi, 2 * BILINEAR_BITS));
+
+      vst1_u32 (dst + i, vreinterpret_u32_u8 (vqmovn_u16 (v)));
+    }
+#endif
+
+  for (; i < width; i++)
+    {
+      uint32_t p = 0;
+      int c;
+
+      for (c = 0; c < 4; c++)
+        {
+          uint32_t v = (row0[i * 4 + c] * (BILINEAR_ONE - wy) +
+                        row1[i * 4 + c] * wy + (1 << (shift - 1))) >> shift;
+          p |= MIN (v, 0xff) << (c * 8);
+        }
+
+      dst[i] = p;
+    }
+}
+
+static void
+scale_bilinear (uint8_t               *dst,
+                int                    dst_stride,
+                int                    dst_width,
+                int                    dst_height,
+                const uint8_t         *src,
+                int                    src_stride,
+                int                    src_width,
+                int                    src_height,
+                cairo_rectangle_int_t *rect)
+{
+  int *x0 = g_new (int, rect->width * 3);
+  int *x1 = x0 + rect->width;
+  int *wx = x1 + rect->width;
+  uint16_t *row_data = g_new (uint16_t, rect->width * 4 * 2);
+  uint16_t *rows[2] = { row_data, row_data + rect->width * 4 };
+  int row_y[2] = { -1, -1 };
+  int x, y;
+
+  for (x = 0; x < rect->width; x++)
+    bilinear_sample (rect->x + x, src_width, dst_width, &x0[x], &x1[x], &wx[x]);
+
+  for (y = rect->y; y < rect->y + rect->height; y++)
+    {
+      int y0, y1, wy;
+
+      bilinear_sample (y, src_height, dst_height, &y0, &y1, &wy);
+
+      /* When upscaling, neighbouring destination rows share source
+       * rows, so only interpolate the ones we don't have yet. */
+      if (row_y[0] != y0)
+        {
+          if (row_y[1] == y0)
+            {
+              uint16_t *tmp = rows[0];
+              rows[0] = rows[1];
+              rows[1] = tmp;
+              row_y[0] = y0;
+              row_y[1] = -1;
+            }
+          else
+            {
+              bilinear_row (rows[0], (const uint32_t *) (src + y0 * src_stride), x0, x1, wx, rect->width);
+              row_y[0] = y0;
+            }
+        }
+
+      if (row_y[1] != y1)
+        {
+          bilinear_row (rows[1], (const uint32_t *) (src + y1 * src_stride), x0, x1, wx, rect->width);
+          row_y[1] = y1;
+        }
+
+      bilinear_blend ((uint32_t *) (dst + y * dst_stride) + rect->x, rows[0], rows[1], wy, rect->width);
+    }
+
+  g_free (row_data);
+  g_free (x0);
+}
+
+/* The source span destination coordinate @i averages over. */
+static void
+box_span (int  i,
+          int  src_size,
+          int  dst_size,
+          int *src0,
+          int *src1)
+{
+  *src0 = (int) ((int64_t) i * src_size / dst_size);
+  *src1 = (int) (((int64_t) (i + 1) * src_size + dst_size - 1) / dst_size);
+  *src1 = CLAMP (*src1, *src0 + 1, src_size);
+}
+
+static void
+scale_box (uint8_t               *dst,
+           int                    dst_stride,
+           int                    dst_width,
+           int                    dst_height,
+           const uint8_t         *src,
+           int                    src_stride,
+           int                    src_width,
+           int                    src_height,
+           cairo_rectangle_int_t *rect)
+{
+  int *x0 = g_new (int, rect->width * 2);
+  int *x1 = x0 + rect->width;
+  uint32_t *sums = g_new (uint32_t, rect->width * 4);
+  int x, y;
+
+  for (x = 0; x < rect->width; x++)
+    box_span (rect->x + x, src_width, dst_width, &x0[x], &x1[x]);
+
+  for (y = rect->y; y < rect->y + rect->height; y++)
+    {
+      uint32_t *d = (uint32_t *) (dst + y * dst_stride) + rect->x;
+      int y0, y1, sy;
+
+      box_span (y, src_height, dst_height, &y0, &y1);
+      memset (sums, 0, rect->width * 4 * sizeof (uint32_t));
+
+      for (sy = y0; sy < y1; sy++)
+        {
+          const uint32_t *s = (const uint32_t *) (src + sy * src_stride);
+
+          for (x = 0; x < rect->width; x++)
+            {
+              uint32_t *sum = sums + x * 4;
+              int sx;
+
+              for (sx = x0[x]; sx < x1[x]; sx++)
+                {
+                  uint32_t p = s[sx];
+
+                  sum[0] += p & 0xff;
+                  sum[1] += (p >> 8) & 0xff;
+                  sum[2] += (p >> 16) & 0xff;
+                  sum[3] += p >> 24;
+                }
+            }
+        }
+
+      for (x = 0; x < rect->width; x++)
+        {
+          uint32_t *sum = sums + x * 4;
+          uint32_t n = (uint32_t) (y1 - y0) * (x1[x] - x0[x]);
+
+          d[x] = ((sum[0] + n / 2) / n) |
+                 ((sum[1] + n / 2) / n) << 8 |
+                 ((sum[2] + n / 2) / n) << 16 |
+                 ((sum[3] + n / 2) / n) << 24;
+        }
+    }
+
+  g_free (sums);
+  g_free (x0);
+}
+
+/* Resamples the @rect part of a @dst_width by @dst_height image from
+ * the whole of a @src_width by @src_height one. Both have 32-bit
+ * pixels. */
+static void
+wakefield_scale_rect (uint8_t               *dst,
+                      int                    dst_stride,
+                      int                    dst_width,
+                      int                    dst_height,
+                      const uint8_t         *src,
+                      int                    src_stride,
+                      int                    src_width,
+                      int                    src_height,
+                      cairo_rectangle_int_t *rect)
+{
+  if (dst_width * 2 < src_width || dst_height * 2 < src_height)
+    scale_box (dst, dst_stride, dst_width, dst_height,
+               src, src_stride, src_width, src_height, rect);
+  else
+    scale_bilinear (dst, dst_stride, dst_width, dst_height,
+                    src, src_stride, src_width, src_height, rect);
+}
+
+/* Maps @rect in the source to the part of the destination that
+ * samples from it. */
+static void
+wakefield_scale_map_rect (int                    src_width,
+                          int                    src_height,
+                          int                    dst_width,
+                          int                    dst_height,
+                          cairo_rectangle_int_t *rect)
+{
+  /* Growing by a source pixel either way covers the bilinear
+   * neighbours, and by a destination pixel the rounding in the box
+   * spans. */
+  int x0 = (int) ((int64_t) (rect->x - 1) * dst_width / src_width) - 1;
+  int y0 = (int) ((int64_t) (rect->y - 1) * dst_height / src_height) - 1;
+  int x1 = (int) (((int64_t) (rect->x + rect->width + 1) * dst_width + src_width - 1) / src_width) + 1;
+  int y1 = (int) (((int64_t) (rect->y + rect->height + 1) * dst_height + src_height - 1) / src_height) + 1;
+
+  x0 = MAX (x0, 0);
+  y0 = MAX (y0, 0);
+  x1 = MIN (x1, dst_width);
+  y1 = MIN (y1, dst_height);
+
+  rect->x = x0;
+  rect->y = y0;
+  rect->width = MAX (x1 - x0, 0);
+  rect->height = MAX (y1 - y0, 0);
+}
+
+#undef BILINEAR_BITS
+#undef BILINEAR_ONE
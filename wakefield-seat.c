@@ -20,6 +20,214 @@
  *     Jasper St. Pierre <jstpierre@mecheye.net>
  */
 
+struct WakefieldCursor
+{
+  struct wl_list link;
+
+  /* What the cursor surface showed, and a hash of it for quick
+   * lookups. */
+  cairo_surface_t *image;
+  guint hash;
+  int hotspot_x, hotspot_y;
+
+  GdkCursor *cursor;
+};
+
+/* Enough for the frames of an animated cursor. */
+#define CURSOR_CACHE_SIZE 32
+
+static void
+cursor_free (struct WakefieldCursor *cursor)
+{
+  wl_list_remove (&cursor->link);
+  cairo_surface_destroy (cursor->image);
+  g_object_unref (cursor->cursor);
+  g_slice_free (struct WakefieldCursor, cursor);
+}
+
+static void
+wakefield_pointer_clear_cursor_cache (struct WakefieldPointer *pointer)
+{
+  struct WakefieldCursor *cursor, *tmp;
+
+  wl_list_for_each_safe (cursor, tmp, &pointer->cursor_cache, link)
+    cursor_free (cursor);
+
+  pointer->cursor_cache_size = 0;
+}
+
+/* Copies what the cursor surface shows into an image of our own, and
+ * hands the buffer back, since we never paint it. Returns NULL if it
+ * shows nothing. */
+static cairo_surface_t *
+snapshot_cursor (struct WakefieldSurface *surface)
+{
+  struct WakefieldBuffer *buffer = surface->backing ? NULL : surface->current.buffer;
+  struct wl_shm_buffer *shm_buffer = NULL;
+  cairo_surface_t *content, *image;
+  int width, height;
+  cairo_t *cr;
+
+  if (!get_content_size (surface, &width, &height))
+    return NULL;
+
+  if (buffer)
+    {
+      shm_buffer = wl_shm_buffer_get (buffer->resource);
+      wl_shm_buffer_begin_access (shm_buffer);
+    }
+
+  content = get_content (surface);
+  cairo_surface_set_device_scale (content, 1, 1);
+
+  image = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+  cr = cairo_create (image);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface (cr, content, 0, 0);
+  cairo_paint (cr);
+  cairo_destroy (cr);
+
+  if (buffer)
+    {
+      wl_shm_buffer_end_access (shm_buffer);
+      wakefield_buffer_release (buffer);
+    }
+
+  cairo_surface_flush (image);
+  cairo_surface_set_device_scale (image, surface->current.scale, surface->current.scale);
+  return image;
+}
+
+static guint
+hash_image (cairo_surface_t *image)
+{
+  const uint32_t *data = (const uint32_t *) cairo_image_surface_get_data (image);
+  int n = cairo_image_surface_get_stride (image) / 4 * cairo_image_surface_get_height (image);
+  guint hash = 5381;
+  int i;
+
+  for (i = 0; i < n; i++)
+    hash = hash * 33 + data[i];
+
+  return hash;
+}
+
+static gboolean
+same_image (cairo_surface_t *a,
+            cairo_surface_t *b)
+{
+  return cairo_image_surface_get_width (a) == cairo_image_surface_get_width (b) &&
+         cairo_image_surface_get_height (a) == cairo_image_surface_get_height (b) &&
+         memcmp (cairo_image_surface_get_data (a), cairo_image_surface_get_data (b),
+                 cairo_image_surface_get_stride (a) * cairo_image_surface_get_height (a)) == 0;
+}
+
+/* Returns a GdkCursor showing @image, from the cache if we've seen it
+ * with the same hotspot before, and takes ownership of @image. */
+static GdkCursor *
+lookup_cursor (struct WakefieldPointer *pointer,
+               GdkDisplay              *display,
+               cairo_surface_t         *image,
+               int                      hotspot_x,
+               int                      hotspot_y)
+{
+  struct WakefieldCursor *cursor;
+  guint hash = hash_image (image);
+
+  wl_list_for_each (cursor, &pointer->cursor_cache, link)
+    {
+      if (cursor->hash == hash &&
+          cursor->hotspot_x == hotspot_x &&
+          cursor->hotspot_y == hotspot_y &&
+          same_image (cursor->image, image))
+        {
+          wl_list_remove (&cursor->link);
+          wl_list_insert (&pointer->cursor_cache, &cursor->link);
+          cairo_surface_destroy (image);
+          return cursor->cursor;
+        }
+    }
+
+  if (pointer->cursor_cache_size == CURSOR_CACHE_SIZE)
+    cursor_free (wl_container_of (pointer->cursor_cache.prev, cursor, link));
+  else
+    pointer->cursor_cache_size++;
+
+  cursor = g_slice_new0 (struct WakefieldCursor);
+  cursor->image = image;
+  cursor->hash = hash;
+  cursor->hotspot_x = hotspot_x;
+  cursor->hotspot_y = hotspot_y;
+  cursor->cursor = gdk_cursor_new_from_surface (display, image, hotspot_x, hotspot_y);
+  wl_list_insert (&pointer->cursor_cache, &cursor->link);
+
+  return cursor->cursor;
+}
+
+/* Shows the cursor on our window, for the window system to move
+ * around without us having to redraw anything: @image, which we take
+ * ownership of, a blank one if there's none, or the default cursor if
+ * the pointer isn't over any client surface. */
+static void
+show_cursor (WakefieldCompositor *compositor,
+             gboolean             focus,
+             cairo_surface_t     *image,
+             int                  hotspot_x,
+             int                  hotspot_y)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  GdkWindow *window = gtk_widget_get_window (GTK_WIDGET (compositor));
+  GdkCursor *cursor;
+
+  if (!window || !focus)
+    {
+      if (window)
+        gdk_window_set_cursor (window, NULL);
+      g_clear_pointer (&image, cairo_surface_destroy);
+      return;
+    }
+
+  if (image)
+    {
+      cursor = lookup_cursor (&priv->seat.pointer, gdk_window_get_display (window),
+                              image, hotspot_x, hotspot_y);
+      gdk_window_set_cursor (window, cursor);
+    }
+  else
+    {
+      cursor = gdk_cursor_new_for_display (gdk_window_get_display (window), GDK_BLANK_CURSOR);
+      gdk_window_set_cursor (window, cursor);
+      g_object_unref (cursor);
+    }
+}
+
+/* Shows the client's cursor surface while the pointer is over its
+ * surfaces, or nothing if it unset that. In threaded mode, GTK picks
+ * it up from the next scene. */
+static void
+update_cursor (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+  cairo_surface_t *image = NULL;
+
+  if (pointer->focus && pointer->cursor_surface)
+    image = snapshot_cursor (pointer->cursor_surface);
+
+  if (priv->threaded)
+    {
+      g_clear_pointer (&priv->cursor_image, cairo_surface_destroy);
+      priv->cursor_image = image;
+      priv->cursor_focus = pointer->focus != NULL;
+      priv->cursor_serial++;
+      priv->scene_dirty = TRUE;
+      return;
+    }
+
+  show_cursor (compositor, pointer->focus != NULL, image,
+               pointer->hotspot_x, pointer->hotspot_y);
+}
+
 static void
 pointer_set_cursor (struct wl_client *client,
                     struct wl_resource *resource,
@@ -27,7 +235,35 @@ pointer_set_cursor (struct wl_client *client,
                     struct wl_resource *surface_resource,
                     int32_t x, int32_t y)
 {
-  g_warning ("TODO: Set cursor\n");
+  struct WakefieldSeat *seat = wl_resource_get_user_data (resource);
+  struct WakefieldPointer *pointer = &seat->pointer;
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (seat->compositor);
+  struct WakefieldSurface *surface = NULL;
+
+  /* Only the client the pointer is over gets to set the cursor, and
+   * only in response to its latest enter. */
+  if (!pointer->focus ||
+      wl_resource_get_client (pointer->focus->resource) != client ||
+      serial != pointer->enter_serial)
+    return;
+
+  if (surface_resource)
+    {
+      surface = wl_resource_get_user_data (surface_resource);
+
+      if (surface->subsurface || surface == priv->surface)
+        {
+          wl_resource_post_error (resource, WL_POINTER_ERROR_ROLE,
+                                  "wl_surface@%d already has another role",
+                                  wl_resource_get_id (surface_resource));
+          return;
+        }
+    }
+
+  pointer->cursor_surface = surface;
+  pointer->hotspot_x = x;
+  pointer->hotspot_y = y;
+  update_cursor (seat->compositor);
 }
 
 static const struct wl_pointer_interface pointer_interface = {
@@ -35,6 +271,27 @@ static const struct wl_pointer_interface pointer_interface = {
   resource_release,
 };
 
+static void
+pointer_destructor (struct wl_resource *resource)
+{
+  struct WakefieldSeat *seat = wl_resource_get_user_data (resource);
+  struct wl_resource *timestamps, *relative;
+
+  wl_resource_for_each (timestamps, &seat->pointer.timestamps_list)
+    {
+      if (wl_resource_get_user_data (timestamps) == resource)
+        wl_resource_set_user_data (timestamps, NULL);
+    }
+
+  wl_resource_for_each (relative, &seat->pointer.relative_list)
+    {
+      if (wl_resource_get_user_data (relative) == resource)
+        wl_resource_set_user_data (relative, NULL);
+    }
+
+  unbind_resource (resource);
+}
+
 static void
 seat_get_pointer (struct wl_client    *client,
                   struct wl_resource  *seat_resource,
@@ -45,140 +302,1701 @@ seat_get_pointer (struct wl_client    *client,
   struct wl_resource *cr;
 
   cr = wl_resource_create (client, &wl_pointer_interface, wl_resource_get_version (seat_resource), id);
-  wl_resource_set_implementation (cr, &pointer_interface, pointer, unbind_resource);
+  wl_resource_set_implementation (cr, &pointer_interface, seat, pointer_destructor);
   wl_list_insert (&pointer->resource_list, wl_resource_get_link (cr));
 }
 
+/* Sends the full-precision time of the event about to be sent to
+ * @input to those that asked for it. */
 static void
-broadcast_button (GtkWidget      *widget,
-                  GdkEventButton *event)
+send_input_timestamp (struct wl_list     *timestamps_list,
+                      struct wl_resource *input,
+                      gint64              timestamp)
+{
+  struct wl_resource *timestamps;
+  uint64_t tv_sec = timestamp / G_USEC_PER_SEC;
+  uint32_t tv_nsec = (timestamp % G_USEC_PER_SEC) * 1000;
+
+  wl_resource_for_each (timestamps, timestamps_list)
+    {
+      if (wl_resource_get_user_data (timestamps) == input)
+        zwp_input_timestamps_v1_send_timestamp (timestamps, tv_sec >> 32, tv_sec & 0xffffffff, tv_nsec);
+    }
+}
+
+/* Sends @client's relative pointers the motion in @message. */
+static void
+send_relative_motion (WakefieldCompositor           *compositor,
+                      struct wl_client              *client,
+                      const struct WakefieldMessage *message)
 {
-  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *resource;
-  uint32_t serial = wl_display_next_serial (priv->wl_display);
-  uint32_t button;
+  uint64_t utime = message->timestamp;
 
-  /* XXX: Convert to evdev */
-  button = event->button;
+  wl_resource_for_each (resource, &priv->seat.pointer.relative_list)
+    {
+      if (!wl_resource_get_user_data (resource) || wl_resource_get_client (resource) != client)
+        continue;
+
+      zwp_relative_pointer_v1_send_relative_motion (resource, utime >> 32, utime & 0xffffffff,
+                                                    wl_fixed_from_double (message->dx),
+                                                    wl_fixed_from_double (message->dy),
+                                                    wl_fixed_from_double (message->dx_unaccel),
+                                                    wl_fixed_from_double (message->dy_unaccel));
+    }
+}
+
+static void
+broadcast_button (WakefieldCompositor           *compositor,
+                  const struct WakefieldMessage *message)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_resource *resource;
+  uint32_t serial = wl_display_next_serial (priv->wl_display);
 
   wl_resource_for_each (resource, &priv->seat.pointer.resource_list)
     {
+      send_input_timestamp (&priv->seat.pointer.timestamps_list, resource, message->timestamp);
       wl_pointer_send_button (resource, serial,
-                              event->time,
-                              button,
-                              (event->type == GDK_BUTTON_PRESS ? 1 : 0));
+                              message->time,
+                              message->button,
+                              message->pressed ? 1 : 0);
     }
 }
 
-static gboolean
-wakefield_compositor_button_press_event (GtkWidget      *widget,
-                                         GdkEventButton *event)
+/* Ends a group of pointer events for @client, or for every client if
+ * NULL, on the pointers new enough to know about frames. */
+static void
+send_pointer_frame (struct WakefieldPointer *pointer,
+                    struct wl_client        *client)
 {
-  broadcast_button (widget, event);
-  return TRUE;
+  struct wl_resource *resource;
+
+  wl_resource_for_each (resource, &pointer->resource_list)
+    {
+      if (client && wl_resource_get_client (resource) != client)
+        continue;
+
+      if (wl_resource_get_version (resource) >= WL_POINTER_FRAME_SINCE_VERSION)
+        wl_pointer_send_frame (resource);
+    }
+}
+
+/* Sends the focus client the scrolling in @message. Wheels get whole
+ * notches in axis_discrete on clients from before axis_value120, with
+ * what's left over kept for next time. */
+static void
+send_axis (WakefieldCompositor           *compositor,
+           const struct WakefieldMessage *message)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+  const double value[2] = { message->dy, message->dx };
+  const int32_t value120[2] = { message->value120_y, message->value120_x };
+  const gboolean stop[2] = { message->stop_y, message->stop_x };
+  struct wl_client *client;
+  struct wl_resource *resource;
+  int32_t discrete[2];
+  int axis;
+
+  /* WL_POINTER_AXIS_VERTICAL_SCROLL is 0, and HORIZONTAL 1. */
+  for (axis = 0; axis < 2; axis++)
+    {
+      pointer->value120_remainder[axis] += value120[axis];
+      discrete[axis] = pointer->value120_remainder[axis] / 120;
+      pointer->value120_remainder[axis] -= discrete[axis] * 120;
+    }
+
+  if (!pointer->focus)
+    return;
+
+  client = wl_resource_get_client (pointer->focus->resource);
+
+  wl_resource_for_each (resource, &pointer->resource_list)
+    {
+      int version = wl_resource_get_version (resource);
+
+      if (wl_resource_get_client (resource) != client)
+        continue;
+
+      if (version >= WL_POINTER_AXIS_SOURCE_SINCE_VERSION)
+        wl_pointer_send_axis_source (resource, message->axis_source);
+
+      for (axis = 0; axis < 2; axis++)
+        {
+          if (value[axis] == 0)
+            continue;
+
+          if (version >= WL_POINTER_AXIS_VALUE120_SINCE_VERSION)
+            {
+              if (value120[axis])
+                wl_pointer_send_axis_value120 (resource, axis, value120[axis]);
+            }
+          else if (version >= WL_POINTER_AXIS_DISCRETE_SINCE_VERSION && discrete[axis])
+            wl_pointer_send_axis_discrete (resource, axis, discrete[axis]);
+
+          send_input_timestamp (&pointer->timestamps_list, resource, message->timestamp);
+          wl_pointer_send_axis (resource, message->time, axis, wl_fixed_from_double (value[axis]));
+        }
+
+      for (axis = 0; axis < 2; axis++)
+        {
+          if (stop[axis] && version >= WL_POINTER_AXIS_STOP_SINCE_VERSION)
+            wl_pointer_send_axis_stop (resource, message->time, axis);
+        }
+    }
+
+  send_pointer_frame (pointer, client);
 }
 
+/* Moves pointer focus to @surface, if it isn't there already, sending
+ * leave and enter to the clients concerned. Returns whether it moved. */
 static gboolean
-wakefield_compositor_button_release_event (GtkWidget      *widget,
-                                           GdkEventButton *event)
+update_pointer_focus (WakefieldCompositor     *compositor,
+                      struct WakefieldSurface *surface,
+                      double                   sx,
+                      double                   sy)
 {
-  broadcast_button (widget, event);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+  struct wl_resource *resource;
+  uint32_t serial;
+
+  if (pointer->focus == surface)
+    return FALSE;
+
+  serial = wl_display_next_serial (priv->wl_display);
+  pointer->enter_serial = serial;
+
+  if (pointer->focus)
+    {
+      struct wl_client *client = wl_resource_get_client (pointer->focus->resource);
+
+      wl_resource_for_each (resource, &pointer->resource_list)
+        {
+          if (wl_resource_get_client (resource) == client)
+            wl_pointer_send_leave (resource, serial, pointer->focus->resource);
+        }
+    }
+
+  pointer->focus = surface;
+
+  /* Another client's cursor is no good over this one's surfaces. */
+  if (pointer->cursor_surface &&
+      (!surface || wl_resource_get_client (surface->resource) !=
+                   wl_resource_get_client (pointer->cursor_surface->resource)))
+    pointer->cursor_surface = NULL;
+
+  if (pointer->focus)
+    {
+      struct wl_client *client = wl_resource_get_client (pointer->focus->resource);
+
+      wl_resource_for_each (resource, &pointer->resource_list)
+        {
+          if (wl_resource_get_client (resource) == client)
+            wl_pointer_send_enter (resource, serial,
+                                   pointer->focus->resource,
+                                   wl_fixed_from_double (sx),
+                                   wl_fixed_from_double (sy));
+        }
+    }
+  else
+    update_cursor (compositor);
+
   return TRUE;
 }
 
-static gboolean
-wakefield_compositor_motion_notify_event (GtkWidget      *widget,
-                                          GdkEventMotion *event)
+static void
+send_motion (WakefieldCompositor           *compositor,
+             struct WakefieldSurface       *surface,
+             const struct WakefieldMessage *message)
 {
-  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *resource;
 
   wl_resource_for_each (resource, &priv->seat.pointer.resource_list)
     {
+      if (wl_resource_get_client (resource) != wl_resource_get_client (surface->resource))
+        continue;
+
+      send_input_timestamp (&priv->seat.pointer.timestamps_list, resource, message->timestamp);
       wl_pointer_send_motion (resource,
-                              event->time,
-                              wl_fixed_from_int (event->x),
-                              wl_fixed_from_int (event->y));
+                              message->time,
+                              wl_fixed_from_double (message->sx),
+                              wl_fixed_from_double (message->sy));
     }
+}
 
-  return FALSE;
+/* Sends clients the pointer events GTK queued for them. */
+static void
+deliver_pointer_message (WakefieldCompositor           *compositor,
+                         const struct WakefieldMessage *message)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+  struct wl_client *left = NULL, *entered = NULL;
+  struct WakefieldSurface *surface;
+  gboolean moved;
+
+  if (pointer->focus)
+    left = wl_resource_get_client (pointer->focus->resource);
+
+  /* While locked, the pointer stays put over the same surface, and only
+   * relative motion gets through. */
+  if (pointer->constraint && pointer->constraint->lock &&
+      message->type == WAKEFIELD_MESSAGE_POINTER_MOTION)
+    {
+      send_relative_motion (compositor, left, message);
+      send_pointer_frame (pointer, left);
+      return;
+    }
+
+  switch (message->type)
+    {
+    case WAKEFIELD_MESSAGE_POINTER_ENTER:
+    case WAKEFIELD_MESSAGE_POINTER_MOTION:
+      /* The surface might have gone away since GTK saw it. */
+      surface = lookup_surface (compositor, message->surface_id);
+      moved = update_pointer_focus (compositor, surface, message->sx, message->sy);
+
+      if (surface)
+        {
+          pointer->x = message->sx;
+          pointer->y = message->sy;
+        }
+
+      if (surface && message->type == WAKEFIELD_MESSAGE_POINTER_MOTION)
+        {
+          send_relative_motion (compositor, wl_resource_get_client (surface->resource), message);
+          send_motion (compositor, surface, message);
+        }
+
+      /* A client moving between its own surfaces gets its leave and
+       * enter in the same frame. */
+      if (surface && (moved || message->type == WAKEFIELD_MESSAGE_POINTER_MOTION))
+        entered = wl_resource_get_client (surface->resource);
+      if (moved && left && left != entered)
+        send_pointer_frame (pointer, left);
+      if (entered)
+        send_pointer_frame (pointer, entered);
+
+      update_constraint (compositor);
+      break;
+    case WAKEFIELD_MESSAGE_POINTER_LEAVE:
+      if (update_pointer_focus (compositor, NULL, 0, 0) && left)
+        send_pointer_frame (pointer, left);
+
+      update_constraint (compositor);
+      break;
+    case WAKEFIELD_MESSAGE_POINTER_BUTTON:
+      broadcast_button (compositor, message);
+      send_pointer_frame (pointer, NULL);
+      break;
+    case WAKEFIELD_MESSAGE_POINTER_AXIS:
+      send_axis (compositor, message);
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+/* In the history mode, how much motion we hold on to before sending
+ * it on without waiting for the tick. */
+#define MAX_PENDING_MOTION 128
+
+/* Sends on the motion held for the frame clock tick. */
+static void
+flush_pending_motion (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  guint i;
+
+  for (i = 0; i < priv->pending_motion->len; i++)
+    queue_message (compositor, &g_array_index (priv->pending_motion, struct WakefieldMessage, i));
+
+  g_array_set_size (priv->pending_motion, 0);
 }
 
+/* Holds @message until the next frame clock tick, if the motion mode
+ * says so. Returns FALSE if it should go out now. */
 static gboolean
-wakefield_compositor_enter_notify_event (GtkWidget        *widget,
-                                         GdkEventCrossing *event)
+hold_motion (WakefieldCompositor     *compositor,
+             struct WakefieldMessage *message)
 {
-  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-  struct wl_resource *resource;
-  uint32_t serial = wl_display_next_serial (priv->wl_display);
+  GdkFrameClock *frame_clock = gtk_widget_get_frame_clock (GTK_WIDGET (compositor));
 
-  wl_resource_for_each (resource, &priv->seat.pointer.resource_list)
+  if (priv->motion_mode == WAKEFIELD_MOTION_MODE_IMMEDIATE || !frame_clock)
+    return FALSE;
+
+  if (priv->motion_mode == WAKEFIELD_MOTION_MODE_COALESCED)
     {
-      wl_pointer_send_enter (resource, serial,
-                             priv->surface->resource,
-                             wl_fixed_from_int (event->x),
-                             wl_fixed_from_int (event->y));
+      /* Relative motion adds up, rather than getting lost. */
+      if (priv->pending_motion->len > 0)
+        {
+          struct WakefieldMessage *last = &g_array_index (priv->pending_motion, struct WakefieldMessage, 0);
+
+          message->dx += last->dx;
+          message->dy += last->dy;
+          message->dx_unaccel += last->dx_unaccel;
+          message->dy_unaccel += last->dy_unaccel;
+        }
+
+      g_array_set_size (priv->pending_motion, 0);
     }
+  else if (priv->pending_motion->len == MAX_PENDING_MOTION)
+    flush_pending_motion (compositor);
 
-  return FALSE;
+  g_array_append_val (priv->pending_motion, *message);
+  gdk_frame_clock_request_phase (frame_clock, GDK_FRAME_CLOCK_PHASE_UPDATE);
+  return TRUE;
 }
 
-static gboolean
-wakefield_compositor_leave_notify_event (GtkWidget        *widget,
-                                         GdkEventCrossing *event)
+/* Past this, an event time is more likely off a clock that wrapped or
+ * jumped than that late. */
+#define MAX_EVENT_LATENCY_US (60 * G_USEC_PER_SEC)
+
+/* Maps the event time @time, in milliseconds of whatever clock the
+ * window system uses, onto the monotonic clock, keeping the spacing
+ * between events rather than when GTK got around to them. Events only
+ * ever arrive after they happened, so the smallest offset between the
+ * clocks we've seen is the closest. */
+static gint64
+get_event_timestamp (WakefieldCompositor *compositor,
+                     uint32_t             time)
 {
-  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-  struct wl_resource *resource;
-  uint32_t serial = wl_display_next_serial (priv->wl_display);
+  gint64 now = g_get_monotonic_time ();
+  gint64 offset = now - (gint64) time * 1000;
 
-  wl_resource_for_each (resource, &priv->seat.pointer.resource_list)
+  if (time == GDK_CURRENT_TIME)
+    return now;
+
+  if (!priv->has_event_time_offset ||
+      offset < priv->event_time_offset ||
+      offset - priv->event_time_offset > MAX_EVENT_LATENCY_US)
     {
-      wl_pointer_send_leave (resource, serial, priv->surface->resource);
+      priv->event_time_offset = offset;
+      priv->has_event_time_offset = TRUE;
     }
 
-  return FALSE;
+  return (gint64) time * 1000 + priv->event_time_offset;
 }
 
+/* Works out which surface is under the pointer, from what GTK shows,
+ * for the Wayland side to send the event to. */
 static void
-wakefield_pointer_init (struct WakefieldPointer *pointer)
+queue_pointer_event (WakefieldCompositor  *compositor,
+                     WakefieldMessageType  type,
+                     double                x,
+                     double                y,
+                     double                dx,
+                     double                dy,
+                     double                dx_unaccel,
+                     double                dy_unaccel,
+                     uint32_t              time)
 {
-  wl_list_init (&pointer->resource_list);
-  pointer->cursor_surface = NULL;
-}
+  struct WakefieldMessage message = { 0 };
+  struct WakefieldSurface *surface;
 
-#define SEAT_VERSION 4
+  message.type = type;
+  message.time = time;
+  message.timestamp = get_event_timestamp (compositor, time);
+  message.dx = dx;
+  message.dy = dy;
+  message.dx_unaccel = dx_unaccel;
+  message.dy_unaccel = dy_unaccel;
 
-static const struct wl_seat_interface seat_interface = {
-  seat_get_pointer,
-  NULL, /* get_keyboard */
-  NULL, /* get_touch */
-};
+  surface = pick_surface (compositor, x, y, &message.sx, &message.sy);
+  if (surface)
+    message.surface_id = surface->id;
+
+  if (type == WAKEFIELD_MESSAGE_POINTER_MOTION && hold_motion (compositor, &message))
+    return;
+
+  flush_pending_motion (compositor);
+  /* Scrolling goes to the surface it happened over. */
+  flush_pending_scroll (compositor);
+  queue_message (compositor, &message);
+}
 
 static void
-bind_seat (struct wl_client *client,
-           void *data,
-           uint32_t version,
-           uint32_t id)
+queue_button (WakefieldCompositor *compositor,
+              GdkEventButton      *event)
 {
-  struct WaylandSeat *seat = data;
-  struct wl_resource *cr;
+  struct WakefieldMessage message = { 0 };
 
-  cr = wl_resource_create (client, &wl_seat_interface, version, id);
-  wl_resource_set_implementation (cr, &seat_interface, seat, unbind_resource);
-  wl_seat_send_capabilities (cr, WL_SEAT_CAPABILITY_POINTER);
-  wl_seat_send_name (cr, "seat0");
+  flush_pending_motion (compositor);
+  flush_pending_scroll (compositor);
+
+  message.type = WAKEFIELD_MESSAGE_POINTER_BUTTON;
+  message.time = event->time;
+  message.timestamp = get_event_timestamp (compositor, event->time);
+  /* XXX: Convert to evdev */
+  message.button = event->button;
+  message.pressed = (event->type == GDK_BUTTON_PRESS);
+
+  queue_message (compositor, &message);
+}
+
+static gboolean
+wakefield_compositor_button_press_event (GtkWidget      *widget,
+                                         GdkEventButton *event)
+{
+  if (!gtk_widget_has_focus (widget))
+    gtk_widget_grab_focus (widget);
+
+  queue_button (WAKEFIELD_COMPOSITOR (widget), event);
+  return TRUE;
+}
+
+static gboolean
+wakefield_compositor_button_release_event (GtkWidget      *widget,
+                                           GdkEventButton *event)
+{
+  queue_button (WAKEFIELD_COMPOSITOR (widget), event);
+  return TRUE;
 }
 
+/* How far a wheel notch scrolls, in surface coordinates, like Weston
+ * does. GDK's smooth scrolling has a notch as 1. */
+#define SCROLL_STEP_DISTANCE 10
+
+/* Sends on the scrolling added up since the last tick. */
 static void
-wakefield_seat_init (struct WakefieldSeat *seat,
-                     struct wl_display    *wl_display)
+flush_pending_scroll (WakefieldCompositor *compositor)
 {
-  wakefield_pointer_init (&seat->pointer);
-  /* wakefield_keyboard_init (&seat->keyboard); */
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  if (!priv->has_pending_scroll)
+    return;
+
+  priv->has_pending_scroll = FALSE;
+  queue_message (compositor, &priv->pending_scroll);
+}
+
+static uint32_t
+get_axis_source (GdkEventScroll *event)
+{
+  GdkDevice *device = gdk_event_get_source_device ((GdkEvent *) event);
+
+  if (event->direction != GDK_SCROLL_SMOOTH || !device)
+    return WL_POINTER_AXIS_SOURCE_WHEEL;
+
+  switch (gdk_device_get_source (device))
+    {
+    case GDK_SOURCE_TOUCHPAD:
+    case GDK_SOURCE_TOUCHSCREEN:
+      return WL_POINTER_AXIS_SOURCE_FINGER;
+    case GDK_SOURCE_TRACKPOINT:
+      return WL_POINTER_AXIS_SOURCE_CONTINUOUS;
+    default:
+      return WL_POINTER_AXIS_SOURCE_WHEEL;
+    }
+}
+
+/* Adds @event to the scrolling held for the next frame clock tick, so
+ * a touchpad's stream of small deltas makes for one axis event per
+ * frame. */
+static gboolean
+wakefield_compositor_scroll_event (GtkWidget      *widget,
+                                   GdkEventScroll *event)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  GdkFrameClock *frame_clock = gtk_widget_get_frame_clock (widget);
+  struct WakefieldMessage *message = &priv->pending_scroll;
+  uint32_t axis_source = get_axis_source (event);
+  double dx = 0, dy = 0;
+
+  /* With smooth scrolling, we get the real thing as well. */
+  if (event->direction != GDK_SCROLL_SMOOTH &&
+      gdk_event_get_pointer_emulated ((GdkEvent *) event))
+    return TRUE;
+
+  switch (event->direction)
+    {
+    case GDK_SCROLL_UP:
+      dy = -1;
+      break;
+    case GDK_SCROLL_DOWN:
+      dy = 1;
+      break;
+    case GDK_SCROLL_LEFT:
+      dx = -1;
+      break;
+    case GDK_SCROLL_RIGHT:
+      dx = 1;
+      break;
+    case GDK_SCROLL_SMOOTH:
+      gdk_event_get_scroll_deltas ((GdkEvent *) event, &dx, &dy);
+      break;
+    }
+
+  /* A different device starts a group of its own. */
+  if (priv->has_pending_scroll && message->axis_source != axis_source)
+    flush_pending_scroll (compositor);
+
+  if (!priv->has_pending_scroll)
+    {
+      memset (message, 0, sizeof (*message));
+      message->type = WAKEFIELD_MESSAGE_POINTER_AXIS;
+      message->axis_source = axis_source;
+      priv->has_pending_scroll = TRUE;
+    }
+
+  message->time = event->time;
+  message->timestamp = get_event_timestamp (compositor, event->time);
+  message->dx += dx * SCROLL_STEP_DISTANCE;
+  message->dy += dy * SCROLL_STEP_DISTANCE;
+
+  if (axis_source == WL_POINTER_AXIS_SOURCE_WHEEL)
+    {
+      message->value120_x += lround (dx * 120);
+      message->value120_y += lround (dy * 120);
+    }
+
+  /* GDK doesn't say which axis stopped, so both did. */
+  if (event->direction == GDK_SCROLL_SMOOTH && gdk_event_is_scroll_stop_event ((GdkEvent *) event))
+    message->stop_x = message->stop_y = TRUE;
+
+  if (frame_clock)
+    gdk_frame_clock_request_phase (frame_clock, GDK_FRAME_CLOCK_PHASE_UPDATE);
+  else
+    flush_pending_scroll (compositor);
+
+  return TRUE;
+}
+
+static gboolean
+wakefield_compositor_motion_notify_event (GtkWidget      *widget,
+                                          GdkEventMotion *event)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  double x, y, dx, dy, dx_unaccel, dy_unaccel;
+
+  if (constrain_motion (compositor, event, &x, &y, &dx, &dy, &dx_unaccel, &dy_unaccel))
+    queue_pointer_event (compositor, WAKEFIELD_MESSAGE_POINTER_MOTION,
+                         x, y, dx, dy, dx_unaccel, dy_unaccel, event->time);
+  return FALSE;
+}
+
+static gboolean
+wakefield_compositor_enter_notify_event (GtkWidget        *widget,
+                                         GdkEventCrossing *event)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  priv->last_root_x = event->x_root;
+  priv->last_root_y = event->y_root;
+  priv->have_last_root = TRUE;
+
+  /* What the pointer did elsewhere isn't motion over us. */
+  priv->raw_dx = priv->raw_dy = 0;
+
+  queue_pointer_event (compositor, WAKEFIELD_MESSAGE_POINTER_ENTER,
+                       event->x, event->y, 0, 0, 0, 0, event->time);
+  return FALSE;
+}
+
+static gboolean
+wakefield_compositor_leave_notify_event (GtkWidget        *widget,
+                                         GdkEventCrossing *event)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (WAKEFIELD_COMPOSITOR (widget));
+  struct WakefieldMessage message = { 0 };
+
+  /* Our own grab moving the pointer over to us isn't it leaving. */
+  if (priv->constraint_grab && event->mode != GDK_CROSSING_NORMAL)
+    return FALSE;
+
+  priv->have_last_root = FALSE;
+
+  flush_pending_motion (WAKEFIELD_COMPOSITOR (widget));
+  flush_pending_scroll (WAKEFIELD_COMPOSITOR (widget));
+
+  message.type = WAKEFIELD_MESSAGE_POINTER_LEAVE;
+  message.time = event->time;
+  queue_message (WAKEFIELD_COMPOSITOR (widget), &message);
+
+  return FALSE;
+}
+
+/* wl_keyboard */
+
+/* Same as Weston's defaults, since GDK doesn't tell us the server's. */
+#define KEY_REPEAT_RATE 40
+#define KEY_REPEAT_DELAY 400
+
+static const struct wl_keyboard_interface keyboard_interface = {
+  resource_release,
+};
+
+static void
+keyboard_destructor (struct wl_resource *resource)
+{
+  struct WakefieldSeat *seat = wl_resource_get_user_data (resource);
+  struct wl_resource *timestamps;
+
+  wl_resource_for_each (timestamps, &seat->keyboard.timestamps_list)
+    {
+      if (wl_resource_get_user_data (timestamps) == resource)
+        wl_resource_set_user_data (timestamps, NULL);
+    }
+
+  unbind_resource (resource);
+}
+
+static void
+send_keyboard_enter (struct WakefieldKeyboard *keyboard,
+                     struct wl_resource       *resource,
+                     uint32_t                  serial)
+{
+  wl_keyboard_send_enter (resource, serial, keyboard->focus->resource, &keyboard->keys);
+  wl_keyboard_send_modifiers (resource, serial,
+                              keyboard->mods_depressed, keyboard->mods_latched,
+                              keyboard->mods_locked, keyboard->group);
+}
+
+static void
+seat_get_keyboard (struct wl_client    *client,
+                   struct wl_resource  *seat_resource,
+                   uint32_t             id)
+{
+  WakefieldCompositorPrivate *priv;
+  struct WakefieldSeat *seat = wl_resource_get_user_data (seat_resource);
+  struct WakefieldKeyboard *keyboard = &seat->keyboard;
+  struct wl_resource *cr;
+
+  priv = wakefield_compositor_get_instance_private (seat->compositor);
+
+  cr = wl_resource_create (client, &wl_keyboard_interface, wl_resource_get_version (seat_resource), id);
+  wl_resource_set_implementation (cr, &keyboard_interface, seat, keyboard_destructor);
+  wl_list_insert (&keyboard->resource_list, wl_resource_get_link (cr));
+
+  /* Every client gets the same fd; the seals keep them from writing to
+   * it, so there's no need for a copy each. */
+  if (keyboard->keymap_fd >= 0)
+    wl_keyboard_send_keymap (cr, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
+                             keyboard->keymap_fd, keyboard->keymap_size);
+
+  if (wl_resource_get_version (cr) >= WL_KEYBOARD_REPEAT_INFO_SINCE_VERSION)
+    wl_keyboard_send_repeat_info (cr, KEY_REPEAT_RATE, KEY_REPEAT_DELAY);
+
+  if (keyboard->focus && wl_resource_get_client (keyboard->focus->resource) == client)
+    send_keyboard_enter (keyboard, cr, wl_display_next_serial (priv->wl_display));
+}
+
+/* Gives the keyboard focus to the root surface while we have it, and
+ * takes it away otherwise, sending leave and enter to the clients
+ * concerned. */
+static void
+update_keyboard_focus (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldKeyboard *keyboard = &priv->seat.keyboard;
+  struct WakefieldSurface *surface = keyboard->has_focus ? priv->surface : NULL;
+  struct wl_resource *resource;
+  uint32_t serial;
+
+  if (keyboard->focus == surface)
+    return;
+
+  serial = wl_display_next_serial (priv->wl_display);
+
+  if (keyboard->focus)
+    {
+      struct wl_client *client = wl_resource_get_client (keyboard->focus->resource);
+
+      wl_resource_for_each (resource, &keyboard->resource_list)
+        {
+          if (wl_resource_get_client (resource) == client)
+            wl_keyboard_send_leave (resource, serial, keyboard->focus->resource);
+        }
+    }
+
+  keyboard->focus = surface;
+
+  if (keyboard->focus)
+    {
+      struct wl_client *client = wl_resource_get_client (keyboard->focus->resource);
+
+      wl_resource_for_each (resource, &keyboard->resource_list)
+        {
+          if (wl_resource_get_client (resource) == client)
+            send_keyboard_enter (keyboard, resource, serial);
+        }
+    }
+}
+
+/* Records @key going down or up, returning FALSE if it already was,
+ * as it is for GDK's autorepeat, which clients do for themselves. */
+static gboolean
+update_pressed_keys (struct WakefieldKeyboard *keyboard,
+                     uint32_t                  key,
+                     gboolean                  pressed)
+{
+  uint32_t *k, *end = (uint32_t *) ((char *) keyboard->keys.data + keyboard->keys.size);
+
+  wl_array_for_each (k, &keyboard->keys)
+    {
+      if (*k != key)
+        continue;
+
+      if (pressed)
+        return FALSE;
+
+      *k = end[-1];
+      keyboard->keys.size -= sizeof (*k);
+      return TRUE;
+    }
+
+  if (!pressed)
+    return FALSE;
+
+  k = wl_array_add (&keyboard->keys, sizeof (*k));
+  *k = key;
+  return TRUE;
+}
+
+/* Sends the focus client the key in @message, and then the modifiers
+ * it left us with, if they changed, so each GDK event makes for at
+ * most one of each. */
+static void
+send_key (WakefieldCompositor           *compositor,
+          const struct WakefieldMessage *message)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldKeyboard *keyboard = &priv->seat.keyboard;
+  struct wl_client *client = NULL;
+  struct wl_resource *resource;
+  gboolean mods_changed;
+  uint32_t serial;
+
+  if (!update_pressed_keys (keyboard, message->key, message->pressed))
+    return;
+
+  if (keyboard->focus)
+    client = wl_resource_get_client (keyboard->focus->resource);
+
+  if (client)
+    {
+      serial = wl_display_next_serial (priv->wl_display);
+
+      wl_resource_for_each (resource, &keyboard->resource_list)
+        {
+          if (wl_resource_get_client (resource) != client)
+            continue;
+
+          send_input_timestamp (&keyboard->timestamps_list, resource, message->timestamp);
+          wl_keyboard_send_key (resource, serial, message->time, message->key,
+                                message->pressed ? WL_KEYBOARD_KEY_STATE_PRESSED :
+                                                   WL_KEYBOARD_KEY_STATE_RELEASED);
+        }
+    }
+
+  mods_changed = (keyboard->mods_depressed != message->mods_depressed ||
+                  keyboard->mods_latched != message->mods_latched ||
+                  keyboard->mods_locked != message->mods_locked ||
+                  keyboard->group != message->group);
+
+  keyboard->mods_depressed = message->mods_depressed;
+  keyboard->mods_latched = message->mods_latched;
+  keyboard->mods_locked = message->mods_locked;
+  keyboard->group = message->group;
+
+  if (!client || !mods_changed)
+    return;
+
+  serial = wl_display_next_serial (priv->wl_display);
+
+  wl_resource_for_each (resource, &keyboard->resource_list)
+    {
+      if (wl_resource_get_client (resource) == client)
+        wl_keyboard_send_modifiers (resource, serial,
+                                    keyboard->mods_depressed, keyboard->mods_latched,
+                                    keyboard->mods_locked, keyboard->group);
+    }
+}
+
+/* Sends clients the keyboard events GTK queued for them. */
+static void
+deliver_keyboard_message (WakefieldCompositor           *compositor,
+                          const struct WakefieldMessage *message)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldKeyboard *keyboard = &priv->seat.keyboard;
+
+  switch (message->type)
+    {
+    case WAKEFIELD_MESSAGE_KEYBOARD_ENTER:
+      keyboard->mods_depressed = message->mods_depressed;
+      keyboard->mods_latched = message->mods_latched;
+      keyboard->mods_locked = message->mods_locked;
+      keyboard->group = message->group;
+      keyboard->has_focus = TRUE;
+      update_keyboard_focus (compositor);
+      break;
+    case WAKEFIELD_MESSAGE_KEYBOARD_LEAVE:
+      keyboard->has_focus = FALSE;
+      update_keyboard_focus (compositor);
+
+      /* We won't see them come back up. */
+      keyboard->keys.size = 0;
+      break;
+    case WAKEFIELD_MESSAGE_KEYBOARD_KEY:
+      send_key (compositor, message);
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+/* Works out the modifiers after @keycode, an XKB keycode or 0 for
+ * none, goes down or up, given GDK's idea of the modifiers before.
+ * Those only get taken on when they disagree with ours, which they
+ * do after we missed events while we didn't have focus. GDK doesn't
+ * say which are held and which are locked, so we go by which are
+ * locks. */
+static void
+get_key_mods (struct WakefieldKeyboard *keyboard,
+              guint                     state,
+              guint                     group,
+              guint                     keycode,
+              gboolean                  pressed,
+              struct WakefieldMessage  *message)
+{
+  struct xkb_state *xkb_state = keyboard->xkb_state;
+  /* The core X modifiers are the first eight in any XKB keymap. */
+  guint mods = state & 0xff;
+
+  if ((xkb_state_serialize_mods (xkb_state, XKB_STATE_MODS_EFFECTIVE) & 0xff) != mods ||
+      xkb_state_serialize_layout (xkb_state, XKB_STATE_LAYOUT_EFFECTIVE) != group)
+    xkb_state_update_mask (xkb_state, mods & ~keyboard->lock_mods, 0, mods & keyboard->lock_mods, 0, 0, group);
+
+  if (keycode)
+    xkb_state_update_key (xkb_state, keycode, pressed ? XKB_KEY_DOWN : XKB_KEY_UP);
+
+  message->mods_depressed = xkb_state_serialize_mods (xkb_state, XKB_STATE_MODS_DEPRESSED);
+  message->mods_latched = xkb_state_serialize_mods (xkb_state, XKB_STATE_MODS_LATCHED);
+  message->mods_locked = xkb_state_serialize_mods (xkb_state, XKB_STATE_MODS_LOCKED);
+  message->group = xkb_state_serialize_layout (xkb_state, XKB_STATE_LAYOUT_EFFECTIVE);
+}
+
+static gboolean
+queue_key (WakefieldCompositor *compositor,
+           GdkEventKey         *event)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldMessage message = { 0 };
+
+  if (!priv->seat.keyboard.xkb_state)
+    return FALSE;
+
+  message.type = WAKEFIELD_MESSAGE_KEYBOARD_KEY;
+  message.time = event->time;
+  message.timestamp = get_event_timestamp (compositor, event->time);
+  /* GDK's X11 and Wayland backends give us XKB keycodes, which are
+   * evdev's plus 8. */
+  message.key = event->hardware_keycode - 8;
+  message.pressed = (event->type == GDK_KEY_PRESS);
+  get_key_mods (&priv->seat.keyboard, event->state, event->group,
+                event->hardware_keycode, message.pressed, &message);
+
+  queue_message (compositor, &message);
+  return TRUE;
+}
+
+static gboolean
+wakefield_compositor_key_press_event (GtkWidget   *widget,
+                                      GdkEventKey *event)
+{
+  return queue_key (WAKEFIELD_COMPOSITOR (widget), event);
+}
+
+static gboolean
+wakefield_compositor_key_release_event (GtkWidget   *widget,
+                                        GdkEventKey *event)
+{
+  return queue_key (WAKEFIELD_COMPOSITOR (widget), event);
+}
+
+static gboolean
+wakefield_compositor_focus_in_event (GtkWidget     *widget,
+                                     GdkEventFocus *event)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldMessage message = { 0 };
+  GdkKeymap *keymap;
+
+  if (!priv->seat.keyboard.xkb_state)
+    return FALSE;
+
+  keymap = gdk_keymap_get_for_display (gtk_widget_get_display (widget));
+
+  message.type = WAKEFIELD_MESSAGE_KEYBOARD_ENTER;
+  get_key_mods (&priv->seat.keyboard, gdk_keymap_get_modifier_state (keymap), 0, 0, FALSE, &message);
+  queue_message (compositor, &message);
+
+  return FALSE;
+}
+
+static gboolean
+wakefield_compositor_focus_out_event (GtkWidget     *widget,
+                                      GdkEventFocus *event)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldMessage message = { 0 };
+
+  if (!priv->seat.keyboard.xkb_state)
+    return FALSE;
+
+  message.type = WAKEFIELD_MESSAGE_KEYBOARD_LEAVE;
+  queue_message (compositor, &message);
+
+  return FALSE;
+}
+
+/* wl_touch */
+
+/* GTK's record of a touch sequence GDK has going. */
+struct WakefieldTouchSequence
+{
+  GdkEventSequence *sequence;
+  int32_t id;
+  guint32 surface_id;
+};
+
+static const struct wl_touch_interface touch_interface = {
+  resource_release,
+};
+
+static void
+touch_destructor (struct wl_resource *resource)
+{
+  struct WakefieldSeat *seat = wl_resource_get_user_data (resource);
+  struct wl_resource *timestamps;
+
+  wl_resource_for_each (timestamps, &seat->touch.timestamps_list)
+    {
+      if (wl_resource_get_user_data (timestamps) == resource)
+        wl_resource_set_user_data (timestamps, NULL);
+    }
+
+  unbind_resource (resource);
+}
+
+static void
+seat_get_touch (struct wl_client    *client,
+                struct wl_resource  *seat_resource,
+                uint32_t             id)
+{
+  struct WakefieldSeat *seat = wl_resource_get_user_data (seat_resource);
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &wl_touch_interface, wl_resource_get_version (seat_resource), id);
+  wl_resource_set_implementation (cr, &touch_interface, seat, touch_destructor);
+  wl_list_insert (&seat->touch.resource_list, wl_resource_get_link (cr));
+}
+
+static struct WakefieldTouchPoint *
+lookup_touch_point (struct WakefieldTouch *touch,
+                    int32_t                id,
+                    guint                 *index)
+{
+  guint i;
+
+  for (i = 0; i < touch->points->len; i++)
+    {
+      struct WakefieldTouchPoint *point = &g_array_index (touch->points, struct WakefieldTouchPoint, i);
+
+      if (point->id == id)
+        {
+          if (index)
+            *index = i;
+          return point;
+        }
+    }
+
+  return NULL;
+}
+
+/* Sends @message to the wl_touches of the client whose surface the
+ * point is on. */
+static void
+send_touch_event (WakefieldCompositor           *compositor,
+                  struct WakefieldTouchPoint    *point,
+                  const struct WakefieldMessage *message)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldTouch *touch = &priv->seat.touch;
+  struct wl_client *client = wl_resource_get_client (point->surface->resource);
+  struct wl_resource *resource;
+  uint32_t serial = 0;
+
+  if (message->type != WAKEFIELD_MESSAGE_TOUCH_MOTION)
+    serial = wl_display_next_serial (priv->wl_display);
+
+  wl_resource_for_each (resource, &touch->resource_list)
+    {
+      if (wl_resource_get_client (resource) != client)
+        continue;
+
+      send_input_timestamp (&touch->timestamps_list, resource, message->timestamp);
+
+      switch (message->type)
+        {
+        case WAKEFIELD_MESSAGE_TOUCH_DOWN:
+          wl_touch_send_down (resource, serial, message->time, point->surface->resource, point->id,
+                              wl_fixed_from_double (message->sx), wl_fixed_from_double (message->sy));
+          break;
+        case WAKEFIELD_MESSAGE_TOUCH_MOTION:
+          wl_touch_send_motion (resource, message->time, point->id,
+                                wl_fixed_from_double (message->sx), wl_fixed_from_double (message->sy));
+          break;
+        case WAKEFIELD_MESSAGE_TOUCH_UP:
+          wl_touch_send_up (resource, serial, message->time, point->id);
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+    }
+
+  if (!g_ptr_array_find (touch->frame_clients, client, NULL))
+    g_ptr_array_add (touch->frame_clients, client);
+}
+
+/* Tells the client of the point's surface that the touch sequence was
+ * taken away, which goes for all of its points. */
+static void
+cancel_touch (WakefieldCompositor        *compositor,
+              struct WakefieldTouchPoint *point)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldTouch *touch = &priv->seat.touch;
+  struct wl_client *client = wl_resource_get_client (point->surface->resource);
+  struct wl_resource *resource;
+  guint i;
+
+  wl_resource_for_each (resource, &touch->resource_list)
+    {
+      if (wl_resource_get_client (resource) == client)
+        wl_touch_send_cancel (resource);
+    }
+
+  for (i = 0; i < touch->points->len; i++)
+    {
+      struct WakefieldTouchPoint *other = &g_array_index (touch->points, struct WakefieldTouchPoint, i);
+
+      if (other->surface && wl_resource_get_client (other->surface->resource) == client)
+        other->surface = NULL;
+    }
+
+  g_ptr_array_remove (touch->frame_clients, client);
+}
+
+/* Sends clients the touch events GTK queued for them. */
+static void
+deliver_touch_message (WakefieldCompositor           *compositor,
+                       const struct WakefieldMessage *message)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldTouch *touch = &priv->seat.touch;
+  struct WakefieldTouchPoint *point;
+  struct wl_resource *resource;
+  guint i;
+
+  switch (message->type)
+    {
+    case WAKEFIELD_MESSAGE_TOUCH_DOWN:
+      g_array_set_size (touch->points, touch->points->len + 1);
+      point = &g_array_index (touch->points, struct WakefieldTouchPoint, touch->points->len - 1);
+      point->id = message->touch_id;
+      /* The surface might have gone away since GTK saw it. */
+      point->surface = lookup_surface (compositor, message->surface_id);
+
+      if (point->surface)
+        send_touch_event (compositor, point, message);
+      break;
+    case WAKEFIELD_MESSAGE_TOUCH_MOTION:
+      point = lookup_touch_point (touch, message->touch_id, NULL);
+      if (point && point->surface)
+        send_touch_event (compositor, point, message);
+      break;
+    case WAKEFIELD_MESSAGE_TOUCH_UP:
+    case WAKEFIELD_MESSAGE_TOUCH_CANCEL:
+      point = lookup_touch_point (touch, message->touch_id, &i);
+      if (!point)
+        break;
+
+      if (point->surface && message->type == WAKEFIELD_MESSAGE_TOUCH_UP)
+        send_touch_event (compositor, point, message);
+      else if (point->surface)
+        cancel_touch (compositor, point);
+
+      g_array_remove_index_fast (touch->points, i);
+      break;
+    case WAKEFIELD_MESSAGE_TOUCH_FRAME:
+      wl_resource_for_each (resource, &touch->resource_list)
+        {
+          if (g_ptr_array_find (touch->frame_clients, wl_resource_get_client (resource), NULL))
+            wl_touch_send_frame (resource);
+        }
+
+      g_ptr_array_set_size (touch->frame_clients, 0);
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+/* Sends on the touch events held for the frame clock tick, in a frame
+ * of their own. */
+static void
+flush_pending_touch (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldMessage message = { 0 };
+  guint i;
+
+  if (priv->pending_touch->len == 0)
+    return;
+
+  for (i = 0; i < priv->pending_touch->len; i++)
+    queue_message (compositor, &g_array_index (priv->pending_touch, struct WakefieldMessage, i));
+
+  g_array_set_size (priv->pending_touch, 0);
+
+  message.type = WAKEFIELD_MESSAGE_TOUCH_FRAME;
+  queue_message (compositor, &message);
+}
+
+/* Holds @message until the next frame clock tick, in place of the
+ * point's last motion if that's all there is since, outside of the
+ * history mode. */
+static void
+hold_touch (WakefieldCompositor     *compositor,
+            struct WakefieldMessage *message)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  GdkFrameClock *frame_clock = gtk_widget_get_frame_clock (GTK_WIDGET (compositor));
+  GArray *pending = priv->pending_touch;
+  guint i;
+
+  if (message->type == WAKEFIELD_MESSAGE_TOUCH_MOTION &&
+      priv->motion_mode != WAKEFIELD_MOTION_MODE_HISTORY)
+    {
+      for (i = pending->len; i-- > 0; )
+        {
+          struct WakefieldMessage *held = &g_array_index (pending, struct WakefieldMessage, i);
+
+          if (held->touch_id != message->touch_id)
+            continue;
+
+          if (held->type == WAKEFIELD_MESSAGE_TOUCH_MOTION)
+            {
+              *held = *message;
+              return;
+            }
+
+          break;
+        }
+    }
+
+  g_array_append_val (pending, *message);
+
+  if (!frame_clock || pending->len >= MAX_PENDING_MOTION)
+    flush_pending_touch (compositor);
+  else
+    gdk_frame_clock_request_phase (frame_clock, GDK_FRAME_CLOCK_PHASE_UPDATE);
+}
+
+/* Maps @x and @y in widget coordinates to those of the surface with
+ * @surface_id, as GTK shows it. Returns FALSE if it isn't shown. */
+static gboolean
+map_to_surface (WakefieldCompositor *compositor,
+                guint32              surface_id,
+                double               x,
+                double               y,
+                double              *sx,
+                double              *sy)
+{
+  GPtrArray *surfaces = get_surfaces (compositor);
+  gboolean found = FALSE;
+  guint i;
+
+  for (i = 0; i < surfaces->len && !found; i++)
+    {
+      struct WakefieldSurface *surface = g_ptr_array_index (surfaces, i);
+      cairo_rectangle_int_t content_rect;
+      int width, height;
+
+      if (surface->id != surface_id || !get_content_rect (surface, &content_rect))
+        continue;
+
+      get_surface_size (surface, &width, &height);
+      *sx = (x - content_rect.x) * width / content_rect.width;
+      *sy = (y - content_rect.y) * height / content_rect.height;
+      found = TRUE;
+    }
+
+  g_ptr_array_free (surfaces, TRUE);
+  return found;
+}
+
+static struct WakefieldTouchSequence *
+lookup_touch_sequence (WakefieldCompositor *compositor,
+                       GdkEventSequence    *sequence,
+                       guint               *index)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  guint i;
+
+  for (i = 0; i < priv->touch_sequences->len; i++)
+    {
+      struct WakefieldTouchSequence *seq = &g_array_index (priv->touch_sequences, struct WakefieldTouchSequence, i);
+
+      if (seq->sequence == sequence)
+        {
+          *index = i;
+          return seq;
+        }
+    }
+
+  return NULL;
+}
+
+/* Finds the lowest point id not in use, to keep them small. */
+static int32_t
+next_touch_id (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  int32_t id = 0;
+  guint i;
+
+ again:
+  for (i = 0; i < priv->touch_sequences->len; i++)
+    {
+      if (g_array_index (priv->touch_sequences, struct WakefieldTouchSequence, i).id == id)
+        {
+          id++;
+          goto again;
+        }
+    }
+
+  return id;
+}
+
+static gboolean
+wakefield_compositor_touch_event (GtkWidget     *widget,
+                                  GdkEventTouch *event)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldMessage message = { 0 };
+  struct WakefieldTouchSequence *seq;
+  struct WakefieldSurface *surface;
+  int32_t id;
+  guint index;
+
+  message.time = event->time;
+  message.timestamp = get_event_timestamp (compositor, event->time);
+
+  seq = lookup_touch_sequence (compositor, event->sequence, &index);
+
+  switch (event->type)
+    {
+    case GDK_TOUCH_BEGIN:
+      if (seq)
+        return TRUE;
+
+      id = next_touch_id (compositor);
+      g_array_set_size (priv->touch_sequences, priv->touch_sequences->len + 1);
+      seq = &g_array_index (priv->touch_sequences, struct WakefieldTouchSequence, priv->touch_sequences->len - 1);
+      seq->sequence = event->sequence;
+      seq->id = id;
+
+      surface = pick_surface (compositor, event->x, event->y, &message.sx, &message.sy);
+      seq->surface_id = surface ? surface->id : 0;
+
+      message.type = WAKEFIELD_MESSAGE_TOUCH_DOWN;
+      message.touch_id = seq->id;
+      message.surface_id = seq->surface_id;
+      break;
+    case GDK_TOUCH_UPDATE:
+      if (!seq || !map_to_surface (compositor, seq->surface_id, event->x, event->y, &message.sx, &message.sy))
+        return TRUE;
+
+      message.type = WAKEFIELD_MESSAGE_TOUCH_MOTION;
+      message.touch_id = seq->id;
+      break;
+    case GDK_TOUCH_END:
+    case GDK_TOUCH_CANCEL:
+      if (!seq)
+        return TRUE;
+
+      message.type = (event->type == GDK_TOUCH_END ? WAKEFIELD_MESSAGE_TOUCH_UP :
+                                                     WAKEFIELD_MESSAGE_TOUCH_CANCEL);
+      message.touch_id = seq->id;
+      g_array_remove_index_fast (priv->touch_sequences, index);
+      break;
+    default:
+      return FALSE;
+    }
+
+  hold_touch (compositor, &message);
+  return TRUE;
+}
+
+static void
+wakefield_touch_init (struct WakefieldTouch *touch)
+{
+  wl_list_init (&touch->resource_list);
+  wl_list_init (&touch->timestamps_list);
+  touch->points = g_array_new (FALSE, FALSE, sizeof (struct WakefieldTouchPoint));
+  touch->frame_clients = g_ptr_array_new ();
+}
+
+/* Puts @keymap into a sealed memfd, which clients can map but nobody
+ * can change. Returns -1 if we can't. */
+static int
+create_keymap_fd (const char *keymap,
+                  size_t      size)
+{
+  size_t written = 0;
+  int fd;
+
+  fd = memfd_create ("wakefield-keymap", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return -1;
+
+  while (written < size)
+    {
+      ssize_t ret = write (fd, keymap + written, size - written);
+
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        goto fail;
+
+      written += ret;
+    }
+
+  if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+    goto fail;
+
+  return fd;
+
+ fail:
+  close (fd);
+  return -1;
+}
+
+/* Compiles the keymap the window system uses, if it can tell us, or
+ * the default one from the environment. */
+static struct xkb_keymap *
+create_keymap (struct xkb_context *context,
+               GdkDisplay         *display)
+{
+#ifdef GDK_WINDOWING_X11
+  if (GDK_IS_X11_DISPLAY (display))
+    {
+      xcb_connection_t *connection = XGetXCBConnection (gdk_x11_display_get_xdisplay (display));
+      struct xkb_keymap *keymap = NULL;
+      int32_t device_id = -1;
+
+      if (xkb_x11_setup_xkb_extension (connection,
+                                       XKB_X11_MIN_MAJOR_XKB_VERSION,
+                                       XKB_X11_MIN_MINOR_XKB_VERSION,
+                                       XKB_X11_SETUP_XKB_EXTENSION_NO_FLAGS,
+                                       NULL, NULL, NULL, NULL))
+        device_id = xkb_x11_get_core_keyboard_device_id (connection);
+
+      if (device_id != -1)
+        keymap = xkb_x11_keymap_new_from_device (context, connection, device_id,
+                                                 XKB_KEYMAP_COMPILE_NO_FLAGS);
+      if (keymap)
+        return keymap;
+    }
+#endif
+
+  /* XXX: Elsewhere, GDK won't tell us the server's keymap. */
+  return xkb_keymap_new_from_names (context, NULL, XKB_KEYMAP_COMPILE_NO_FLAGS);
+}
+
+static void
+wakefield_keyboard_init (struct WakefieldKeyboard *keyboard,
+                         GdkDisplay               *display)
+{
+  static const char * const lock_names[] = { XKB_MOD_NAME_CAPS, XKB_MOD_NAME_NUM };
+  struct xkb_context *context;
+  char *keymap;
+  guint i;
+
+  wl_list_init (&keyboard->resource_list);
+  wl_list_init (&keyboard->timestamps_list);
+  wl_array_init (&keyboard->keys);
+  keyboard->focus = NULL;
+  keyboard->keymap_fd = -1;
+
+  context = xkb_context_new (XKB_CONTEXT_NO_FLAGS);
+  if (context)
+    {
+      keyboard->keymap = create_keymap (context, display);
+      xkb_context_unref (context);
+    }
+
+  if (!keyboard->keymap)
+    {
+      g_warning ("Couldn't compile a keymap, no keyboard for clients");
+      return;
+    }
+
+  keymap = xkb_keymap_get_as_string (keyboard->keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+  keyboard->keymap_size = strlen (keymap) + 1;
+  keyboard->keymap_fd = create_keymap_fd (keymap, keyboard->keymap_size);
+  free (keymap);
+
+  if (keyboard->keymap_fd < 0)
+    {
+      g_warning ("Couldn't create a sealed keymap, no keyboard for clients");
+      g_clear_pointer (&keyboard->keymap, xkb_keymap_unref);
+      return;
+    }
+
+  keyboard->xkb_state = xkb_state_new (keyboard->keymap);
+
+  for (i = 0; i < G_N_ELEMENTS (lock_names); i++)
+    {
+      xkb_mod_index_t index = xkb_keymap_mod_get_index (keyboard->keymap, lock_names[i]);
+
+      if (index != XKB_MOD_INVALID)
+        keyboard->lock_mods |= 1 << index;
+    }
+}
+
+static void
+wakefield_pointer_init (struct WakefieldPointer *pointer)
+{
+  wl_list_init (&pointer->resource_list);
+  wl_list_init (&pointer->cursor_cache);
+  wl_list_init (&pointer->timestamps_list);
+  wl_list_init (&pointer->relative_list);
+  pointer->cursor_surface = NULL;
+  pointer->focus = NULL;
+}
+
+#define SEAT_VERSION 8
+
+static const struct wl_seat_interface seat_interface = {
+  seat_get_pointer,
+  seat_get_keyboard,
+  seat_get_touch,
+  resource_release,
+};
+
+static void
+bind_seat (struct wl_client *client,
+           void *data,
+           uint32_t version,
+           uint32_t id)
+{
+  struct WakefieldSeat *seat = data;
+  struct wl_resource *cr;
+  uint32_t capabilities = WL_SEAT_CAPABILITY_POINTER | WL_SEAT_CAPABILITY_TOUCH;
+
+  if (seat->keyboard.keymap_fd >= 0)
+    capabilities |= WL_SEAT_CAPABILITY_KEYBOARD;
+
+  cr = wl_resource_create (client, &wl_seat_interface, version, id);
+  wl_resource_set_implementation (cr, &seat_interface, seat, unbind_resource);
+  wl_seat_send_capabilities (cr, capabilities);
+  wl_seat_send_name (cr, "seat0");
+}
+
+static void
+wakefield_seat_init (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldSeat *seat = &priv->seat;
+
+  seat->compositor = compositor;
+  wakefield_pointer_init (&seat->pointer);
+  wakefield_keyboard_init (&seat->keyboard, gtk_widget_get_display (GTK_WIDGET (compositor)));
+  wakefield_touch_init (&seat->touch);
+
+  wl_global_create (priv->wl_display, &wl_seat_interface, SEAT_VERSION, seat, bind_seat);
+}
+
+static void
+wakefield_seat_finalize (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldKeyboard *keyboard = &priv->seat.keyboard;
+  struct WakefieldTouch *touch = &priv->seat.touch;
+
+  wl_array_release (&keyboard->keys);
+  wl_array_init (&keyboard->keys);
+  g_clear_pointer (&keyboard->xkb_state, xkb_state_unref);
+  g_clear_pointer (&keyboard->keymap, xkb_keymap_unref);
+  if (keyboard->keymap_fd >= 0)
+    {
+      close (keyboard->keymap_fd);
+      keyboard->keymap_fd = -1;
+    }
+
+  g_clear_pointer (&touch->points, g_array_unref);
+  g_clear_pointer (&touch->frame_clients, g_ptr_array_unref);
+}
+
+/* zwp_relative_pointer_manager_v1
+ *
+ * The accelerated motion comes from where GDK says the pointer is on
+ * the root window, so it stops at the edges of the screen unless the
+ * pointer is locked. The unaccelerated motion comes from XI_RawMotion
+ * on X11; elsewhere it's the same as the accelerated motion. */
+
+static const struct zwp_relative_pointer_v1_interface relative_pointer_interface = {
+  resource_release,
+};
+
+static void
+relative_pointer_manager_get_relative_pointer (struct wl_client   *client,
+                                               struct wl_resource *resource,
+                                               uint32_t            id,
+                                               struct wl_resource *pointer_resource)
+{
+  struct WakefieldSeat *seat = wl_resource_get_user_data (pointer_resource);
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &zwp_relative_pointer_v1_interface, wl_resource_get_version (resource), id);
+  wl_resource_set_implementation (cr, &relative_pointer_interface, pointer_resource, unbind_resource);
+  wl_list_insert (&seat->pointer.relative_list, wl_resource_get_link (cr));
+}
+
+static const struct zwp_relative_pointer_manager_v1_interface relative_pointer_manager_interface = {
+  resource_release,
+  relative_pointer_manager_get_relative_pointer,
+};
+
+static void
+bind_relative_pointer_manager (struct wl_client *client,
+                               void *data,
+                               uint32_t version,
+                               uint32_t id)
+{
+  WakefieldCompositor *compositor = data;
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &zwp_relative_pointer_manager_v1_interface, version, id);
+  wl_resource_set_implementation (cr, &relative_pointer_manager_interface, compositor, NULL);
+}
+
+#define ZWP_RELATIVE_POINTER_MANAGER_VERSION 1
+
+static void
+wakefield_relative_pointer_init (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  wl_global_create (priv->wl_display, &zwp_relative_pointer_manager_v1_interface,
+                    ZWP_RELATIVE_POINTER_MANAGER_VERSION, compositor, bind_relative_pointer_manager);
+}
+
+/* zwp_input_timestamps_manager_v1
+ *
+ * GDK only gives us millisecond event times, so that's all the
+ * timestamps have, but they're on the same clock as presentation
+ * times. */
+
+static const struct zwp_input_timestamps_v1_interface input_timestamps_interface = {
+  resource_release,
+};
+
+/* Makes a timestamps object for @input, which gets timestamps if
+ * @timestamps_list is where we look for them, and never otherwise. */
+static void
+create_input_timestamps (struct wl_client   *client,
+                         struct wl_resource *resource,
+                         uint32_t            id,
+                         struct wl_resource *input,
+                         struct wl_list     *timestamps_list)
+{
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &zwp_input_timestamps_v1_interface, wl_resource_get_version (resource), id);
+  wl_resource_set_implementation (cr, &input_timestamps_interface, input, unbind_resource);
+
+  if (timestamps_list)
+    wl_list_insert (timestamps_list, wl_resource_get_link (cr));
+  else
+    wl_list_init (wl_resource_get_link (cr));
+}
+
+static void
+input_timestamps_manager_get_keyboard_timestamps (struct wl_client   *client,
+                                                  struct wl_resource *resource,
+                                                  uint32_t            id,
+                                                  struct wl_resource *keyboard_resource)
+{
+  struct WakefieldSeat *seat = wl_resource_get_user_data (keyboard_resource);
+
+  create_input_timestamps (client, resource, id, keyboard_resource, &seat->keyboard.timestamps_list);
+}
+
+static void
+input_timestamps_manager_get_pointer_timestamps (struct wl_client   *client,
+                                                 struct wl_resource *resource,
+                                                 uint32_t            id,
+                                                 struct wl_resource *pointer_resource)
+{
+  struct WakefieldSeat *seat = wl_resource_get_user_data (pointer_resource);
+
+  create_input_timestamps (client, resource, id, pointer_resource, &seat->pointer.timestamps_list);
+}
+
+static void
+input_timestamps_manager_get_touch_timestamps (struct wl_client   *client,
+                                               struct wl_resource *resource,
+                                               uint32_t            id,
+                                               struct wl_resource *touch_resource)
+{
+  struct WakefieldSeat *seat = wl_resource_get_user_data (touch_resource);
+
+  create_input_timestamps (client, resource, id, touch_resource, &seat->touch.timestamps_list);
+}
+
+static const struct zwp_input_timestamps_manager_v1_interface input_timestamps_manager_interface = {
+  resource_release,
+  input_timestamps_manager_get_keyboard_timestamps,
+  input_timestamps_manager_get_pointer_timestamps,
+  input_timestamps_manager_get_touch_timestamps,
+};
+
+static void
+bind_input_timestamps_manager (struct wl_client *client,
+                               void *data,
+                               uint32_t version,
+                               uint32_t id)
+{
+  WakefieldCompositor *compositor = data;
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &zwp_input_timestamps_manager_v1_interface, version, id);
+  wl_resource_set_implementation (cr, &input_timestamps_manager_interface, compositor, NULL);
+}
+
+#define ZWP_INPUT_TIMESTAMPS_MANAGER_VERSION 1
+
+static void
+wakefield_input_timestamps_init (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
 
-  wl_global_create (wl_display, &wl_seat_interface, SEAT_VERSION, seat, bind_seat);
+  wl_global_create (priv->wl_display, &zwp_input_timestamps_manager_v1_interface,
+                    ZWP_INPUT_TIMESTAMPS_MANAGER_VERSION, compositor, bind_input_timestamps_manager);
 }
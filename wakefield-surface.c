@@ -20,7 +20,7 @@
  *     Jasper St. Pierre <jstpierre@mecheye.net>
  */
 
-#define COMPOSITOR_VERSION 3
+#define COMPOSITOR_VERSION 4
 
 struct WakefieldRegion
 {
@@ -82,6 +82,31 @@ wl_compositor_create_region (struct wl_client *client,
   region->region = cairo_region_create ();
 }
 
+static void
+surface_state_buffer_destroyed (struct wl_listener *listener,
+                                void               *data)
+{
+  struct WakefieldSurfacePendingState *state = wl_container_of (listener, state, buffer_destroy_listener);
+
+  state->buffer = NULL;
+}
+
+static void
+surface_state_set_buffer (struct WakefieldSurfacePendingState *state,
+                          struct WakefieldBuffer              *buffer)
+{
+  if (state->buffer == buffer)
+    return;
+
+  if (state->buffer)
+    wl_list_remove (&state->buffer_destroy_listener.link);
+
+  state->buffer = buffer;
+
+  if (state->buffer)
+    wl_signal_add (&state->buffer->destroy_signal, &state->buffer_destroy_listener);
+}
+
 static void
 wl_surface_attach (struct wl_client *client,
                    struct wl_resource *surface_resource,
@@ -89,9 +114,14 @@ wl_surface_attach (struct wl_client *client,
                    gint32 dx, gint32 dy)
 {
   struct WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+  struct WakefieldBuffer *buffer = NULL;
+
+  if (buffer_resource)
+    buffer = wakefield_buffer_from_resource (buffer_resource);
 
   /* Ignore dx/dy in our case */
-  surface->pending.buffer = buffer_resource;
+  surface_state_set_buffer (&surface->pending, buffer);
+  surface->pending.newly_attached = TRUE;
 }
 
 static void
@@ -101,7 +131,17 @@ wl_surface_damage (struct wl_client *client,
 {
   struct WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
   cairo_rectangle_int_t rectangle = { x, y, width, height };
-  cairo_region_union_rectangle (surface->damage, &rectangle);
+  cairo_region_union_rectangle (surface->pending.damage, &rectangle);
+}
+
+static void
+wl_surface_damage_buffer (struct wl_client *client,
+                          struct wl_resource *surface_resource,
+                          int32_t x, int32_t y, int32_t width, int32_t height)
+{
+  struct WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+  cairo_rectangle_int_t rectangle = { x, y, width, height };
+  cairo_region_union_rectangle (surface->pending.buffer_damage, &rectangle);
 }
 
 #define WL_CALLBACK_VERSION 1
@@ -124,7 +164,24 @@ wl_surface_set_opaque_region (struct wl_client *client,
                               struct wl_resource *surface_resource,
                               struct wl_resource *region_resource)
 {
-  /* XXX: Do we need this? */
+  struct WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+  g_clear_pointer (&surface->pending.opaque_region, cairo_region_destroy);
+  if (region_resource)
+    {
+      struct WakefieldRegion *region = wl_resource_get_user_data (region_resource);
+      surface->pending.opaque_region = cairo_region_copy (region->region);
+    }
+  else
+    surface->pending.opaque_region = cairo_region_create ();
+}
+
+/* Makes a region that covers the whole surface, however big. */
+static cairo_region_t *
+create_infinite_region (void)
+{
+  cairo_rectangle_int_t everything = { G_MININT / 2, G_MININT / 2, G_MAXINT, G_MAXINT };
+
+  return cairo_region_create_rectangle (&everything);
 }
 
 static void
@@ -139,40 +196,761 @@ wl_surface_set_input_region (struct wl_client *client,
       struct WakefieldRegion *region = wl_resource_get_user_data (region_resource);
       surface->pending.input_region = cairo_region_copy (region->region);
     }
+  else
+    surface->pending.input_region = create_infinite_region ();
+}
+
+/* Makes a copy of @image we can change without touching it. */
+static cairo_surface_t *
+copy_image (cairo_surface_t *image)
+{
+  int height = cairo_image_surface_get_height (image);
+  cairo_surface_t *copy;
+
+  copy = cairo_image_surface_create (cairo_image_surface_get_format (image),
+                                     cairo_image_surface_get_width (image), height);
+
+  cairo_surface_flush (image);
+  cairo_surface_flush (copy);
+  memcpy (cairo_image_surface_get_data (copy), cairo_image_surface_get_data (image),
+          cairo_image_surface_get_stride (image) * height);
+  cairo_surface_mark_dirty (copy);
+
+  return copy;
 }
 
 static void
-wl_surface_commit (struct wl_client *client,
-                   struct wl_resource *resource)
+clear_spare_backings (struct WakefieldSurface *surface)
 {
-  struct WakefieldSurface *surface = wl_resource_get_user_data (resource);
+  guint i;
+
+  for (i = 0; i < N_SPARE_BACKINGS; i++)
+    {
+      g_clear_pointer (&surface->spare_backing[i], cairo_surface_destroy);
+      g_clear_pointer (&surface->spare_damage[i], cairo_region_destroy);
+    }
+}
+
+static void
+clear_backing (struct WakefieldSurface *surface)
+{
+  g_clear_pointer (&surface->backing, cairo_surface_destroy);
+  clear_spare_backings (surface);
+}
+
+/* Notes that the spare backing stores, other than the one in @skip,
+ * if any, missed @damage. */
+static void
+add_spare_damage (struct WakefieldSurface *surface,
+                  cairo_region_t          *damage,
+                  int                      skip)
+{
+  int i;
+
+  for (i = 0; i < N_SPARE_BACKINGS; i++)
+    {
+      if (i != skip && surface->spare_backing[i])
+        cairo_region_union (surface->spare_damage[i], damage);
+    }
+}
+
+/* Copies @region of @src into @dst, which has the same layout. */
+static void
+copy_backing_region (cairo_surface_t *dst,
+                     cairo_surface_t *src,
+                     cairo_region_t  *region)
+{
+  cairo_t *cr = cairo_create (dst);
+
+  gdk_cairo_region (cr, region);
+  cairo_clip (cr);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface (cr, src, 0, 0);
+  cairo_paint (cr);
+  cairo_destroy (cr);
+}
+
+/* Sets aside the backing store, which a scene is still showing, and
+ * carries on in a spare one no scene holds anymore, bringing it up to
+ * date with what it missed apart from @damage, which is about to be
+ * written anyway. Only if there's no such spare do we copy all of
+ * it. */
+static void
+swap_backing (struct WakefieldSurface *surface,
+              cairo_region_t          *damage)
+{
+  cairo_surface_t *backing = NULL;
+  int slot = -1;
+  int i;
 
-  if (surface->pending.buffer)
-    surface->current.buffer = surface->pending.buffer;
+  for (i = 0; i < N_SPARE_BACKINGS; i++)
+    {
+      if (surface->spare_backing[i] &&
+          cairo_surface_get_reference_count (surface->spare_backing[i]) == 1)
+        {
+          backing = surface->spare_backing[i];
+          cairo_region_subtract (surface->spare_damage[i], damage);
+          copy_backing_region (backing, surface->backing, surface->spare_damage[i]);
+          cairo_region_destroy (surface->spare_damage[i]);
+
+          surface->spare_backing[i] = NULL;
+          surface->spare_damage[i] = NULL;
+          slot = i;
+          break;
+        }
+    }
+
+  if (!backing)
+    {
+      backing = copy_image (surface->backing);
+
+      for (i = 0; i < N_SPARE_BACKINGS; i++)
+        {
+          if (!surface->spare_backing[i])
+            {
+              slot = i;
+              break;
+            }
+        }
+    }
+
+  add_spare_damage (surface, damage, slot);
+
+  /* With every spare still shown, the old one just goes once the
+   * scenes are done with it. */
+  if (slot >= 0)
+    {
+      surface->spare_backing[slot] = surface->backing;
+      surface->spare_damage[slot] = cairo_region_copy (damage);
+    }
+  else
+    cairo_surface_destroy (surface->backing);
+
+  surface->backing = backing;
+}
+
+/* Copies @damage, in content pixels, out of the buffer into our
+ * backing store, converting it to a format cairo understands and
+ * applying the buffer transform, or all of it if the backing store
+ * doesn't match the buffer anymore. */
+static void
+snapshot_buffer (struct WakefieldSurface *surface,
+                 struct WakefieldBuffer  *buffer,
+                 cairo_region_t          *damage)
+{
+  struct wl_shm_buffer *shm_buffer;
+  cairo_format_t format = buffer->format->cairo_format;
+  enum wl_output_transform transform = surface->current.transform;
+  cairo_rectangle_int_t backing_rect = { 0, 0, buffer->width, buffer->height };
+  cairo_region_t *region;
+  uint8_t *src, *dst;
+  int dst_stride;
+  int i;
+
+  shm_buffer = wl_shm_buffer_get (buffer->resource);
+  if (!shm_buffer)
+    g_assert_not_reached ();
+
+  wakefield_transform_rect (transform, buffer->width, buffer->height, &backing_rect);
+
+  if (surface->backing &&
+      (cairo_image_surface_get_format (surface->backing) != format ||
+       cairo_image_surface_get_width (surface->backing) != backing_rect.width ||
+       cairo_image_surface_get_height (surface->backing) != backing_rect.height))
+    clear_backing (surface);
+
+  if (!surface->backing)
+    {
+      surface->backing = cairo_image_surface_create (format, backing_rect.width, backing_rect.height);
+      region = cairo_region_create_rectangle (&backing_rect);
+    }
+  else
+    {
+      region = cairo_region_copy (damage);
+      cairo_region_intersect_rectangle (region, &backing_rect);
+
+      /* In threaded mode, GTK might still be showing the backing store
+       * from a scene, so leave it be and carry on in a spare one. */
+      if (cairo_surface_get_reference_count (surface->backing) > 1)
+        swap_backing (surface, region);
+      else
+        add_spare_damage (surface, region, -1);
+    }
+
+  cairo_surface_flush (surface->backing);
+  dst = cairo_image_surface_get_data (surface->backing);
+  dst_stride = cairo_image_surface_get_stride (surface->backing);
+
+  wl_shm_buffer_begin_access (shm_buffer);
+  src = wl_shm_buffer_get_data (shm_buffer);
+
+  for (i = 0; i < cairo_region_num_rectangles (region); i++)
+    {
+      cairo_rectangle_int_t rect, buffer_rect;
+
+      cairo_region_get_rectangle (region, i, &rect);
+
+      buffer_rect = rect;
+      wakefield_transform_rect (wakefield_transform_invert (transform),
+                                backing_rect.width, backing_rect.height, &buffer_rect);
+
+      wakefield_transform_copy_rect (buffer->format, transform, dst, dst_stride,
+                                     src, buffer->stride, buffer->width, buffer->height,
+                                     &buffer_rect);
+      cairo_surface_mark_dirty_rectangle (surface->backing, rect.x, rect.y, rect.width, rect.height);
+    }
+
+  wl_shm_buffer_end_access (shm_buffer);
+
+  cairo_region_destroy (region);
+}
+
+/* Formats cairo can't paint and transformed buffers have to go
+ * through the backing store, so they get converted once on commit
+ * rather than on every draw. In threaded mode, GTK can't paint from
+ * buffers the dispatch thread might release at any time, so they all
+ * do. */
+static gboolean
+needs_backing (struct WakefieldSurface *surface,
+               struct WakefieldBuffer  *buffer)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (surface->compositor);
+
+  return priv->threaded ||
+         priv->copy_on_commit ||
+         buffer->format->conversion != WAKEFIELD_CONVERSION_NONE ||
+         surface->current.transform != WL_OUTPUT_TRANSFORM_NORMAL;
+}
+
+static void
+unset_viewport (struct WakefieldSurfacePendingState *state)
+{
+  state->src_x = state->src_y = state->src_width = state->src_height = -1;
+  state->dst_width = state->dst_height = -1;
+}
+
+/* Checks the wp_viewport state about to be committed against the
+ * buffer it will apply to, raising a protocol error if it doesn't
+ * fit. */
+static gboolean
+check_viewport (struct WakefieldSurface             *surface,
+                struct WakefieldSurfacePendingState *state)
+{
+  int scale = state->scale > 0 ? state->scale : surface->current.scale;
+  int width, height;
+
+  if (!surface->viewport || state->src_width < 0)
+    return TRUE;
+
+  if (state->dst_width < 0 &&
+      (state->src_width != floor (state->src_width) ||
+       state->src_height != floor (state->src_height)))
+    {
+      wl_resource_post_error (surface->viewport, WP_VIEWPORT_ERROR_BAD_SIZE,
+                              "source size %fx%f isn't a whole number of pixels",
+                              state->src_width, state->src_height);
+      return FALSE;
+    }
+
+  if (state->newly_attached)
+    {
+      int transform = state->transform >= 0 ? state->transform : surface->current.transform;
+
+      if (!state->buffer)
+        return TRUE;
+
+      width = wakefield_transform_swaps_axes (transform) ? state->buffer->height : state->buffer->width;
+      height = wakefield_transform_swaps_axes (transform) ? state->buffer->width : state->buffer->height;
+    }
+  else if (!get_content_size (surface, &width, &height))
+    return TRUE;
+
+  if (state->src_x + state->src_width > (double) width / scale ||
+      state->src_y + state->src_height > (double) height / scale)
+    {
+      wl_resource_post_error (surface->viewport, WP_VIEWPORT_ERROR_OUT_OF_BUFFER,
+                              "source rectangle extends outside of the buffer");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Works out the pending damage in pixels of the contents this commit
+ * shows. Damage in surface coordinates gets rounded out through the
+ * scale and viewport; damage in buffer coordinates only needs the
+ * buffer transform applied, so it stays exact. */
+static cairo_region_t *
+get_pending_content_damage (struct WakefieldSurface             *surface,
+                            struct WakefieldSurfacePendingState *state)
+{
+  enum wl_output_transform transform = surface->current.transform;
+  cairo_rectangle_int_t content_rect = { 0, 0, 0, 0 };
+  int buffer_width, buffer_height;
+  cairo_region_t *region;
+  int i;
+
+  if (state->newly_attached)
+    {
+      if (!state->buffer)
+        return cairo_region_create ();
+
+      buffer_width = state->buffer->width;
+      buffer_height = state->buffer->height;
+      content_rect.width = wakefield_transform_swaps_axes (transform) ? buffer_height : buffer_width;
+      content_rect.height = wakefield_transform_swaps_axes (transform) ? buffer_width : buffer_height;
+    }
+  else if (get_content_size (surface, &content_rect.width, &content_rect.height))
+    {
+      buffer_width = wakefield_transform_swaps_axes (transform) ? content_rect.height : content_rect.width;
+      buffer_height = wakefield_transform_swaps_axes (transform) ? content_rect.width : content_rect.height;
+    }
+  else
+    return cairo_region_create ();
+
+  region = surface_region_to_content (surface, state->damage,
+                                      content_rect.width, content_rect.height);
+
+  for (i = 0; i < cairo_region_num_rectangles (state->buffer_damage); i++)
+    {
+      cairo_rectangle_int_t rect;
+
+      cairo_region_get_rectangle (state->buffer_damage, i, &rect);
+      wakefield_transform_rect (transform, buffer_width, buffer_height, &rect);
+      cairo_region_union_rectangle (region, &rect);
+    }
+
+  cairo_region_intersect_rectangle (region, &content_rect);
+  return region;
+}
+
+static void
+destroy_pending_state (struct WakefieldSurfacePendingState *state)
+{
+  struct wl_resource *cr, *tmp;
+
+  wl_resource_for_each_safe (cr, tmp, &state->frame_callbacks)
+    wl_resource_destroy (cr);
+
+  surface_state_set_buffer (state, NULL);
+  discard_feedback_list (&state->feedback_list);
+  g_clear_pointer (&state->damage, cairo_region_destroy);
+  g_clear_pointer (&state->buffer_damage, cairo_region_destroy);
+  g_clear_pointer (&state->opaque_region, cairo_region_destroy);
+  g_clear_pointer (&state->input_region, cairo_region_destroy);
+}
+
+/* A subsurface is synchronized if it or any of its ancestors asked to
+ * be. */
+static gboolean
+subsurface_is_synchronized (struct WakefieldSubsurface *sub)
+{
+  while (sub)
+    {
+      if (sub->synchronized)
+        return TRUE;
+
+      sub = sub->parent ? sub->parent->subsurface : NULL;
+    }
+
+  return FALSE;
+}
+
+/* Takes a subsurface out of its parent's stacking order, which hides
+ * it until it's destroyed. */
+static void
+subsurface_unlink (struct WakefieldSubsurface *sub)
+{
+  if (!sub->parent)
+    return;
+
+  damage_tree (sub->surface);
+
+  wl_list_remove (&sub->parent_link);
+  wl_list_remove (&sub->parent_link_pending);
+  sub->parent = NULL;
+}
+
+static void
+subsurface_destroy (struct WakefieldSubsurface *sub)
+{
+  subsurface_unlink (sub);
+  destroy_pending_state (&sub->cached);
+
+  sub->surface->subsurface = NULL;
+  wl_resource_set_user_data (sub->resource, NULL);
+  g_slice_free (struct WakefieldSubsurface, sub);
+}
+
+/* Folds what the client just committed into what a synchronized
+ * subsurface already has cached for its parent's next commit. */
+static void
+commit_to_cache (struct WakefieldSubsurface *sub)
+{
+  struct WakefieldSurface *surface = sub->surface;
+  struct WakefieldSurfacePendingState *pending = &surface->pending;
+  struct WakefieldSurfacePendingState *cached = &sub->cached;
+
+  cairo_region_union (cached->damage, pending->damage);
+  cairo_region_union (cached->buffer_damage, pending->buffer_damage);
+  {
+    cairo_rectangle_int_t nothing = { 0, 0, 0, 0 };
+    cairo_region_intersect_rectangle (pending->damage, &nothing);
+    cairo_region_intersect_rectangle (pending->buffer_damage, &nothing);
+  }
+
+  if (pending->newly_attached)
+    {
+      /* Like one replaced before we got to paint it, a buffer replaced
+       * before it even got applied goes right back. */
+      if (cached->newly_attached && cached->buffer &&
+          cached->buffer != pending->buffer &&
+          cached->buffer != surface->current.buffer)
+        {
+          cached->buffer->busy = TRUE;
+          wakefield_buffer_release (cached->buffer);
+        }
+
+      surface_state_set_buffer (cached, pending->buffer);
+      cached->newly_attached = TRUE;
+      surface_state_set_buffer (pending, NULL);
+      pending->newly_attached = FALSE;
+    }
+
+  if (pending->scale > 0)
+    cached->scale = pending->scale;
+  pending->scale = 0;
+
+  if (pending->transform >= 0)
+    cached->transform = pending->transform;
+  pending->transform = -1;
+
+  if (pending->opaque_region)
+    {
+      g_clear_pointer (&cached->opaque_region, cairo_region_destroy);
+      cached->opaque_region = pending->opaque_region;
+      pending->opaque_region = NULL;
+    }
+
+  if (pending->input_region)
+    {
+      g_clear_pointer (&cached->input_region, cairo_region_destroy);
+      cached->input_region = pending->input_region;
+      pending->input_region = NULL;
+    }
+
+  cached->src_x = pending->src_x;
+  cached->src_y = pending->src_y;
+  cached->src_width = pending->src_width;
+  cached->src_height = pending->src_height;
+  cached->dst_width = pending->dst_width;
+  cached->dst_height = pending->dst_height;
+
+  wl_list_insert_list (&cached->frame_callbacks, &pending->frame_callbacks);
+  wl_list_init (&pending->frame_callbacks);
+
+  discard_feedback_list (&cached->feedback_list);
+  wl_list_insert_list (&cached->feedback_list, &pending->feedback_list);
+  wl_list_init (&pending->feedback_list);
+
+  sub->has_cache = TRUE;
+}
+
+static void commit_state (struct WakefieldSurface             *surface,
+                          struct WakefieldSurfacePendingState *state);
+
+/* Marks everything the surface shows as damaged. */
+static void
+damage_contents (struct WakefieldSurface *surface)
+{
+  cairo_rectangle_int_t rect = { 0, 0, 0, 0 };
+
+  if (get_surface_size (surface, &rect.width, &rect.height))
+    cairo_region_union_rectangle (surface->current.damage, &rect);
+  if (get_content_size (surface, &rect.width, &rect.height))
+    cairo_region_union_rectangle (surface->current.buffer_damage, &rect);
+
+  schedule_draw (surface->compositor);
+}
+
+/* Applies what the client asked of a surface's subsurfaces, which
+ * takes effect on its commit: their stacking order, their positions,
+ * and whatever the synchronized ones cached. Returns TRUE if they
+ * moved around. */
+static gboolean
+commit_subsurfaces (struct WakefieldSurface *surface)
+{
+  struct WakefieldSubsurface *sub;
+  gboolean rearranged = surface->restacked;
+
+  if (surface->restacked)
+    {
+      wl_list_for_each (sub, &surface->subsurfaces_pending, parent_link_pending)
+        {
+          wl_list_remove (&sub->parent_link);
+          wl_list_insert (surface->subsurfaces.prev, &sub->parent_link);
+        }
+
+      surface->restacked = FALSE;
+    }
+
+  wl_list_for_each (sub, &surface->subsurfaces, parent_link)
+    {
+      if (sub->surface == surface)
+        continue;
+
+      if (sub->has_pending_position)
+        {
+          if (sub->x != sub->pending_x || sub->y != sub->pending_y)
+            rearranged = TRUE;
+
+          sub->x = sub->pending_x;
+          sub->y = sub->pending_y;
+          sub->has_pending_position = FALSE;
+        }
+
+      if (sub->has_cache && subsurface_is_synchronized (sub))
+        {
+          sub->has_cache = FALSE;
+          commit_state (sub->surface, &sub->cached);
+        }
+    }
+
+  return rearranged;
+}
+
+/* Makes @state, either what the client just committed or what a
+ * synchronized subsurface cached, the current one. */
+static void
+commit_state (struct WakefieldSurface             *surface,
+              struct WakefieldSurfacePendingState *state)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (surface->compositor);
+  gboolean threaded = on_dispatch_thread (surface->compositor);
+  cairo_rectangle_int_t old_rect, new_rect;
+  gboolean was_shown = FALSE, is_shown;
+  cairo_region_t *old_extents = NULL;
+  gboolean redo_backing = FALSE;
+  gboolean redraw = FALSE;
+  cairo_region_t *damage;
+
+  if (!check_viewport (surface, state))
+    return;
+
+  /* Note where we were, in case we change size or go away. In
+   * threaded mode, GTK works that out from the scenes instead. */
+  if (!threaded)
+    {
+      was_shown = get_content_rect (surface, &old_rect);
+      old_extents = cairo_region_create ();
+      add_tree_extents (surface, old_extents);
+    }
 
   /* XXX: Should we reallocate / redraw the entire region if the buffer
    * scale changes? */
-  if (surface->pending.scale > 0)
-    surface->current.scale = surface->pending.scale;
+  if (state->scale > 0)
+    surface->current.scale = state->scale;
 
-  wl_list_insert_list (&surface->current.frame_callbacks,
-                       &surface->pending.frame_callbacks);
-  wl_list_init (&surface->pending.frame_callbacks);
+  if (state->transform >= 0 &&
+      state->transform != surface->current.transform)
+    {
+      surface->current.transform = state->transform;
+      redo_backing = TRUE;
+    }
+
+  if (state->src_x != surface->current.src_x ||
+      state->src_y != surface->current.src_y ||
+      state->src_width != surface->current.src_width ||
+      state->src_height != surface->current.src_height ||
+      state->dst_width != surface->current.dst_width ||
+      state->dst_height != surface->current.dst_height)
+    {
+      surface->current.src_x = state->src_x;
+      surface->current.src_y = state->src_y;
+      surface->current.src_width = state->src_width;
+      surface->current.src_height = state->src_height;
+      surface->current.dst_width = state->dst_width;
+      surface->current.dst_height = state->dst_height;
+      redo_backing = TRUE;
+    }
+
+  if (redo_backing)
+    {
+      /* Our backing store is laid out for the old transform, and only
+       * has what we showed of the old source rectangle, so redo it
+       * from scratch, out of the buffer we still hold if the client
+       * didn't attach a new one. One the client already got back
+       * might have half a new frame in it, so then we keep showing
+       * what we have until it attaches another. */
+      if (state->newly_attached)
+        clear_backing (surface);
+      else if (surface->current.buffer && surface->current.buffer->busy &&
+               needs_backing (surface, surface->current.buffer))
+        {
+          clear_backing (surface);
+          surface_state_set_buffer (state, surface->current.buffer);
+          state->newly_attached = TRUE;
+        }
+      else if (surface->backing)
+        surface->backing_outdated = TRUE;
+
+      g_clear_pointer (&surface->scaled, cairo_surface_destroy);
+      redraw = TRUE;
+    }
 
-  /* process damage */
-  gtk_widget_queue_draw_region (GTK_WIDGET (surface->compositor), surface->damage);
+  if (state->newly_attached && surface->backing_outdated)
+    {
+      clear_backing (surface);
+      surface->backing_outdated = FALSE;
+    }
+
+  damage = get_pending_content_damage (surface, state);
+
+  if (state->newly_attached)
+    {
+      struct WakefieldBuffer *buffer = state->buffer;
+
+      if (buffer && needs_backing (surface, buffer))
+        {
+          snapshot_buffer (surface, buffer, damage);
+
+          /* We're done with it already. This also covers the buffer
+           * being the current one we only redid the backing store
+           * from, which mustn't get released twice below. */
+          buffer->busy = TRUE;
+          wakefield_buffer_release (buffer);
+          buffer = NULL;
+        }
+      else
+        clear_backing (surface);
+
+      if (buffer)
+        {
+          /* The client might have drawn new contents into a buffer we
+           * already wrapped, so drop any snapshots cairo took of it. */
+          if (buffer->cr_surface)
+            cairo_surface_mark_dirty (buffer->cr_surface);
+
+          buffer->busy = TRUE;
+        }
+
+      /* A buffer that gets replaced before we got to paint it never
+       * will be, so hand it back right away rather than starving the
+       * client. Its damage is still in current.damage, so the next
+       * paint covers it. */
+      if (surface->current.buffer && surface->current.buffer != buffer)
+        wakefield_buffer_release (surface->current.buffer);
+
+      surface_state_set_buffer (&surface->current, buffer);
+    }
+
+  if (!wl_list_empty (&state->frame_callbacks))
+    {
+      wl_list_insert_list (&surface->current.frame_callbacks,
+                           &state->frame_callbacks);
+      wl_list_init (&state->frame_callbacks);
+      schedule_frame (surface->compositor);
+    }
+
+  /* This commit supersedes whatever we hadn't painted yet. */
+  discard_feedback_list (&surface->current.feedback_list);
+  if (!wl_list_empty (&state->feedback_list))
+    {
+      wl_list_insert_list (&surface->current.feedback_list,
+                           &state->feedback_list);
+      wl_list_init (&state->feedback_list);
+      schedule_frame (surface->compositor);
+    }
+
+  /* process damage, keeping track of what hasn't been painted yet,
+   * both in surface coordinates and exactly in content pixels */
+  if (!cairo_region_is_empty (damage))
+    {
+      int content_width, content_height;
+
+      if (get_content_size (surface, &content_width, &content_height))
+        {
+          cairo_region_t *surface_damage;
+
+          surface_damage = content_region_to_surface (surface, damage, content_width, content_height);
+          cairo_region_union (surface->current.damage, surface_damage);
+          cairo_region_destroy (surface_damage);
+        }
+
+      cairo_region_union (surface->current.damage, state->damage);
+      cairo_region_union (surface->current.buffer_damage, damage);
+      schedule_draw (surface->compositor);
+    }
+  cairo_region_destroy (damage);
 
   /* ... and then empty it */
   {
     cairo_rectangle_int_t nothing = { 0, 0, 0, 0 };
-    cairo_region_intersect_rectangle (surface->damage, &nothing);
+    cairo_region_intersect_rectangle (state->damage, &nothing);
+    cairo_region_intersect_rectangle (state->buffer_damage, &nothing);
   }
 
-  /* XXX: Stop leak when we start using the input region. */
-  surface->pending.input_region = NULL;
+  if (state->opaque_region)
+    {
+      cairo_region_destroy (surface->current.opaque_region);
+      surface->current.opaque_region = state->opaque_region;
+      state->opaque_region = NULL;
+    }
+
+  if (state->input_region)
+    {
+      cairo_region_destroy (surface->current.input_region);
+      surface->current.input_region = state->input_region;
+      state->input_region = NULL;
+    }
+
+  surface_state_set_buffer (state, NULL);
+  state->newly_attached = FALSE;
+  state->scale = 0;
+  state->transform = -1;
+
+  if (commit_subsurfaces (surface))
+    redraw = TRUE;
 
-  surface->pending.buffer = NULL;
-  surface->pending.scale = 0;
+  if (threaded)
+    {
+      /* Contents redone from scratch still need damage of their own. */
+      if (redo_backing)
+        damage_contents (surface);
+    }
+  else
+    {
+      /* Anything that moved, showed up or went away, including by
+       * attaching NULL, needs repainting where it was and where it
+       * is. */
+      is_shown = get_content_rect (surface, &new_rect);
+      if (redraw || was_shown != is_shown ||
+          (is_shown && memcmp (&old_rect, &new_rect, sizeof (new_rect)) != 0))
+        {
+          add_tree_extents (surface, old_extents);
+          damage_region (surface->compositor, old_extents);
+        }
+      cairo_region_destroy (old_extents);
+    }
+
+  if (surface == priv->seat.pointer.cursor_surface)
+    update_cursor (surface->compositor);
+
+  commit_constraint (surface);
+}
+
+static void
+wl_surface_commit (struct wl_client *client,
+                   struct wl_resource *resource)
+{
+  struct WakefieldSurface *surface = wl_resource_get_user_data (resource);
+
+  /* A synchronized subsurface's state only gets applied along with
+   * its parent's. */
+  if (surface->subsurface && subsurface_is_synchronized (surface->subsurface))
+    commit_to_cache (surface->subsurface);
+  else
+    commit_state (surface, &surface->pending);
 }
 
 static void
@@ -180,7 +958,16 @@ wl_surface_set_buffer_transform (struct wl_client *client,
                                  struct wl_resource *resource,
                                  int32_t transform)
 {
-  /* TODO */
+  struct WakefieldSurface *surface = wl_resource_get_user_data (resource);
+
+  if (!wakefield_transform_is_valid (transform))
+    {
+      wl_resource_post_error (resource, WL_SURFACE_ERROR_INVALID_TRANSFORM,
+                              "buffer transform %d is invalid", transform);
+      return;
+    }
+
+  surface->pending.transform = transform;
 }
 
 static void
@@ -192,26 +979,66 @@ wl_surface_set_buffer_scale (struct wl_client *client,
   surface->pending.scale = scale;
 }
 
-static void
-destroy_pending_state (struct WakefieldSurfacePendingState *state)
-{
-  g_clear_pointer (&state->input_region, cairo_region_destroy);
-}
-
 static void
 wl_surface_destructor (struct wl_resource *resource)
 {
   struct WakefieldSurface *surface = wl_resource_get_user_data (resource);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (surface->compositor);
+  struct WakefieldSubsurface *sub, *tmp;
+  guint i;
+
+  damage_tree (surface);
+
+  if (surface->subsurface)
+    subsurface_destroy (surface->subsurface);
+
+  /* Our subsurfaces stay around, but aren't shown anymore. */
+  wl_list_for_each_safe (sub, tmp, &surface->subsurfaces, parent_link)
+    {
+      if (sub != &surface->self)
+        subsurface_unlink (sub);
+    }
 
   destroy_pending_state (&surface->pending);
   destroy_pending_state (&surface->current);
+  clear_backing (surface);
+  g_clear_pointer (&surface->scaled, cairo_surface_destroy);
+  g_clear_pointer (&surface->scaled_damage, cairo_region_destroy);
 
-  /* XXX */
-  {
-    WakefieldCompositor *compositor = surface->compositor;
-    WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-    priv->surface = NULL;
-  }
+  if (surface->viewport)
+    wl_resource_set_user_data (surface->viewport, NULL);
+
+  detach_constraint (surface);
+
+  if (priv->seat.pointer.focus == surface)
+    priv->seat.pointer.focus = NULL;
+
+  if (priv->seat.keyboard.focus == surface)
+    priv->seat.keyboard.focus = NULL;
+
+  for (i = 0; i < priv->seat.touch.points->len; i++)
+    {
+      struct WakefieldTouchPoint *point = &g_array_index (priv->seat.touch.points, struct WakefieldTouchPoint, i);
+
+      if (point->surface == surface)
+        point->surface = NULL;
+    }
+
+  if (priv->seat.pointer.cursor_surface == surface)
+    {
+      priv->seat.pointer.cursor_surface = NULL;
+      update_cursor (surface->compositor);
+    }
+
+  if (priv->surface == surface)
+    {
+      priv->surface = NULL;
+      update_keyboard_focus (surface->compositor);
+    }
+
+  g_hash_table_remove (priv->surface_ids, GUINT_TO_POINTER (surface->id));
+  wl_list_remove (&surface->link);
+  g_slice_free (struct WakefieldSurface, surface);
 }
 
 static const struct wl_surface_interface surface_interface = {
@@ -223,9 +1050,21 @@ static const struct wl_surface_interface surface_interface = {
   wl_surface_set_input_region,
   wl_surface_commit,
   wl_surface_set_buffer_transform,
-  wl_surface_set_buffer_scale
+  wl_surface_set_buffer_scale,
+  wl_surface_damage_buffer
 };
 
+/* Finds the surface a message from the GTK side is about, or returns
+ * NULL if it went away in the meantime. */
+static struct WakefieldSurface *
+lookup_surface (WakefieldCompositor *compositor,
+                guint32              id)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return g_hash_table_lookup (priv->surface_ids, GUINT_TO_POINTER (id));
+}
+
 static void
 wl_compositor_create_surface (struct wl_client *client,
                               struct wl_resource *compositor_resource,
@@ -235,26 +1074,52 @@ wl_compositor_create_surface (struct wl_client *client,
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct WakefieldSurface *surface;
 
-  /* XXX: For now, treat the first surface created as the proper
-   * preview surface and leak all the rest until we get a
-   * special Wakefield extension... */
-
-  if (priv->surface)
-    return;
-
   surface = g_slice_new0 (struct WakefieldSurface);
   surface->compositor = compositor;
-  surface->damage = cairo_region_create ();
+  surface->id = ++priv->next_surface_id;
+  g_hash_table_insert (priv->surface_ids, GUINT_TO_POINTER (surface->id), surface);
 
   surface->resource = wl_resource_create (client, &wl_surface_interface, wl_resource_get_version (compositor_resource), id);
   wl_resource_set_implementation (surface->resource, &surface_interface, surface, wl_surface_destructor);
 
   wl_list_init (&surface->pending.frame_callbacks);
   wl_list_init (&surface->current.frame_callbacks);
+  wl_list_init (&surface->pending.feedback_list);
+  wl_list_init (&surface->current.feedback_list);
+
+  surface->pending.buffer_destroy_listener.notify = surface_state_buffer_destroyed;
+  surface->current.buffer_destroy_listener.notify = surface_state_buffer_destroyed;
+
+  surface->pending.damage = cairo_region_create ();
+  surface->current.damage = cairo_region_create ();
+  surface->pending.buffer_damage = cairo_region_create ();
+  surface->current.buffer_damage = cairo_region_create ();
+  surface->current.opaque_region = cairo_region_create ();
+  surface->current.input_region = create_infinite_region ();
 
   surface->current.scale = 1;
+  surface->pending.transform = -1;
+  surface->current.transform = WL_OUTPUT_TRANSFORM_NORMAL;
+
+  unset_viewport (&surface->pending);
+  unset_viewport (&surface->current);
+
+  wl_list_init (&surface->subsurfaces);
+  wl_list_init (&surface->subsurfaces_pending);
+  surface->self.surface = surface;
+  wl_list_insert (&surface->subsurfaces, &surface->self.parent_link);
+  wl_list_insert (&surface->subsurfaces_pending, &surface->self.parent_link_pending);
+
+  wl_list_insert (priv->surfaces.prev, &surface->link);
 
-  priv->surface = surface;
+  /* XXX: For now, treat the first surface created as the proper
+   * preview surface, with the rest only shown as its subsurfaces,
+   * until we get a special Wakefield extension... */
+  if (!priv->surface)
+    {
+      priv->surface = surface;
+      update_keyboard_focus (compositor);
+    }
 }
 
 const static struct wl_compositor_interface compositor_interface = {
@@ -281,3 +1146,374 @@ wakefield_surface_init (WakefieldCompositor *compositor)
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   wl_global_create (priv->wl_display, &wl_compositor_interface, COMPOSITOR_VERSION, compositor, bind_compositor);
 }
+
+/* wp_viewporter lets clients crop and scale their buffers, so that
+ * e.g. a video player can hand us frames at a lower resolution than
+ * they're shown at. */
+
+static void
+wp_viewport_destructor (struct wl_resource *resource)
+{
+  struct WakefieldSurface *surface = wl_resource_get_user_data (resource);
+
+  if (!surface)
+    return;
+
+  /* Like the rest of the state, this only goes away on the next
+   * commit. */
+  surface->viewport = NULL;
+  unset_viewport (&surface->pending);
+}
+
+static void
+wp_viewport_set_source (struct wl_client *client,
+                        struct wl_resource *resource,
+                        wl_fixed_t x,
+                        wl_fixed_t y,
+                        wl_fixed_t width,
+                        wl_fixed_t height)
+{
+  struct WakefieldSurface *surface = wl_resource_get_user_data (resource);
+
+  if (!surface)
+    {
+      wl_resource_post_error (resource, WP_VIEWPORT_ERROR_NO_SURFACE,
+                              "wl_surface for this viewport no longer exists");
+      return;
+    }
+
+  if (x == wl_fixed_from_int (-1) && y == wl_fixed_from_int (-1) &&
+      width == wl_fixed_from_int (-1) && height == wl_fixed_from_int (-1))
+    {
+      surface->pending.src_x = surface->pending.src_y = -1;
+      surface->pending.src_width = surface->pending.src_height = -1;
+      return;
+    }
+
+  if (x < 0 || y < 0 || width <= 0 || height <= 0)
+    {
+      wl_resource_post_error (resource, WP_VIEWPORT_ERROR_BAD_VALUE,
+                              "invalid source rectangle");
+      return;
+    }
+
+  surface->pending.src_x = wl_fixed_to_double (x);
+  surface->pending.src_y = wl_fixed_to_double (y);
+  surface->pending.src_width = wl_fixed_to_double (width);
+  surface->pending.src_height = wl_fixed_to_double (height);
+}
+
+static void
+wp_viewport_set_destination (struct wl_client *client,
+                             struct wl_resource *resource,
+                             int32_t width,
+                             int32_t height)
+{
+  struct WakefieldSurface *surface = wl_resource_get_user_data (resource);
+
+  if (!surface)
+    {
+      wl_resource_post_error (resource, WP_VIEWPORT_ERROR_NO_SURFACE,
+                              "wl_surface for this viewport no longer exists");
+      return;
+    }
+
+  if (width == -1 && height == -1)
+    {
+      surface->pending.dst_width = surface->pending.dst_height = -1;
+      return;
+    }
+
+  if (width <= 0 || height <= 0)
+    {
+      wl_resource_post_error (resource, WP_VIEWPORT_ERROR_BAD_VALUE,
+                              "invalid destination size");
+      return;
+    }
+
+  surface->pending.dst_width = width;
+  surface->pending.dst_height = height;
+}
+
+static const struct wp_viewport_interface viewport_interface = {
+  resource_release,
+  wp_viewport_set_source,
+  wp_viewport_set_destination,
+};
+
+static void
+wp_viewporter_get_viewport (struct wl_client *client,
+                            struct wl_resource *resource,
+                            uint32_t id,
+                            struct wl_resource *surface_resource)
+{
+  struct WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+  struct wl_resource *viewport;
+
+  if (surface->viewport)
+    {
+      wl_resource_post_error (resource, WP_VIEWPORTER_ERROR_VIEWPORT_EXISTS,
+                              "a viewport for that surface already exists");
+      return;
+    }
+
+  viewport = wl_resource_create (client, &wp_viewport_interface, wl_resource_get_version (resource), id);
+  wl_resource_set_implementation (viewport, &viewport_interface, surface, wp_viewport_destructor);
+  surface->viewport = viewport;
+}
+
+static const struct wp_viewporter_interface viewporter_interface = {
+  resource_release,
+  wp_viewporter_get_viewport,
+};
+
+static void
+bind_viewporter (struct wl_client *client,
+                 void *data,
+                 uint32_t version,
+                 uint32_t id)
+{
+  WakefieldCompositor *compositor = data;
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &wp_viewporter_interface, version, id);
+  wl_resource_set_implementation (cr, &viewporter_interface, compositor, NULL);
+}
+
+#define WP_VIEWPORTER_VERSION 1
+
+static void
+wakefield_viewporter_init (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  wl_global_create (priv->wl_display, &wp_viewporter_interface,
+                    WP_VIEWPORTER_VERSION, compositor, bind_viewporter);
+}
+
+/* wl_subcompositor lets clients build their window out of several
+ * surfaces, e.g. to put a video on top of a static UI, each with its
+ * own contents and damage. */
+
+static void
+wl_subsurface_set_position (struct wl_client *client,
+                            struct wl_resource *resource,
+                            int32_t x,
+                            int32_t y)
+{
+  struct WakefieldSubsurface *sub = wl_resource_get_user_data (resource);
+
+  if (!sub)
+    return;
+
+  sub->pending_x = x;
+  sub->pending_y = y;
+  sub->has_pending_position = TRUE;
+}
+
+/* Finds the entry for @sibling_resource in the stacking order @sub is
+ * in, or returns NULL if it isn't a sibling or the parent. */
+static struct WakefieldSubsurface *
+get_sibling (struct WakefieldSubsurface *sub,
+             struct wl_resource         *sibling_resource)
+{
+  struct WakefieldSurface *sibling = wl_resource_get_user_data (sibling_resource);
+
+  if (sibling == sub->parent)
+    return &sibling->self;
+
+  if (sibling != sub->surface && sibling->subsurface &&
+      sibling->subsurface->parent == sub->parent)
+    return sibling->subsurface;
+
+  return NULL;
+}
+
+static void
+restack_subsurface (struct wl_resource *resource,
+                    struct wl_resource *sibling_resource,
+                    gboolean            above)
+{
+  struct WakefieldSubsurface *sub = wl_resource_get_user_data (resource);
+  struct WakefieldSubsurface *sibling;
+
+  if (!sub || !sub->parent)
+    return;
+
+  sibling = get_sibling (sub, sibling_resource);
+  if (!sibling)
+    {
+      wl_resource_post_error (resource, WL_SUBSURFACE_ERROR_BAD_SURFACE,
+                              "wl_surface@%d is not a sibling or the parent",
+                              wl_resource_get_id (sibling_resource));
+      return;
+    }
+
+  wl_list_remove (&sub->parent_link_pending);
+  if (above)
+    wl_list_insert (&sibling->parent_link_pending, &sub->parent_link_pending);
+  else
+    wl_list_insert (sibling->parent_link_pending.prev, &sub->parent_link_pending);
+
+  sub->parent->restacked = TRUE;
+}
+
+static void
+wl_subsurface_place_above (struct wl_client *client,
+                           struct wl_resource *resource,
+                           struct wl_resource *sibling_resource)
+{
+  restack_subsurface (resource, sibling_resource, TRUE);
+}
+
+static void
+wl_subsurface_place_below (struct wl_client *client,
+                           struct wl_resource *resource,
+                           struct wl_resource *sibling_resource)
+{
+  restack_subsurface (resource, sibling_resource, FALSE);
+}
+
+static void
+wl_subsurface_set_sync (struct wl_client *client,
+                        struct wl_resource *resource)
+{
+  struct WakefieldSubsurface *sub = wl_resource_get_user_data (resource);
+
+  if (sub)
+    sub->synchronized = TRUE;
+}
+
+static void
+wl_subsurface_set_desync (struct wl_client *client,
+                          struct wl_resource *resource)
+{
+  struct WakefieldSubsurface *sub = wl_resource_get_user_data (resource);
+
+  if (!sub)
+    return;
+
+  sub->synchronized = FALSE;
+
+  /* Whatever was cached gets applied right away, unless an ancestor
+   * keeps us synchronized. */
+  if (sub->has_cache && !subsurface_is_synchronized (sub))
+    {
+      sub->has_cache = FALSE;
+      commit_state (sub->surface, &sub->cached);
+    }
+}
+
+static const struct wl_subsurface_interface subsurface_interface = {
+  resource_release,
+  wl_subsurface_set_position,
+  wl_subsurface_place_above,
+  wl_subsurface_place_below,
+  wl_subsurface_set_sync,
+  wl_subsurface_set_desync,
+};
+
+static void
+wl_subsurface_destructor (struct wl_resource *resource)
+{
+  struct WakefieldSubsurface *sub = wl_resource_get_user_data (resource);
+
+  if (sub)
+    subsurface_destroy (sub);
+}
+
+static void
+wl_subcompositor_get_subsurface (struct wl_client *client,
+                                 struct wl_resource *resource,
+                                 uint32_t id,
+                                 struct wl_resource *surface_resource,
+                                 struct wl_resource *parent_resource)
+{
+  struct WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+  struct WakefieldSurface *parent = wl_resource_get_user_data (parent_resource);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (surface->compositor);
+  struct WakefieldSurface *ancestor;
+  struct WakefieldSubsurface *sub;
+
+  if (surface->subsurface || surface == priv->seat.pointer.cursor_surface)
+    {
+      wl_resource_post_error (resource, WL_SUBCOMPOSITOR_ERROR_BAD_SURFACE,
+                              "wl_surface@%d already has another role",
+                              wl_resource_get_id (surface_resource));
+      return;
+    }
+
+  for (ancestor = parent; ancestor; ancestor = ancestor->subsurface ? ancestor->subsurface->parent : NULL)
+    {
+      if (ancestor == surface)
+        {
+          wl_resource_post_error (resource, WL_SUBCOMPOSITOR_ERROR_BAD_SURFACE,
+                                  "wl_surface@%d can't be a subsurface of itself or its own subsurfaces",
+                                  wl_resource_get_id (surface_resource));
+          return;
+        }
+    }
+
+  sub = g_slice_new0 (struct WakefieldSubsurface);
+  sub->surface = surface;
+  sub->parent = parent;
+  sub->synchronized = TRUE;
+
+  wl_list_init (&sub->cached.frame_callbacks);
+  wl_list_init (&sub->cached.feedback_list);
+  sub->cached.buffer_destroy_listener.notify = surface_state_buffer_destroyed;
+  sub->cached.damage = cairo_region_create ();
+  sub->cached.buffer_damage = cairo_region_create ();
+  sub->cached.transform = -1;
+  unset_viewport (&sub->cached);
+
+  /* New subsurfaces go on top of their siblings. */
+  wl_list_insert (parent->subsurfaces.prev, &sub->parent_link);
+  wl_list_insert (parent->subsurfaces_pending.prev, &sub->parent_link_pending);
+
+  sub->resource = wl_resource_create (client, &wl_subsurface_interface, wl_resource_get_version (resource), id);
+  wl_resource_set_implementation (sub->resource, &subsurface_interface, sub, wl_subsurface_destructor);
+  surface->subsurface = sub;
+
+  /* If the surface we took for the root turned out to be a
+   * subsurface, show the tree it's part of instead. */
+  if (priv->surface == surface)
+    {
+      ancestor = parent;
+      while (ancestor->subsurface && ancestor->subsurface->parent)
+        ancestor = ancestor->subsurface->parent;
+
+      priv->surface = ancestor;
+      update_keyboard_focus (surface->compositor);
+      damage_all (surface->compositor);
+    }
+  else
+    damage_tree (surface);
+}
+
+static const struct wl_subcompositor_interface subcompositor_interface = {
+  resource_release,
+  wl_subcompositor_get_subsurface,
+};
+
+static void
+bind_subcompositor (struct wl_client *client,
+                    void *data,
+                    uint32_t version,
+                    uint32_t id)
+{
+  WakefieldCompositor *compositor = data;
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &wl_subcompositor_interface, version, id);
+  wl_resource_set_implementation (cr, &subcompositor_interface, compositor, NULL);
+}
+
+#define WL_SUBCOMPOSITOR_VERSION 1
+
+static void
+wakefield_subcompositor_init (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  wl_global_create (priv->wl_display, &wl_subcompositor_interface,
+                    WL_SUBCOMPOSITOR_VERSION, compositor, bind_subcompositor);
+}
@@ -0,0 +1,801 @@
+/*
+ * Copyright (C) 2015 Endless Mobile
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * Written by:
+ *     Jasper St. Pierre <jstpierre@mecheye.net>
+ */
+
+/* Messages from the GTK side */
+
+/* Must be a power of two. */
+#define MESSAGE_QUEUE_SIZE 256
+
+/* Takes the frame whose feedback waited on the scene @seq off the
+ * list, if it's still there. */
+static struct WakefieldPresentedFrame *
+take_presented_frame (WakefieldCompositor *compositor,
+                      guint64              seq)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPresentedFrame *frame;
+
+  wl_list_for_each (frame, &priv->presented_frames, link)
+    {
+      if (frame->scene_seq == seq)
+        {
+          wl_list_remove (&frame->link);
+          return frame;
+        }
+    }
+
+  return NULL;
+}
+
+/* Frame callbacks committed before the scene @scene_seq was published
+ * and went out with it. */
+struct WakefieldPublishedCallbacks
+{
+  struct wl_list link;
+  guint64 scene_seq;
+  struct wl_list frame_callbacks;
+};
+
+/* Sends the frame callbacks that went out with scenes up to and
+ * including @seq. Later ones wait for their own scene to get
+ * painted. */
+static void
+send_published_callbacks (WakefieldCompositor *compositor,
+                          guint64              seq,
+                          uint32_t             time)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPublishedCallbacks *published, *tmp;
+  struct wl_resource *cr, *cr_tmp;
+
+  wl_list_for_each_safe (published, tmp, &priv->published_callbacks, link)
+    {
+      if (published->scene_seq > seq)
+        break;
+
+      wl_resource_for_each_safe (cr, cr_tmp, &published->frame_callbacks)
+        {
+          wl_callback_send_done (cr, time);
+          wl_resource_destroy (cr);
+        }
+
+      wl_list_remove (&published->link);
+      g_slice_free (struct WakefieldPublishedCallbacks, published);
+    }
+}
+
+static void
+deliver_message (WakefieldCompositor           *compositor,
+                 const struct WakefieldMessage *message)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPresentedFrame *frame;
+  struct WakefieldSurface *surface;
+
+  mark_needs_flush (compositor);
+
+  switch (message->type)
+    {
+    case WAKEFIELD_MESSAGE_FRAME:
+      /* Nothing was shown, so nothing was presented. */
+      if (message->hidden)
+        {
+          wl_list_for_each (surface, &priv->surfaces, link)
+            discard_feedback_list (&surface->current.feedback_list);
+        }
+      send_published_callbacks (compositor, message->scene_seq, message->time);
+      break;
+    case WAKEFIELD_MESSAGE_PRESENTED:
+    case WAKEFIELD_MESSAGE_DISCARDED:
+      frame = take_presented_frame (compositor, message->scene_seq);
+      if (!frame)
+        break;
+
+      if (message->type == WAKEFIELD_MESSAGE_PRESENTED)
+        {
+          frame->frame_counter = message->frame_counter;
+          send_presented_frame (compositor, frame, message->presentation_time,
+                                message->refresh_interval, message->flags);
+        }
+      else
+        discard_feedback_list (&frame->feedback_list);
+
+      g_slice_free (struct WakefieldPresentedFrame, frame);
+      break;
+    case WAKEFIELD_MESSAGE_KEYBOARD_ENTER:
+    case WAKEFIELD_MESSAGE_KEYBOARD_LEAVE:
+    case WAKEFIELD_MESSAGE_KEYBOARD_KEY:
+      deliver_keyboard_message (compositor, message);
+      break;
+    case WAKEFIELD_MESSAGE_TOUCH_DOWN:
+    case WAKEFIELD_MESSAGE_TOUCH_MOTION:
+    case WAKEFIELD_MESSAGE_TOUCH_UP:
+    case WAKEFIELD_MESSAGE_TOUCH_CANCEL:
+    case WAKEFIELD_MESSAGE_TOUCH_FRAME:
+      deliver_touch_message (compositor, message);
+      break;
+    case WAKEFIELD_MESSAGE_OUTPUT_SCALE:
+      set_output_scale (compositor, message->scale);
+      break;
+    default:
+      deliver_pointer_message (compositor, message);
+      break;
+    }
+}
+
+static void
+drain_messages (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  guint tail = priv->message_tail;
+  guint head = g_atomic_int_get (&priv->message_head);
+
+  while (tail != head)
+    {
+      struct WakefieldMessage message = priv->messages[tail % MESSAGE_QUEUE_SIZE];
+
+      /* Free up the slot before doing anything that might take long. */
+      tail++;
+      g_atomic_int_set (&priv->message_tail, tail);
+
+      deliver_message (compositor, &message);
+    }
+}
+
+static void
+wake_dispatch_thread (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  uint64_t one = 1;
+
+  while (write (priv->wakeup_fd, &one, sizeof (one)) < 0 && errno == EINTR)
+    ;
+}
+
+static int
+dispatch_wakeup (int       fd,
+                 uint32_t  mask,
+                 void     *data)
+{
+  WakefieldCompositor *compositor = data;
+  uint64_t count;
+
+  while (read (fd, &count, sizeof (count)) < 0 && errno == EINTR)
+    ;
+
+  drain_messages (compositor);
+  return 0;
+}
+
+static gboolean
+is_input_message (const struct WakefieldMessage *message)
+{
+  switch (message->type)
+    {
+    case WAKEFIELD_MESSAGE_FRAME:
+    case WAKEFIELD_MESSAGE_PRESENTED:
+    case WAKEFIELD_MESSAGE_DISCARDED:
+    case WAKEFIELD_MESSAGE_OUTPUT_SCALE:
+      return FALSE;
+    default:
+      return TRUE;
+    }
+}
+
+static gboolean
+input_burst_done (gpointer user_data)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (user_data);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  priv->input_burst_id = 0;
+
+  /* Outside of threaded mode, the GSource flushes it all next time
+   * around. */
+  if (priv->threaded)
+    wake_dispatch_thread (compositor);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Hands @message to the Wayland side: straight away, or in threaded
+ * mode, through the queue to the dispatch thread. Input is only sent
+ * on to clients once GDK has no more events for us, so a burst of it
+ * costs a single flush. */
+static void
+queue_message (WakefieldCompositor     *compositor,
+               struct WakefieldMessage *message)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  gboolean input = is_input_message (message);
+  guint head, tail, used;
+
+  /* GDK's events come in at GDK_PRIORITY_EVENTS, so this runs once
+   * they stop coming, which lets small bursts go over together. */
+  if (input && !priv->input_burst_id)
+    priv->input_burst_id = g_idle_add_full (GDK_PRIORITY_EVENTS + 1, input_burst_done,
+                                            compositor, NULL);
+
+  if (!priv->threaded)
+    {
+      deliver_message (compositor, message);
+      return;
+    }
+
+  head = priv->message_head;
+  tail = g_atomic_int_get (&priv->message_tail);
+  used = head - tail;
+
+  /* Rather than wait for the dispatch thread, drop what we can't fit.
+   * Pointer motion is stale by the time a thread this far behind gets
+   * to it anyway, so it only gets the first three quarters, to keep
+   * room for what shouldn't get lost. */
+  if (used == MESSAGE_QUEUE_SIZE ||
+      (message->type == WAKEFIELD_MESSAGE_POINTER_MOTION && used >= MESSAGE_QUEUE_SIZE / 4 * 3))
+    {
+      if (message->type != WAKEFIELD_MESSAGE_POINTER_MOTION)
+        g_warning ("Wayland dispatch thread is stuck, dropping a message");
+      return;
+    }
+
+  priv->messages[head % MESSAGE_QUEUE_SIZE] = *message;
+  g_atomic_int_set (&priv->message_head, head + 1);
+
+  /* A long burst would fill the queue before the idle ever got to
+   * run, so don't wait for it past half full. */
+  if (!input || used + 1 >= MESSAGE_QUEUE_SIZE / 2)
+    wake_dispatch_thread (compositor);
+}
+
+/* Scenes */
+
+static const cairo_user_data_key_t backing_key;
+
+/* Wraps the pixels of a backing store in a surface of GTK's own, so
+ * none of what cairo keeps on the surfaces it paints from is shared
+ * between threads. The wrapper holds a reference on the backing store,
+ * which keeps the dispatch thread from writing to it. */
+static cairo_surface_t *
+wrap_backing (cairo_surface_t *backing)
+{
+  cairo_surface_t *wrapper;
+
+  cairo_surface_flush (backing);
+  wrapper = cairo_image_surface_create_for_data (cairo_image_surface_get_data (backing),
+                                                 cairo_image_surface_get_format (backing),
+                                                 cairo_image_surface_get_width (backing),
+                                                 cairo_image_surface_get_height (backing),
+                                                 cairo_image_surface_get_stride (backing));
+  cairo_surface_set_user_data (wrapper, &backing_key, cairo_surface_reference (backing),
+                               (cairo_destroy_func_t) cairo_surface_destroy);
+  return wrapper;
+}
+
+/* Copies @surface and the subsurfaces shown along with it into @scene,
+ * with the copy of @parent as their parent, as far as drawing them
+ * goes. Returns the copy of @surface, or NULL if it isn't shown. */
+static struct WakefieldSurface *
+copy_surface_tree (struct WakefieldScene   *scene,
+                   struct WakefieldSurface *surface,
+                   struct WakefieldSurface *parent)
+{
+  struct WakefieldSurface *copy;
+  struct WakefieldSubsurface *sub;
+  int width, height;
+
+  if (!surface->backing || !get_surface_size (surface, &width, &height))
+    return NULL;
+
+  copy = g_slice_new0 (struct WakefieldSurface);
+  copy->compositor = surface->compositor;
+  copy->id = surface->id;
+  wl_list_insert (scene->surfaces.prev, &copy->link);
+
+  copy->current.scale = surface->current.scale;
+  copy->current.transform = surface->current.transform;
+  copy->current.src_x = surface->current.src_x;
+  copy->current.src_y = surface->current.src_y;
+  copy->current.src_width = surface->current.src_width;
+  copy->current.src_height = surface->current.src_height;
+  copy->current.dst_width = surface->current.dst_width;
+  copy->current.dst_height = surface->current.dst_height;
+  copy->current.damage = cairo_region_copy (surface->current.damage);
+  copy->current.buffer_damage = cairo_region_copy (surface->current.buffer_damage);
+  copy->current.opaque_region = cairo_region_copy (surface->current.opaque_region);
+  copy->current.input_region = cairo_region_copy (surface->current.input_region);
+  copy->backing = wrap_backing (surface->backing);
+
+  wl_list_init (&copy->subsurfaces);
+  copy->self.surface = copy;
+
+  if (parent)
+    {
+      copy->subsurface = g_slice_new0 (struct WakefieldSubsurface);
+      copy->subsurface->surface = copy;
+      copy->subsurface->parent = parent;
+      copy->subsurface->x = surface->subsurface->x;
+      copy->subsurface->y = surface->subsurface->y;
+      wl_list_insert (parent->subsurfaces.prev, &copy->subsurface->parent_link);
+    }
+
+  wl_list_for_each (sub, &surface->subsurfaces, parent_link)
+    {
+      if (sub->surface == surface)
+        wl_list_insert (copy->subsurfaces.prev, &copy->self.parent_link);
+      else
+        copy_surface_tree (scene, sub->surface, copy);
+    }
+
+  return copy;
+}
+
+static struct WakefieldScene *
+scene_new (guint64 seq)
+{
+  struct WakefieldScene *scene = g_slice_new0 (struct WakefieldScene);
+
+  scene->seq = seq;
+  wl_list_init (&scene->surfaces);
+
+  return scene;
+}
+
+static void
+scene_free (struct WakefieldScene *scene)
+{
+  struct WakefieldSurface *copy, *tmp;
+
+  wl_list_for_each_safe (copy, tmp, &scene->surfaces, link)
+    {
+      cairo_region_destroy (copy->current.damage);
+      cairo_region_destroy (copy->current.buffer_damage);
+      cairo_region_destroy (copy->current.opaque_region);
+      cairo_region_destroy (copy->current.input_region);
+      cairo_surface_destroy (copy->backing);
+      g_clear_pointer (&copy->scaled, cairo_surface_destroy);
+      g_clear_pointer (&copy->scaled_damage, cairo_region_destroy);
+
+      if (copy->subsurface)
+        g_slice_free (struct WakefieldSubsurface, copy->subsurface);
+      g_slice_free (struct WakefieldSurface, copy);
+    }
+
+  g_clear_pointer (&scene->cursor_image, cairo_surface_destroy);
+  g_slice_free (struct WakefieldScene, scene);
+}
+
+static struct WakefieldSurface *
+scene_find_surface (struct WakefieldScene *scene,
+                    guint32                id)
+{
+  struct WakefieldSurface *copy;
+
+  wl_list_for_each (copy, &scene->surfaces, link)
+    {
+      if (copy->id == id)
+        return copy;
+    }
+
+  return NULL;
+}
+
+/* Takes the ready scene, if there is one, leaving nothing in its
+ * place. */
+static struct WakefieldScene *
+take_scene (struct WakefieldScene **slot)
+{
+  struct WakefieldScene *scene;
+
+  do
+    scene = g_atomic_pointer_get (slot);
+  while (scene && !g_atomic_pointer_compare_and_exchange (slot, scene, NULL));
+
+  return scene;
+}
+
+static gboolean consume_scene (gpointer user_data);
+
+/* On the dispatch thread, hands GTK what it needs to show what was
+ * committed since the last scene. */
+static void
+publish_scene (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPresentedFrame *frame = NULL;
+  struct WakefieldPublishedCallbacks *published = NULL;
+  struct WakefieldScene *scene, *stale;
+  struct WakefieldSurface *surface, *copy;
+
+  if (!priv->scene_dirty)
+    return;
+
+  priv->scene_dirty = FALSE;
+
+  /* If GTK hasn't taken the last scene yet, it never will. Its damage
+   * still has to be painted, but its feedback won't be presented. */
+  stale = take_scene (&priv->ready_scene);
+  if (stale)
+    {
+      wl_list_for_each (copy, &stale->surfaces, link)
+        {
+          surface = lookup_surface (compositor, copy->id);
+          if (!surface)
+            continue;
+
+          cairo_region_union (surface->current.damage, copy->current.damage);
+          cairo_region_union (surface->current.buffer_damage, copy->current.buffer_damage);
+        }
+
+      frame = take_presented_frame (compositor, stale->seq);
+      if (frame)
+        {
+          discard_feedback_list (&frame->feedback_list);
+          g_slice_free (struct WakefieldPresentedFrame, frame);
+          frame = NULL;
+        }
+
+      scene_free (stale);
+    }
+
+  scene = scene_new (++priv->scene_seq);
+
+  if (priv->surface)
+    scene->root = copy_surface_tree (scene, priv->surface, NULL);
+
+  wl_list_for_each (surface, &priv->surfaces, link)
+    {
+      /* The scene has it now. */
+      cairo_rectangle_int_t nothing = { 0, 0, 0, 0 };
+      cairo_region_intersect_rectangle (surface->current.damage, &nothing);
+      cairo_region_intersect_rectangle (surface->current.buffer_damage, &nothing);
+
+      /* Its frame callbacks are done once GTK paints this scene, or
+       * one after it. */
+      if (!wl_list_empty (&surface->current.frame_callbacks))
+        {
+          if (!published)
+            {
+              published = g_slice_new0 (struct WakefieldPublishedCallbacks);
+              published->scene_seq = scene->seq;
+              wl_list_init (&published->frame_callbacks);
+              wl_list_insert (priv->published_callbacks.prev, &published->link);
+            }
+
+          wl_list_insert_list (&published->frame_callbacks, &surface->current.frame_callbacks);
+          wl_list_init (&surface->current.frame_callbacks);
+          scene->needs_frame = TRUE;
+        }
+
+      if (wl_list_empty (&surface->current.feedback_list))
+        continue;
+
+      if (!frame)
+        {
+          frame = g_slice_new0 (struct WakefieldPresentedFrame);
+          frame->scene_seq = scene->seq;
+          wl_list_init (&frame->feedback_list);
+          wl_list_insert (priv->presented_frames.prev, &frame->link);
+        }
+
+      wl_list_insert_list (&frame->feedback_list, &surface->current.feedback_list);
+      wl_list_init (&surface->current.feedback_list);
+    }
+
+  /* GTK needs a frame to tell us when the feedback got presented. */
+  scene->has_feedback = frame != NULL;
+  if (scene->has_feedback)
+    scene->needs_frame = TRUE;
+
+  scene->cursor_serial = priv->cursor_serial;
+  scene->cursor_focus = priv->cursor_focus;
+  if (priv->cursor_image)
+    scene->cursor_image = cairo_surface_reference (priv->cursor_image);
+  scene->hotspot_x = priv->seat.pointer.hotspot_x;
+  scene->hotspot_y = priv->seat.pointer.hotspot_y;
+  scene->constraint_serial = priv->constraint_serial;
+  scene->constraint = priv->constraint;
+
+  g_atomic_pointer_set (&priv->ready_scene, scene);
+
+  if (g_atomic_int_compare_and_exchange (&priv->consume_pending, FALSE, TRUE))
+    g_idle_add_full (G_PRIORITY_DEFAULT, consume_scene, g_object_ref (compositor), g_object_unref);
+}
+
+struct WakefieldShownRect
+{
+  guint32 id;
+  cairo_rectangle_int_t rect;
+};
+
+/* Notes where each surface we show is, bottom to top. */
+static GArray *
+get_shown_rects (WakefieldCompositor *compositor)
+{
+  GPtrArray *surfaces = get_surfaces (compositor);
+  GArray *rects;
+  guint i;
+
+  rects = g_array_sized_new (FALSE, FALSE, sizeof (struct WakefieldShownRect), surfaces->len);
+  for (i = 0; i < surfaces->len; i++)
+    {
+      struct WakefieldSurface *surface = g_ptr_array_index (surfaces, i);
+      struct WakefieldShownRect shown;
+
+      shown.id = surface->id;
+      get_content_rect (surface, &shown.rect);
+      g_array_append_val (rects, shown);
+    }
+
+  g_ptr_array_free (surfaces, TRUE);
+  return rects;
+}
+
+static int
+find_shown_rect (GArray  *rects,
+                 guint32  id)
+{
+  guint i;
+
+  for (i = 0; i < rects->len; i++)
+    {
+      if (g_array_index (rects, struct WakefieldShownRect, i).id == id)
+        return i;
+    }
+
+  return -1;
+}
+
+/* Repaints where surfaces moved, showed up, went away or changed
+ * places in the stacking order between @before and @after. */
+static void
+damage_rearranged (WakefieldCompositor *compositor,
+                   GArray              *before,
+                   GArray              *after)
+{
+  cairo_region_t *region = cairo_region_create ();
+  guint i;
+
+  for (i = 0; i < after->len; i++)
+    {
+      struct WakefieldShownRect *shown = &g_array_index (after, struct WakefieldShownRect, i);
+      struct WakefieldShownRect *was = NULL;
+      int j = find_shown_rect (before, shown->id);
+
+      if (j >= 0)
+        {
+          was = &g_array_index (before, struct WakefieldShownRect, j);
+          if ((guint) j == i && memcmp (&was->rect, &shown->rect, sizeof (shown->rect)) == 0)
+            continue;
+
+          cairo_region_union_rectangle (region, &was->rect);
+        }
+
+      cairo_region_union_rectangle (region, &shown->rect);
+    }
+
+  for (i = 0; i < before->len; i++)
+    {
+      struct WakefieldShownRect *was = &g_array_index (before, struct WakefieldShownRect, i);
+
+      if (find_shown_rect (after, was->id) < 0)
+        cairo_region_union_rectangle (region, &was->rect);
+    }
+
+  damage_region (compositor, region);
+  cairo_region_destroy (region);
+}
+
+/* On the GTK side, starts showing the scene the dispatch thread just
+ * made ready. */
+static gboolean
+consume_scene (gpointer user_data)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (user_data);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldScene *scene, *old;
+  struct WakefieldSurface *copy, *old_copy;
+  GArray *before, *after;
+
+  g_atomic_int_set (&priv->consume_pending, FALSE);
+
+  if (!priv->threaded)
+    return G_SOURCE_REMOVE;
+
+  scene = take_scene (&priv->ready_scene);
+  if (!scene)
+    return G_SOURCE_REMOVE;
+
+  old = priv->front_scene;
+
+  /* Whatever we didn't get to draw of the old scene is still damaged,
+   * and the scaled copies stay good as far as they aren't. */
+  wl_list_for_each (copy, &scene->surfaces, link)
+    {
+      old_copy = scene_find_surface (old, copy->id);
+      if (!old_copy)
+        continue;
+
+      cairo_region_union (copy->current.damage, old_copy->current.damage);
+      cairo_region_union (copy->current.buffer_damage, old_copy->current.buffer_damage);
+
+      copy->scaled = old_copy->scaled;
+      copy->scaled_src = old_copy->scaled_src;
+      copy->scaled_damage = old_copy->scaled_damage;
+      old_copy->scaled = NULL;
+      old_copy->scaled_damage = NULL;
+    }
+
+  /* Nothing shows the old scene anymore. */
+  discard_scene_feedback (compositor, old);
+
+  before = get_shown_rects (compositor);
+  priv->front_scene = scene;
+  after = get_shown_rects (compositor);
+
+  damage_rearranged (compositor, before, after);
+  g_array_free (before, TRUE);
+  g_array_free (after, TRUE);
+
+  scene_free (old);
+
+  schedule_draw (compositor);
+
+  if (scene->needs_frame)
+    schedule_frame (compositor);
+
+  if (scene->cursor_serial != priv->shown_cursor_serial)
+    {
+      priv->shown_cursor_serial = scene->cursor_serial;
+      show_cursor (compositor, scene->cursor_focus,
+                   scene->cursor_image ? cairo_surface_reference (scene->cursor_image) : NULL,
+                   scene->hotspot_x, scene->hotspot_y);
+    }
+
+  if (scene->constraint_serial != priv->shown_constraint_serial)
+    {
+      priv->shown_constraint_serial = scene->constraint_serial;
+      show_constraint (compositor, &scene->constraint);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+/* The dispatch thread */
+
+static gpointer
+dispatch_thread_main (gpointer data)
+{
+  WakefieldCompositor *compositor = data;
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_event_loop *loop = wl_display_get_event_loop (priv->wl_display);
+
+  while (!g_atomic_int_get (&priv->dispatch_quit))
+    {
+      publish_scene (compositor);
+      wl_display_flush_clients (priv->wl_display);
+      wl_event_loop_dispatch (loop, -1);
+    }
+
+  return NULL;
+}
+
+static void
+start_dispatch_thread (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_event_loop *loop = wl_display_get_event_loop (priv->wl_display);
+  struct WakefieldSurface *surface;
+
+  /* From now on, GTK only paints from backing stores. */
+  wl_list_for_each (surface, &priv->surfaces, link)
+    {
+      struct WakefieldBuffer *buffer = surface->current.buffer;
+
+      if (buffer && !surface->backing)
+        {
+          cairo_region_t *damage = cairo_region_create ();
+
+          snapshot_buffer (surface, buffer, damage);
+          cairo_region_destroy (damage);
+
+          wakefield_buffer_release (buffer);
+          surface_state_set_buffer (&surface->current, NULL);
+        }
+    }
+
+  /* GTK won't be telling us about those frames anymore. */
+  flush_presented_frames (compositor, NULL);
+
+  g_source_destroy (priv->event_source);
+  g_clear_pointer (&priv->event_source, g_source_unref);
+
+  /* Drops the scaled copies too, which only scenes keep from now on. */
+  damage_all (compositor);
+
+  priv->messages = g_new0 (struct WakefieldMessage, MESSAGE_QUEUE_SIZE);
+  priv->message_head = priv->message_tail = 0;
+  priv->wakeup_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  priv->wakeup_source = wl_event_loop_add_fd (loop, priv->wakeup_fd, WL_EVENT_READABLE,
+                                              dispatch_wakeup, compositor);
+
+  priv->front_scene = scene_new (0);
+  priv->shown_cursor_serial = priv->cursor_serial;
+
+  priv->threaded = TRUE;
+  priv->gtk_thread = g_thread_self ();
+  priv->scene_dirty = TRUE;
+  wl_list_init (&priv->published_callbacks);
+  update_cursor (compositor);
+
+  priv->dispatch_quit = FALSE;
+  priv->dispatch_thread = g_thread_new ("wakefield-dispatch", dispatch_thread_main, compositor);
+}
+
+static void
+stop_dispatch_thread (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldScene *scene;
+  struct WakefieldSurface *surface;
+  struct WakefieldPresentedFrame *frame, *tmp;
+
+  g_atomic_int_set (&priv->dispatch_quit, TRUE);
+  wake_dispatch_thread (compositor);
+  g_thread_join (priv->dispatch_thread);
+  priv->dispatch_thread = NULL;
+
+  /* Say what's left to say about the scenes, and deliver everything
+   * the thread didn't get to ourselves. */
+  flush_timed_scenes (compositor, NULL);
+  discard_scene_feedback (compositor, priv->front_scene);
+  drain_messages (compositor);
+
+  /* No one is going to paint the scenes those went out with. */
+  send_published_callbacks (compositor, G_MAXUINT64, g_get_monotonic_time () / 1000);
+
+  wl_event_source_remove (priv->wakeup_source);
+  priv->wakeup_source = NULL;
+  close (priv->wakeup_fd);
+  priv->wakeup_fd = -1;
+  g_clear_pointer (&priv->messages, g_free);
+
+  priv->threaded = FALSE;
+
+  scene = take_scene (&priv->ready_scene);
+  if (scene)
+    scene_free (scene);
+  g_clear_pointer (&priv->front_scene, scene_free);
+  g_clear_pointer (&priv->cursor_image, cairo_surface_destroy);
+
+  /* Nothing shows the backing stores but us now. */
+  wl_list_for_each (surface, &priv->surfaces, link)
+    clear_spare_backings (surface);
+
+  /* That leaves feedback for scenes GTK never took, which were never
+   * shown. */
+  wl_list_for_each_safe (frame, tmp, &priv->presented_frames, link)
+    {
+      discard_feedback_list (&frame->feedback_list);
+      wl_list_remove (&frame->link);
+      g_slice_free (struct WakefieldPresentedFrame, frame);
+    }
+}
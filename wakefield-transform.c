@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2015 Endless Mobile
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * Written by:
+ *     Jasper St. Pierre <jstpierre@mecheye.net>
+ */
+
+/* Buffer transforms. Rather than have cairo resample through a
+ * rotated matrix on every draw, the damaged parts of a transformed
+ * buffer are rotated into our backing store once, on commit. */
+
+static gboolean
+wakefield_transform_is_valid (int32_t transform)
+{
+  return transform >= WL_OUTPUT_TRANSFORM_NORMAL &&
+         transform <= WL_OUTPUT_TRANSFORM_FLIPPED_270;
+}
+
+static gboolean
+wakefield_transform_swaps_axes (enum wl_output_transform transform)
+{
+  return transform == WL_OUTPUT_TRANSFORM_90 ||
+         transform == WL_OUTPUT_TRANSFORM_270 ||
+         transform == WL_OUTPUT_TRANSFORM_FLIPPED_90 ||
+         transform == WL_OUTPUT_TRANSFORM_FLIPPED_270;
+}
+
+/* The transform that undoes @transform. The flipped ones are their
+ * own inverse. */
+static enum wl_output_transform
+wakefield_transform_invert (enum wl_output_transform transform)
+{
+  switch (transform)
+    {
+    case WL_OUTPUT_TRANSFORM_90:
+      return WL_OUTPUT_TRANSFORM_270;
+    case WL_OUTPUT_TRANSFORM_270:
+      return WL_OUTPUT_TRANSFORM_90;
+    default:
+      return transform;
+    }
+}
+
+/* Maps @rect, inside a @width by @height area, to where it ends up
+ * once the area is transformed. */
+static void
+wakefield_transform_rect (enum wl_output_transform  transform,
+                          int                       width,
+                          int                       height,
+                          cairo_rectangle_int_t    *rect)
+{
+  cairo_rectangle_int_t r = *rect;
+
+  switch (transform)
+    {
+    case WL_OUTPUT_TRANSFORM_NORMAL:
+    default:
+      break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED:
+      rect->x = width - r.x - r.width;
+      break;
+    case WL_OUTPUT_TRANSFORM_90:
+      rect->x = r.y;
+      rect->y = width - r.x - r.width;
+      break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+      rect->x = height - r.y - r.height;
+      rect->y = width - r.x - r.width;
+      break;
+    case WL_OUTPUT_TRANSFORM_180:
+      rect->x = width - r.x - r.width;
+      rect->y = height - r.y - r.height;
+      break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+      rect->y = height - r.y - r.height;
+      break;
+    case WL_OUTPUT_TRANSFORM_270:
+      rect->x = height - r.y - r.height;
+      rect->y = r.x;
+      break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+      rect->x = r.y;
+      rect->y = r.x;
+      break;
+    }
+
+  if (wakefield_transform_swaps_axes (transform))
+    {
+      rect->width = r.height;
+      rect->height = r.width;
+    }
+}
+
+/* Where source pixel (x, y) of a @width by @height buffer lands in
+ * the transformed destination is origin + x * step_x + y * step_y,
+ * counted in pixels. */
+static void
+wakefield_transform_get_steps (enum wl_output_transform  transform,
+                               int                       width,
+                               int                       height,
+                               int                       dst_stride,
+                               ptrdiff_t                *origin,
+                               ptrdiff_t                *step_x,
+                               ptrdiff_t                *step_y)
+{
+  cairo_rectangle_int_t corner = { 0, 0, 1, 1 };
+
+  wakefield_transform_rect (transform, width, height, &corner);
+  *origin = (ptrdiff_t) corner.y * dst_stride + corner.x;
+
+  switch (transform)
+    {
+    case WL_OUTPUT_TRANSFORM_NORMAL:
+    default:
+      *step_x = 1;
+      *step_y = dst_stride;
+      break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED:
+      *step_x = -1;
+      *step_y = dst_stride;
+      break;
+    case WL_OUTPUT_TRANSFORM_90:
+      *step_x = -dst_stride;
+      *step_y = 1;
+      break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+      *step_x = -dst_stride;
+      *step_y = -1;
+      break;
+    case WL_OUTPUT_TRANSFORM_180:
+      *step_x = -1;
+      *step_y = -dst_stride;
+      break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+      *step_x = 1;
+      *step_y = -dst_stride;
+      break;
+    case WL_OUTPUT_TRANSFORM_270:
+      *step_x = dst_stride;
+      *step_y = -1;
+      break;
+    case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+      *step_x = dst_stride;
+      *step_y = 1;
+      break;
+    }
+}
+
+/* The 32-bit kernels work on tiles small enough that both the rows
+ * we read and the columns we write stay in L1. */
+#define TRANSFORM_TILE_SIZE 32
+
+/* Copies @n pixels from @src to @dst, @dst_end, @dst_end - 1 and so
+ * on, for the transforms that mirror rows. */
+static void
+reverse_row (uint32_t       *dst_end,
+             const uint32_t *src,
+             int             n)
+{
+  int i = 0;
+
+#if defined (__SSE2__)
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_si128 ((__m128i *) (dst_end - i - 3),
+                      _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) (src + i)),
+                                         _MM_SHUFFLE (0, 1, 2, 3)));
+#elif defined (__ARM_NEON)
+  for (; i + 4 <= n; i += 4)
+    {
+      uint32x4_t v = vrev64q_u32 (vld1q_u32 (src + i));
+      vst1q_u32 (dst_end - i - 3, vcombine_u32 (vget_high_u32 (v), vget_low_u32 (v)));
+    }
+#endif
+
+  for (; i < n; i++)
+    dst_end[-i] = src[i];
+}
+
+/* Writes a 4x4 block for the transforms that swap axes, where one
+ * step is a whole destination row and the other is one pixel either
+ * way: source column i becomes four neighbouring pixels starting at
+ * @dst + i * @step_x. */
+static inline void
+transpose_block_4x4 (uint32_t       *dst,
+                     ptrdiff_t       step_x,
+                     ptrdiff_t       step_y,
+                     const uint32_t *src,
+                     int             src_stride)
+{
+#if defined (__SSE2__)
+  __m128i r0 = _mm_loadu_si128 ((const __m128i *) (src + 0 * src_stride));
+  __m128i r1 = _mm_loadu_si128 ((const __m128i *) (src + 1 * src_stride));
+  __m128i r2 = _mm_loadu_si128 ((const __m128i *) (src + 2 * src_stride));
+  __m128i r3 = _mm_loadu_si128 ((const __m128i *) (src + 3 * src_stride));
+  __m128i t0 = _mm_unpacklo_epi32 (r0, r1);
+  __m128i t1 = _mm_unpacklo_epi32 (r2, r3);
+  __m128i t2 = _mm_unpackhi_epi32 (r0, r1);
+  __m128i t3 = _mm_unpackhi_epi32 (r2, r3);
+  __m128i c[4];
+  int i;
+
+  c[0] = _mm_unpacklo_epi64 (t0, t1);
+  c[1] = _mm_unpackhi_epi64 (t0, t1);
+  c[2] = _mm_unpacklo_epi64 (t2, t3);
+  c[3] = _mm_unpackhi_epi64 (t2, t3);
+
+  for (i = 0; i < 4; i++)
+    {
+      if (step_y > 0)
+        _mm_storeu_si128 ((__m128i *) (dst + i * step_x), c[i]);
+      else
+        _mm_storeu_si128 ((__m128i *) (dst + i * step_x - 3),
+                          _mm_shuffle_epi32 (c[i], _MM_SHUFFLE (0, 1, 2, 3)));
+    }
+#elif defined (__ARM_NEON)
+  uint32x4x2_t t01 = vtrnq_u32 (vld1q_u32 (src + 0 * src_stride), vld1q_u32 (src + 1 * src_stride));
+  uint32x4x2_t t23 = vtrnq_u32 (vld1q_u32 (src + 2 * src_stride), vld1q_u32 (src + 3 * src_stride));
+  uint32x4_t c[4];
+  int i;
+
+  c[0] = vcombine_u32 (vget_low_u32 (t01.val[0]), vget_low_u32 (t23.val[0]));
+  c[1] = vcombine_u32 (vget_low_u32 (t01.val[1]), vget_low_u32 (t23.val[1]));
+  c[2] = vcombine_u32 (vget_high_u32 (t01.val[0]), vget_high_u32 (t23.val[0]));
+  c[3] = vcombine_u32 (vget_high_u32 (t01.val[1]), vget_high_u32 (t23.val[1]));
+
+  for (i = 0; i < 4; i++)
+    {
+      if (step_y > 0)
+        vst1q_u32 (dst + i * step_x, c[i]);
+      else
+        {
+          uint32x4_t v = vrev64q_u32 (c[i]);
+          vst1q_u32 (dst + i * step_x - 3, vcombine_u32 (vget_high_u32 (v), vget_low_u32 (v)));
+        }
+    }
+#else
+  int x, y;
+
+  for (y = 0; y < 4; y++)
+    for (x = 0; x < 4; x++)
+      dst[x * step_x + y * step_y] = src[y * src_stride + x];
+#endif
+}
+
+static void
+transform_tile_32 (uint32_t       *dst,
+                   ptrdiff_t       step_x,
+                   ptrdiff_t       step_y,
+                   const uint32_t *src,
+                   int             src_stride,
+                   int             width,
+                   int             height)
+{
+  int x, y;
+
+  if (step_x == 1 || step_x == -1)
+    {
+      for (y = 0; y < height; y++, src += src_stride, dst += step_y)
+        {
+          if (step_x > 0)
+            memcpy (dst, src, width * 4);
+          else
+            reverse_row (dst, src, width);
+        }
+      return;
+    }
+
+  for (y = 0; y + 4 <= height; y += 4)
+    {
+      for (x = 0; x + 4 <= width; x += 4)
+        transpose_block_4x4 (dst + x * step_x + y * step_y, step_x, step_y,
+                             src + y * src_stride + x, src_stride);
+
+      for (; x < width; x++)
+        {
+          int i;
+
+          for (i = 0; i < 4; i++)
+            dst[x * step_x + (y + i) * step_y] = src[(y + i) * src_stride + x];
+        }
+    }
+
+  for (; y < height; y++)
+    for (x = 0; x < width; x++)
+      dst[x * step_x + y * step_y] = src[y * src_stride + x];
+}
+
+/* Copies @rect out of a @width by @height buffer in @format, like
+ * wakefield_format_copy_rect, to where @transform puts it in @dst. */
+static void
+wakefield_transform_copy_rect (const struct WakefieldFormat *format,
+                               enum wl_output_transform      transform,
+                               uint8_t                      *dst,
+                               int                           dst_stride,
+                               const uint8_t                *src,
+                               int                           src_stride,
+                               int                           width,
+                               int                           height,
+                               cairo_rectangle_int_t        *rect)
+{
+  int bpp = format->bytes_per_pixel;
+  ptrdiff_t origin, step_x, step_y;
+  int tx, ty;
+
+  if (transform == WL_OUTPUT_TRANSFORM_NORMAL)
+    {
+      wakefield_format_copy_rect (format, dst, dst_stride, src, src_stride, rect);
+      return;
+    }
+
+  wakefield_transform_get_steps (transform, width, height, dst_stride / bpp,
+                                 &origin, &step_x, &step_y);
+
+  /* None of the 16-bit formats need converting, and they're rare
+   * enough that a plain loop will do. */
+  if (bpp == 2)
+    {
+      uint16_t *d = (uint16_t *) dst + origin;
+      int x, y;
+
+      for (y = rect->y; y < rect->y + rect->height; y++)
+        {
+          const uint16_t *s = (const uint16_t *) (src + y * src_stride);
+
+          for (x = rect->x; x < rect->x + rect->width; x++)
+            d[x * step_x + y * step_y] = s[x];
+        }
+      return;
+    }
+
+  for (ty = rect->y; ty < rect->y + rect->height; ty += TRANSFORM_TILE_SIZE)
+    for (tx = rect->x; tx < rect->x + rect->width; tx += TRANSFORM_TILE_SIZE)
+      {
+        uint32_t tile[TRANSFORM_TILE_SIZE * TRANSFORM_TILE_SIZE];
+        int tw = MIN (TRANSFORM_TILE_SIZE, rect->x + rect->width - tx);
+        int th = MIN (TRANSFORM_TILE_SIZE, rect->y + rect->height - ty);
+        const uint32_t *s = (const uint32_t *) (src + ty * src_stride) + tx;
+        int s_stride = src_stride / 4;
+
+        if (format->conversion != WAKEFIELD_CONVERSION_NONE)
+          {
+            int y;
+
+            for (y = 0; y < th; y++)
+              convert_row (format->conversion, tile + y * TRANSFORM_TILE_SIZE,
+                           s + y * s_stride, tw);
+
+            s = tile;
+            s_stride = TRANSFORM_TILE_SIZE;
+          }
+
+        transform_tile_32 ((uint32_t *) dst + origin + tx * step_x + ty * step_y,
+                           step_x, step_y, s, s_stride, tw, th);
+      }
+}
+
+#undef TRANSFORM_TILE_SIZE